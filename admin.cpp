@@ -0,0 +1,235 @@
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "err.h"
+#include "admin.h"
+
+#define ADMIN_EVENTS 16
+
+using namespace std;
+
+AdminConsole::~AdminConsole() {
+    if (this->epoll_fd == -1) return;
+    for (int i = 0; i < (int)this->connections.size(); i++) this->close_connection(i);
+    close(this->listener);
+    close(this->epoll_fd);
+    ::unlink(this->path.c_str());
+}
+
+void AdminConsole::open(const string &path) {
+    this->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (this->listener < 0) syserr("cannot create a socket");
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof address.sun_path) fatal("Socket path %s is too long", path.c_str());
+    strcpy(address.sun_path, path.c_str());
+    ::unlink(path.c_str());
+    if (bind(this->listener, (struct sockaddr *) &address, (socklen_t) sizeof address) < 0) syserr("bind");
+    if (listen(this->listener, ADMIN_CONNECTIONS) < 0) syserr("listen");
+    fcntl(this->listener, F_SETFL, O_NONBLOCK);
+    this->path = path;
+
+    this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epoll_fd < 0) syserr("epoll_create1");
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u32 = 0;
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->listener, &event) < 0) syserr("epoll_ctl");
+}
+
+void AdminConsole::serve() {
+    epoll_event events[ADMIN_EVENTS];
+    int count = epoll_wait(this->epoll_fd, events, ADMIN_EVENTS, 0);
+    if (count < 0 && errno != EINTR) syserr("epoll_wait");
+    for (int k = 0; k < count; k++) {
+        //Connections are numbered from 1, 0 is the listener
+        int connection = (int)events[k].data.u32 - 1;
+        if (connection == -1) {
+            this->accept_connection();
+            continue;
+        }
+        if (this->connections[connection].fd == -1) continue;
+        if (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) this->read_connection(connection);
+    }
+}
+
+void AdminConsole::accept_connection() {
+    while (true) {
+        int fd = accept4(this->listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        int connection = 0;
+        while (connection < (int)this->connections.size() && this->connections[connection].fd != -1) connection++;
+        if (connection == ADMIN_CONNECTIONS) {
+            close(fd);
+            continue;
+        }
+        if (connection == (int)this->connections.size()) this->connections.emplace_back();
+        AdminConnection &c = this->connections[connection];
+        c.fd = fd;
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u32 = connection + 1;
+        if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) syserr("epoll_ctl");
+    }
+}
+
+void AdminConsole::read_connection(int connection) {
+    AdminConnection &c = this->connections[connection];
+    char buffer[ADMIN_LINE];
+    ssize_t length = read(c.fd, buffer, sizeof buffer);
+    if (length < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    //Gone, or sending more than a few commands without reading the answers
+    if (length <= 0 || c.input.size() + length > 4 * ADMIN_LINE) {
+        this->close_connection(connection);
+        return;
+    }
+    c.input.append(buffer, length);
+}
+
+void AdminConsole::close_connection(int connection) {
+    AdminConnection &c = this->connections[connection];
+    if (c.fd == -1) return;
+    close(c.fd);
+    //Keeps the snapshot's storage for the next operator
+    c.fd = -1;
+    c.input.clear();
+    c.output.clear();
+    c.output_offset = 0;
+    c.listing = false;
+    c.writing = false;
+}
+
+bool AdminConsole::next_command(int &connection, string &command) {
+    for (int i = 0; i < (int)this->connections.size(); i++) {
+        AdminConnection &c = this->connections[i];
+        if (c.fd == -1 || c.listing) continue;
+        size_t end = c.input.find('\n');
+        if (end == string::npos) continue;
+        command.assign(c.input, 0, end);
+        if (!command.empty() && command.back() == '\r') command.pop_back();
+        c.input.erase(0, end + 1);
+        connection = i;
+        return true;
+    }
+    return false;
+}
+
+void AdminConsole::reply(int connection, string_view line) {
+    AdminConnection &c = this->connections[connection];
+    c.output.append(line);
+    c.output += "\nEND\n";
+}
+
+AdminSnapshot &AdminConsole::list(int connection) {
+    AdminConnection &c = this->connections[connection];
+    c.snapshot.tables.clear();
+    c.snapshot.clients.clear();
+    c.next_table = 0;
+    c.next_client = 0;
+    c.listing = true;
+    return c.snapshot;
+}
+
+void AdminConsole::format_slice(AdminConnection &c) {
+    const char *seats = "NESW";
+    const char *queues[5] = {"N", "E", "S", "W", "any"};
+    char line[192];
+    for (int rows = 0; rows < ADMIN_SLICE && c.output.size() - c.output_offset < ADMIN_WRITE_SIZE; rows++) {
+        int length;
+        if (c.next_table < c.snapshot.tables.size()) {
+            const AdminTable &t = c.snapshot.tables[c.next_table++];
+            length = snprintf(line, sizeof line, "table %d game %d phase %d round %d", t.table, t.number, t.phase,
+                              t.round);
+            if (t.phase == 1) {
+                length += snprintf(line + length, sizeof line - length, " trick %d cards %d", t.trick_number,
+                                   t.cards_on_table);
+            }
+            else length += snprintf(line + length, sizeof line - length, " trick - cards -");
+            //A table stands still while a seat is empty, between deals it waits for the deal stream
+            if (t.connected_clients != 4) length += snprintf(line + length, sizeof line - length, " waiting seats");
+            else if (t.phase == 0) length += snprintf(line + length, sizeof line - length, " waiting deal");
+            else if (t.phase == 1) {
+                length += snprintf(line + length, sizeof line - length, " waiting %c", seats[t.current_player]);
+            }
+            else length += snprintf(line + length, sizeof line - length, " waiting -");
+            for (int i = 0; i < 4; i++) {
+                if (t.bots[i]) length += snprintf(line + length, sizeof line - length, " %c=bot", seats[i]);
+                else if (t.seats[i] == 0) length += snprintf(line + length, sizeof line - length, " %c=-", seats[i]);
+                else length += snprintf(line + length, sizeof line - length, " %c=%d", seats[i], t.seats[i]);
+            }
+        }
+        else if (c.next_client < c.snapshot.clients.size()) {
+            const AdminClient &client = c.snapshot.clients[c.next_client++];
+            char address[INET6_ADDRSTRLEN] = "unix";
+            if (!client.unix_peer && inet_ntop(AF_INET6, &client.address, address, sizeof address) == nullptr) {
+                syserr("inet_ntop");
+            }
+            length = snprintf(line, sizeof line, "client %d %s:%u table ", client.slot, address, client.port);
+            if (client.table == -1) length += snprintf(line + length, sizeof line - length, "-");
+            else length += snprintf(line + length, sizeof line - length, "%d", client.table);
+            length += snprintf(line + length, sizeof line - length, " seat %c queue %s read %u write %u pending %lld",
+                               client.place == -1 ? '-' : seats[(int)client.place],
+                               client.queue == -1 ? "-" : queues[(int)client.queue],
+                               client.read_size, client.write_size, (long long)client.pending);
+            if (client.binary) length += snprintf(line + length, sizeof line - length, " binary");
+            if (client.congested) length += snprintf(line + length, sizeof line - length, " congested");
+            if (client.disconnect) length += snprintf(line + length, sizeof line - length, " disconnecting");
+        }
+        else {
+            c.output += "END\n";
+            c.listing = false;
+            return;
+        }
+        c.output.append(line, min(length, (int)sizeof line - 1));
+        c.output += '\n';
+    }
+}
+
+void AdminConsole::flush() {
+    for (int i = 0; i < (int)this->connections.size(); i++) {
+        AdminConnection &c = this->connections[i];
+        if (c.fd == -1) continue;
+        if (c.listing) this->format_slice(c);
+        while (c.output_offset < c.output.size()) {
+            //MSG_NOSIGNAL: an operator closing the console early must not take the server down
+            ssize_t length = send(c.fd, c.output.data() + c.output_offset, c.output.size() - c.output_offset, MSG_NOSIGNAL);
+            if (length < 0 && errno == EINTR) continue;
+            if (length < 0 && errno != EAGAIN) {
+                this->close_connection(i);
+                break;
+            }
+            if (length <= 0) break;
+            c.output_offset += length;
+        }
+        if (c.fd == -1) continue;
+        if (c.output_offset == c.output.size()) {
+            c.output.clear();
+            c.output_offset = 0;
+        }
+        this->watch(i);
+    }
+}
+
+// Asks for EPOLLOUT while output is queued, a listing is unfinished or a
+// command waits behind one, which brings the game loop back for the next
+// slice or command as soon as the answer can go out.
+void AdminConsole::watch(int connection) {
+    AdminConnection &c = this->connections[connection];
+    bool writing = c.listing || !c.output.empty() || c.input.find('\n') != string::npos;
+    if (writing == c.writing) return;
+    c.writing = writing;
+    epoll_event event = {};
+    event.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.u32 = connection + 1;
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, c.fd, &event) < 0) syserr("epoll_ctl");
+}
@@ -0,0 +1,103 @@
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <netinet/in.h>
+
+#ifndef MIM_ADMIN_H
+#define MIM_ADMIN_H
+
+// Listings are formatted ADMIN_SLICE rows at a time and only while less
+// than ADMIN_WRITE_SIZE bytes wait for the operator, so a long or slowly
+// read answer costs the game loop a bounded amount per iteration.
+#define ADMIN_SLICE        256
+#define ADMIN_WRITE_SIZE   65536
+#define ADMIN_LINE         256
+#define ADMIN_CONNECTIONS  8
+
+struct AdminTable {
+    int table;
+    int number;
+    int phase;
+    int round;
+    int trick_number;
+    int current_player;
+    int connected_clients;
+    int cards_on_table;
+    // Client slot in every seat, 0 when empty.
+    int seats[4];
+    bool bots[4];
+};
+
+struct AdminClient {
+    int slot;
+    in6_addr address;
+    uint16_t port;
+    bool unix_peer;
+    int8_t place;
+    int8_t queue;
+    bool binary;
+    bool congested;
+    bool disconnect;
+    int table;
+    uint32_t read_size;
+    uint32_t write_size;
+    int64_t pending;
+};
+
+// Copy of the game taken between two iterations of its loop, so a listing
+// is consistent however long it takes to send.
+struct AdminSnapshot {
+    std::vector<AdminTable> tables;
+    std::vector<AdminClient> clients;
+};
+
+struct AdminConnection {
+    int fd = -1;
+    std::string input;
+    std::string output;
+    size_t output_offset = 0;
+    // Rows of the snapshot still to be formatted.
+    AdminSnapshot snapshot;
+    size_t next_table = 0;
+    size_t next_client = 0;
+    bool listing = false;
+    // EPOLLOUT is asked for, while there is something to write, to format or to answer.
+    bool writing = false;
+};
+
+// Operator commands on a local Unix socket, one per line. The listener
+// and the connections sit behind a single epoll fd, which is all the game
+// loop polls; the game answers commands itself, nothing here touches it.
+class AdminConsole {
+public:
+    AdminConsole() = default;
+    AdminConsole(const AdminConsole &) = delete;
+    AdminConsole &operator=(const AdminConsole &) = delete;
+    ~AdminConsole();
+    void open(const std::string &path);
+    int fd() const { return this->epoll_fd; }
+    // Accepts and reads whatever is ready without blocking.
+    void serve();
+    // Next command of a connection which is not in the middle of a listing.
+    bool next_command(int &connection, std::string &command);
+    // Answers with one line.
+    void reply(int connection, std::string_view line);
+    // Answers with the rows of a snapshot, which the caller fills.
+    AdminSnapshot &list(int connection);
+    // Formats a slice of every listing and writes what the sockets take.
+    void flush();
+private:
+    int epoll_fd = -1;
+    int listener = -1;
+    std::string path;
+    std::vector<AdminConnection> connections;
+    void accept_connection();
+    void read_connection(int connection);
+    void close_connection(int connection);
+    void format_slice(AdminConnection &c);
+    void watch(int connection);
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifdef ALLOC_STATS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+#include "alloc.h"
+
+static const char *tag_names[ALLOC_TAGS] = {
+    "other", "read", "IAM", "TRICK in", "DEAL", "TRICK out", "TAKEN", "WRONG", "SCORE/TOTAL"
+};
+
+static thread_local int current_tag = ALLOC_OTHER;
+static std::atomic<uint64_t> messages[ALLOC_TAGS];
+static std::atomic<uint64_t> allocations[ALLOC_TAGS];
+static std::atomic<uint64_t> allocated_bytes[ALLOC_TAGS];
+static std::atomic<bool> warmed_up;
+
+void alloc_begin(int tag) {
+    current_tag = tag;
+    messages[tag].fetch_add(1, std::memory_order_relaxed);
+}
+
+void alloc_end() {
+    current_tag = ALLOC_OTHER;
+}
+
+void alloc_warmed_up() {
+    if (warmed_up.exchange(true)) return;
+    for (int i = 0; i < ALLOC_TAGS; i++) {
+        messages[i].store(0, std::memory_order_relaxed);
+        allocations[i].store(0, std::memory_order_relaxed);
+        allocated_bytes[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void alloc_report() {
+    fprintf(stderr, "%-12s %10s %12s %14s %10s\n", "type", "messages", "allocations", "bytes", "per msg");
+    for (int i = 0; i < ALLOC_TAGS; i++) {
+        uint64_t count = messages[i].load(std::memory_order_relaxed);
+        uint64_t allocs = allocations[i].load(std::memory_order_relaxed);
+        fprintf(stderr, "%-12s %10lu %12lu %14lu %10.3f\n", tag_names[i], count, allocs,
+                allocated_bytes[i].load(std::memory_order_relaxed), count ? (double)allocs / count : 0.0);
+    }
+}
+
+static void *counted_alloc(size_t size) {
+    allocations[current_tag].fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes[current_tag].fetch_add(size, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+// aligned_alloc wants a size that is a multiple of the alignment.
+static void *counted_aligned_alloc(size_t size, std::align_val_t alignment) {
+    size_t align = (size_t)alignment;
+    allocations[current_tag].fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes[current_tag].fetch_add(size, std::memory_order_relaxed);
+    void *p = aligned_alloc(align, size ? (size + align - 1) / align * align : align);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(size_t size) {
+    return counted_alloc(size);
+}
+
+void *operator new[](size_t size) {
+    return counted_alloc(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return counted_alloc(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return counted_alloc(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    return counted_aligned_alloc(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+    return counted_aligned_alloc(size, alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    try {
+        return counted_aligned_alloc(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    try {
+        return counted_aligned_alloc(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef MIM_ALLOC_H
+#define MIM_ALLOC_H
+
+// Allocation counting, enabled by building with ALLOC_STATS=1.
+// Allocations are attributed to the message type being handled.
+// ALLOC_WARMED_UP() starts the counts over the first time it is called,
+// so buffers growing to their size in the first deal are left out.
+enum AllocTag {
+    ALLOC_OTHER,
+    ALLOC_READ,
+    ALLOC_IAM,
+    ALLOC_TRICK_IN,
+    ALLOC_DEAL,
+    ALLOC_TRICK_OUT,
+    ALLOC_TAKEN,
+    ALLOC_WRONG,
+    ALLOC_SCORE,
+    ALLOC_TAGS
+};
+
+#ifdef ALLOC_STATS
+void alloc_begin(int tag);
+void alloc_end();
+void alloc_warmed_up();
+void alloc_report();
+#define ALLOC_BEGIN(tag)   alloc_begin(tag)
+#define ALLOC_END()        alloc_end()
+#define ALLOC_WARMED_UP()  alloc_warmed_up()
+#define ALLOC_REPORT()     alloc_report()
+#else
+#define ALLOC_BEGIN(tag)
+#define ALLOC_END()
+#define ALLOC_WARMED_UP()
+#define ALLOC_REPORT()
+#endif
+
+#endif
@@ -0,0 +1,234 @@
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "err.h"
+#include "deals.h"
+#include "batch.h"
+
+#define INLINE inline __attribute__((always_inline))
+
+//Kernels are inlined into their callers, vectors never cross a call
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+using namespace std;
+
+typedef int16_t Lanes16 __attribute__((vector_size(16 * sizeof(int16_t))));
+typedef int16_t Lanes8 __attribute__((vector_size(8 * sizeof(int16_t))));
+typedef int16_t Lane __attribute__((vector_size(sizeof(int16_t))));
+
+// The kernels are written once for vectors of 16 games (AVX2), 8 games
+// (SSE2, the x86-64 baseline) and a vector of one: comparisons give masks
+// of all ones or zeros and choices are made with and/or, so the scalar
+// kernels run exactly the same code. Loops over seats, suits and slots are
+// unrolled, which turns the values they are compared with into constants.
+template <typename V> INLINE V splat(int value) {
+    V result;
+    #pragma GCC unroll 16
+    for (size_t i = 0; i < sizeof result / sizeof(int16_t); i++) result[i] = value;
+    return result;
+}
+template <typename V> INLINE V is_equal(const V &a, const V &b) { return (V)(a == b); }
+template <typename V> INLINE V is_greater(const V &a, const V &b) { return (V)(a > b); }
+
+// Vectors never cross a tile, BATCH_TILE is a multiple of 16.
+template <typename V> INLINE V load(BatchColumns &c, int column, int game) {
+    V value;
+    memcpy(&value, c.at(column, game), sizeof value);
+    return value;
+}
+
+template <typename V> INLINE void store(BatchColumns &c, int column, int game, const V &value) {
+    memcpy(c.at(column, game), &value, sizeof value);
+}
+
+template <typename V> INLINE V choose(const V &mask, const V &yes, const V &no) {
+    return (mask & yes) | (~mask & no);
+}
+
+// Value of the seat in player from a [seat] group of columns.
+template <typename V> INLINE V of_seat(BatchColumns &c, int columns, const V &player, int game) {
+    V result = splat<V>(0);
+    #pragma GCC unroll 16
+    for (int seat = 0; seat < 4; seat++) result |= is_equal(player, splat<V>(seat)) & load<V>(c, columns + seat, game);
+    return result;
+}
+
+template <typename V> INLINE void legal_step(BatchColumns &c, int game, int position) {
+    V player = (load<V>(c, BatchColumns::LEADER, game) + splat<V>(position)) & splat<V>(3);
+    V led = load<V>(c, BatchColumns::TRICK, game) >> 4;
+    V hand[4];
+    V has_led = splat<V>(0);
+    #pragma GCC unroll 16
+    for (int suit = 0; suit < 4; suit++) {
+        hand[suit] = of_seat(c, BatchColumns::HAND + suit * 4, player, game);
+        has_led |= is_equal(led, splat<V>(suit)) & hand[suit];
+    }
+    //Any card when leading or when out of the suit led
+    V follow = position == 0 ? splat<V>(0) : ~is_equal(has_led, splat<V>(0));
+    #pragma GCC unroll 16
+    for (int suit = 0; suit < 4; suit++) {
+        store(c, BatchColumns::LEGAL + suit, game, choose(follow, hand[suit] & is_equal(led, splat<V>(suit)), hand[suit]));
+    }
+}
+
+template <typename V> INLINE void choose_step(BatchColumns &c, int game, int position) {
+    V player = (load<V>(c, BatchColumns::LEADER, game) + splat<V>(position)) & splat<V>(3);
+    V led = load<V>(c, BatchColumns::TRICK, game) >> 4;
+    V alive = of_seat(c, BatchColumns::ALIVE, player, game);
+    V of_led = splat<V>(0);
+    if (position > 0) {
+        #pragma GCC unroll 16
+        for (int suit = 0; suit < 4; suit++) {
+            of_led |= is_equal(led, splat<V>(suit)) & of_seat(c, BatchColumns::SUIT_SLOTS + suit * 4, player, game);
+        }
+        of_led &= alive;
+    }
+    //First slot of the suit led, otherwise the first slot
+    V slots = choose(is_equal(of_led, splat<V>(0)), alive, of_led);
+    V slot = slots & -slots;
+    V card = splat<V>(0);
+    V bit = splat<V>(0);
+    #pragma GCC unroll 16
+    for (int i = 0; i < 13; i++) {
+        V here = is_equal(slot, splat<V>(1 << i));
+        card |= here & of_seat(c, BatchColumns::SLOT_CARD + i * 4, player, game);
+        bit |= here & of_seat(c, BatchColumns::SLOT_BIT + i * 4, player, game);
+    }
+    store(c, BatchColumns::TRICK + position, game, card);
+    V suit = card >> 4;
+    #pragma GCC unroll 16
+    for (int seat = 0; seat < 4; seat++) {
+        V mine = is_equal(player, splat<V>(seat));
+        store(c, BatchColumns::ALIVE + seat, game, load<V>(c, BatchColumns::ALIVE + seat, game) & ~(mine & slot));
+        #pragma GCC unroll 16
+        for (int s = 0; s < 4; s++) {
+            int column = BatchColumns::HAND + s * 4 + seat;
+            store(c, column, game, load<V>(c, column, game) & ~(mine & is_equal(suit, splat<V>(s)) & bit));
+        }
+    }
+}
+
+// Winner as in trick_winner, points as in trick_points.
+template <typename V> INLINE void take_step(BatchColumns &c, int game, int trick_number) {
+    V led = load<V>(c, BatchColumns::TRICK, game) >> 4;
+    V best = splat<V>(0);
+    V winner = splat<V>(0);
+    V hearts = splat<V>(0);
+    V queens = splat<V>(0);
+    V jacks_kings = splat<V>(0);
+    V king_of_hearts = splat<V>(0);
+    #pragma GCC unroll 16
+    for (int position = 0; position < 4; position++) {
+        V card = load<V>(c, BatchColumns::TRICK + position, game);
+        V suit = card >> 4;
+        V value = card & splat<V>(15);
+        V higher = is_equal(suit, led) & is_greater(value, best);
+        best = choose(higher, value, best);
+        winner = choose(higher, splat<V>(position), winner);
+        //Masks are -1, so subtracting counts
+        V heart = is_equal(suit, splat<V>(2));
+        hearts -= heart;
+        queens -= is_equal(value, splat<V>(12));
+        jacks_kings -= is_equal(value, splat<V>(11)) | is_equal(value, splat<V>(13));
+        king_of_hearts -= heart & is_equal(value, splat<V>(13));
+    }
+    V type = load<V>(c, BatchColumns::TYPE, game);
+    V all = is_equal(type, splat<V>(7));
+    V points = (all | is_equal(type, splat<V>(1))) & splat<V>(1);
+    points += (all | is_equal(type, splat<V>(2))) & hearts;
+    points += (all | is_equal(type, splat<V>(3))) & (queens * splat<V>(5));
+    points += (all | is_equal(type, splat<V>(4))) & (jacks_kings * splat<V>(2));
+    points += (all | is_equal(type, splat<V>(5))) & (king_of_hearts * splat<V>(18));
+    if (trick_number == 7 || trick_number == 13) points += (all | is_equal(type, splat<V>(6))) & splat<V>(10);
+    V seat = (load<V>(c, BatchColumns::LEADER, game) + winner) & splat<V>(3);
+    #pragma GCC unroll 16
+    for (int s = 0; s < 4; s++) {
+        int column = BatchColumns::POINTS + s;
+        store(c, column, game, load<V>(c, column, game) + (is_equal(seat, splat<V>(s)) & points));
+    }
+    store(c, BatchColumns::LEADER, game, seat);
+}
+
+// Instantiates the kernels for vectors of V, lanes games at a time.
+#define BATCH_KERNELS(name, V, lanes, attributes) \
+    attributes static void legal_##name(BatchColumns &c, int begin, int end, int position) { \
+        for (int game = begin; game < end; game += lanes) legal_step<V>(c, game, position); \
+    } \
+    attributes static void choose_##name(BatchColumns &c, int begin, int end, int position) { \
+        for (int game = begin; game < end; game += lanes) choose_step<V>(c, game, position); \
+    } \
+    attributes static void take_##name(BatchColumns &c, int begin, int end, int trick_number) { \
+        for (int game = begin; game < end; game += lanes) take_step<V>(c, game, trick_number); \
+    } \
+    static const BatchKernels name##_kernels = {legal_##name, choose_##name, take_##name, #name};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+BATCH_KERNELS(avx2, Lanes16, 16, __attribute__((target("avx2"))))
+BATCH_KERNELS(sse2, Lanes8, 8, )
+#else
+BATCH_KERNELS(vector, Lanes8, 8, )
+#endif
+BATCH_KERNELS(scalar, Lane, 1, )
+
+BatchEngine::BatchEngine(const vector<Round> &deals, const string &kernels) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (kernels == "" && __builtin_cpu_supports("avx2")) this->kernels = &avx2_kernels;
+    else if (kernels == "avx2") {
+        if (!__builtin_cpu_supports("avx2")) fatal("This CPU has no AVX2");
+        this->kernels = &avx2_kernels;
+    }
+    else if (kernels == "" || kernels == "sse2") this->kernels = &sse2_kernels;
+#else
+    if (kernels == "" || kernels == "vector") this->kernels = &vector_kernels;
+#endif
+    else if (kernels == "scalar") this->kernels = &scalar_kernels;
+    else fatal("Unknown kernels %s", kernels.c_str());
+    BatchColumns &c = this->columns;
+    c.games = deals.size();
+    c.padded = (c.games + BATCH_TILE - 1) / BATCH_TILE * BATCH_TILE;
+    c.data.assign((size_t)c.padded * BatchColumns::COUNT, 0);
+    const string suits = "CDHS";
+    for (int game = 0; game < c.games; game++) {
+        const Round &deal = deals[game];
+        *c.at(BatchColumns::TYPE, game) = deal.type;
+        *c.at(BatchColumns::LEADER, game) = place_number(deal.starting_player);
+        for (int seat = 0; seat < 4; seat++) {
+            const vector<Card> &cards = deal.player_cards[seat];
+            for (int slot = 0; slot < (int)cards.size() && slot < 13; slot++) {
+                int suit = suits.find(cards[slot].color);
+                int bit = 1 << (cards[slot].value - 2);
+                *c.at(BatchColumns::SLOT_CARD + slot * 4 + seat, game) = suit * 16 + cards[slot].value;
+                *c.at(BatchColumns::SLOT_BIT + slot * 4 + seat, game) = bit;
+                *c.at(BatchColumns::SUIT_SLOTS + suit * 4 + seat, game) |= 1 << slot;
+                *c.at(BatchColumns::HAND + suit * 4 + seat, game) |= bit;
+                *c.at(BatchColumns::ALIVE + seat, game) |= 1 << slot;
+            }
+        }
+    }
+}
+
+// A tile of games is played to the end before the next one, so its columns stay in the cache.
+void BatchEngine::play() {
+    for (int begin = 0; begin < this->columns.padded; begin += BATCH_TILE) {
+        int end = min(begin + BATCH_TILE, this->columns.padded);
+        for (int trick_number = 1; trick_number <= 13; trick_number++) {
+            for (int position = 0; position < 4; position++) this->choose_cards(position, begin, end);
+            this->take_trick(trick_number, begin, end);
+        }
+    }
+}
+
+void BatchEngine::legal_moves(int position) {
+    this->kernels->legal(this->columns, 0, this->columns.padded, position);
+}
+
+void BatchEngine::choose_cards(int position, int begin, int end) {
+    this->kernels->choose(this->columns, begin, end, position);
+}
+
+void BatchEngine::take_trick(int trick_number, int begin, int end) {
+    this->kernels->take(this->columns, begin, end, trick_number);
+}
@@ -0,0 +1,88 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "deals.h"
+
+#ifndef MIM_BATCH_H
+#define MIM_BATCH_H
+
+// Games are played in lockstep, up to 16 of them per kernel step. Every
+// column holds one 16-bit value per game and the games are padded to a
+// multiple of BATCH_TILE, padding games have no cards and score nothing.
+// A tile is also what play() plays to the end before the next one.
+#define BATCH_TILE 64
+
+// Suits are numbered in CDHS order. A card is packed as suit * 16 + value,
+// a set of cards of one suit is a mask with bit value - 2 set for each card.
+// Hands also keep the order of the deal file, as slots 0..12, because the
+// bot plays the first card of its hand that it may play.
+//
+// Games are stored in tiles of BATCH_TILE games, a tile holds every column
+// of its games one after another, so the games played together share a
+// few kilobytes of memory instead of touching a hundred separate arrays.
+struct BatchColumns {
+    static constexpr int TYPE = 0;
+    static constexpr int LEADER = 1;
+    // [suit][seat]
+    static constexpr int HAND = 2;
+    static constexpr int SUIT_SLOTS = HAND + 16;
+    // [seat]
+    static constexpr int ALIVE = SUIT_SLOTS + 16;
+    // [slot][seat], the card and its bit in the suit mask
+    static constexpr int SLOT_CARD = ALIVE + 4;
+    static constexpr int SLOT_BIT = SLOT_CARD + 52;
+    // [position in the trick]
+    static constexpr int TRICK = SLOT_BIT + 52;
+    // [suit], of the seat to play
+    static constexpr int LEGAL = TRICK + 4;
+    // [seat], of the deal so far
+    static constexpr int POINTS = LEGAL + 4;
+    static constexpr int COUNT = POINTS + 4;
+
+    int games = 0;
+    int padded = 0;
+    std::vector<int16_t> data;
+    static size_t index(int column, int game) {
+        return ((size_t)(game / BATCH_TILE) * COUNT + column) * BATCH_TILE + game % BATCH_TILE;
+    }
+    int16_t *at(int column, int game) { return this->data.data() + index(column, game); }
+    int16_t at(int column, int game) const { return this->data[index(column, game)]; }
+};
+
+// One step of play for the games from begin to end.
+struct BatchKernels {
+    void (*legal)(BatchColumns &c, int begin, int end, int position);
+    void (*choose)(BatchColumns &c, int begin, int end, int position);
+    void (*take)(BatchColumns &c, int begin, int end, int trick_number);
+    const char *name;
+};
+
+// Plays thousands of deals at once with the bot of choose_card at every
+// seat, scored like the server scores them. Kernels are "avx2", "sse2" and
+// "scalar", the same code for 16, 8 and 1 game at a time; the fastest the
+// CPU has is used when none is asked for.
+class BatchEngine {
+public:
+    BatchEngine(const std::vector<Round> &deals, const std::string &kernels);
+    int size() const { return this->columns.games; }
+    // The whole deal, 13 tricks.
+    void play();
+    // Steps of play, position within the trick from 0.
+    void legal_moves(int position);
+    void choose_cards(int position) { this->choose_cards(position, 0, this->columns.padded); }
+    void take_trick(int trick_number) { this->take_trick(trick_number, 0, this->columns.padded); }
+    // Suit mask of the cards the seat to play may play, after legal_moves.
+    int legal(int game, int suit) const { return (uint16_t)this->columns.at(BatchColumns::LEGAL + suit, game); }
+    int card(int game, int position) const { return this->columns.at(BatchColumns::TRICK + position, game); }
+    int leader(int game) const { return this->columns.at(BatchColumns::LEADER, game); }
+    int points(int game, int seat) const { return this->columns.at(BatchColumns::POINTS + seat, game); }
+    const char *kernel_name() const { return this->kernels->name; }
+private:
+    BatchColumns columns;
+    const BatchKernels *kernels;
+    void choose_cards(int position, int begin, int end);
+    void take_trick(int trick_number, int begin, int end);
+};
+
+#endif
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Plays a scripted 20-deal game on the allocation counting server and fails
+# if handling TRICK or TAKEN allocates at all after the first deal, which
+# grows the buffers to their size and is left out of the counts.
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk 'BEGIN {
+    srand(1)
+    split("2 3 4 5 6 7 8 9 10 J Q K A", values, " ")
+    split("C D H S", colors, " ")
+    for (deal = 1; deal <= 20; deal++) {
+        n = 0
+        for (c = 1; c <= 4; c++) for (v = 1; v <= 13; v++) deck[++n] = values[v] colors[c]
+        for (i = 52; i > 1; i--) { j = int(rand() * i) + 1; t = deck[i]; deck[i] = deck[j]; deck[j] = t }
+        print (deal - 1) % 7 + 1 substr("NESW", deal % 4 + 1, 1)
+        for (p = 0; p < 4; p++) {
+            line = ""
+            for (i = 1; i <= 13; i++) line = line deck[p * 13 + i]
+            print line
+        }
+    }
+}' > "$dir/deals.txt"
+
+timeout 60 ./kierki-serwer-alloc -u "$dir/socket" -f "$dir/deals.txt" -t 1 > "$dir/transcript" 2> "$dir/report" &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$dir/socket" ] && break
+    sleep 0.1
+done
+for place in N E S W; do
+    timeout 60 ./kierki-klient -u "$dir/socket" -$place -a > /dev/null &
+done
+if ! wait $server; then
+    echo "check-alloc: the game did not finish"
+    exit 1
+fi
+
+awk '
+    /^(TRICK in|TRICK out|TAKEN) / { type = $1 ($2 ~ /^[a-z]/ ? " " $2 : ""); allocations[type] = $(NF - 2); messages[type] = $(NF - 3) }
+    END {
+        failed = 0
+        for (type in allocations) {
+            printf "%-10s %6d messages %4d allocations\n", type, messages[type], allocations[type]
+            if (messages[type] == 0 || allocations[type] != 0) failed = 1
+        }
+        if (length(allocations) != 3) failed = 1
+        if (failed) print "check-alloc: TRICK/TAKEN handling allocates"
+        exit failed
+    }' "$dir/report"
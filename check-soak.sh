@@ -0,0 +1,66 @@
+#!/bin/sh
+# Plays games with many seats and dropped connections, and fails on what
+# only shows in such long runs.
+#
+# The same two virtual hours are played with the clock started at 0 and
+# past 2^31 ms, as on a host up for 25 days: the two must come out the
+# same, timers kept in the low 32 bits of the clock included.
+#
+# Binary lobby clients dropped every 37 ms play a game on the pipelined
+# server, coming back to their seats by token: every one must finish it.
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk 'BEGIN {
+    srand(1)
+    split("2 3 4 5 6 7 8 9 10 J Q K A", values, " ")
+    split("C D H S", colors, " ")
+    for (deal = 1; deal <= 20; deal++) {
+        n = 0
+        for (c = 1; c <= 4; c++) for (v = 1; v <= 13; v++) deck[++n] = values[v] colors[c]
+        for (i = 52; i > 1; i--) { j = int(rand() * i) + 1; t = deck[i]; deck[i] = deck[j]; deck[j] = t }
+        print (deal - 1) % 7 + 1 substr("NESW", deal % 4 + 1, 1)
+        for (p = 0; p < 4; p++) {
+            line = ""
+            for (i = 1; i <= 13; i++) line = line deck[p * 13 + i]
+            print line
+        }
+    }
+}' > "$dir/deals.txt"
+
+failed=0
+
+for start in 0 3000000000; do
+    ./kierki-soak -f "$dir/deals.txt" -n 100 -H 2 -m 1000 -S 7 -e $start 2>&1 | sed 's/ wall_ms [0-9]* speedup [0-9]*//' > "$dir/clock_$start"
+done
+cat "$dir/clock_0"
+if ! cmp -s "$dir/clock_0" "$dir/clock_3000000000"; then
+    echo "check-soak: a clock past 2^31 ms plays differently"
+    diff "$dir/clock_0" "$dir/clock_3000000000"
+    failed=1
+fi
+
+timeout 120 ./kierki-serwer -l -P -u "$dir/socket" -f "$dir/deals.txt" -t 1 > /dev/null 2>&1 &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$dir/socket" ] && break
+    sleep 0.1
+done
+clients=""
+for i in 1 2 3 4 5 6 7 8; do
+    timeout 60 ./kierki-klient -u "$dir/socket" -L -a -b -r 5 -d 37 > /dev/null 2>&1 &
+    clients="$clients $!"
+done
+finished=0
+for client in $clients; do
+    wait $client && finished=$((finished + 1))
+done
+kill $server
+echo "pipelined resume: $finished of 8 clients finished"
+if [ $finished -ne 8 ]; then
+    echo "check-soak: binary clients do not get back to their seats on the pipelined server"
+    failed=1
+fi
+
+exit $failed
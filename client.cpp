@@ -0,0 +1,573 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <regex>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "err.h"
+#include "net.h"
+#include "client.h"
+
+#define BUFFER_SIZE 1000
+// Reconnect backoff in milliseconds, doubled after every failed attempt.
+#define RECONNECT_BASE_DELAY 100
+#define RECONNECT_MAX_DELAY  5000
+
+using namespace std;
+
+Client::Client(Net &net, ServerInfo server_info, LocalInfo client_info, bool auto_place, char place, bool binary)
+    : net(net) {
+    this->server_info = server_info;
+    this->client_info = client_info;
+    this->auto_place = auto_place;
+    this->binary = binary;
+    this->place = place;
+    this->sent_iam = false;
+    this->put_card = false;
+    this->pollfds[0] = {server_info.socket_fd, POLLOUT, 0}; // Server socket for writing
+    if (this->auto_place) this->pollfds[1] = {-1, 0, 0};
+    else this->pollfds[1] = {STDIN_FILENO, POLLIN, 0}; // STDIN for input if not auto_place
+}
+
+void Client::set_reconnect(const ServerAddress &address, int attempts, int drop_interval) {
+    this->address = address;
+    this->reconnects = attempts;
+    this->drop_interval = drop_interval;
+    if (drop_interval > 0) this->next_drop = this->net.now() + drop_interval;
+}
+
+bool Client::run() {
+    char buffer[BUFFER_SIZE];
+    while (true) {
+        for (int i = 0; i < 2; i++) this->pollfds[i].revents = 0;
+        int timeout = -1;
+        if (this->next_drop != -1) timeout = max(this->next_drop - this->net.now(), (int64_t)0);
+        bool speculating = this->speculated_cards.size() < this->speculated_keys.size();
+        if (speculating) timeout = 0;
+        int poll_status = this->net.poll(this->pollfds, 2, timeout);
+        if (poll_status < 0 && errno != EINTR) syserr("poll");
+        if (this->next_drop != -1 && this->net.now() >= this->next_drop) {
+            //Injected failure, the server sees the connection closed
+            if (!this->reconnect()) return this->return_code;
+            continue;
+        }
+        //Nothing came, one more reply is worked out before the next look
+        if (poll_status == 0 && speculating) {
+            this->speculate();
+            continue;
+        }
+
+        bool reconnected = false;
+        for (int i = 0; i < 2 && !reconnected; i++) {
+            if (this->pollfds[i].revents & POLLIN) {
+                ssize_t message_length = this->net.read(this->pollfds[i].fd, buffer, BUFFER_SIZE);
+                if (message_length < 0) continue;
+                if (message_length == 0) {
+                    if (i == 0 && this->reconnect()) {
+                        reconnected = true;
+                        continue;
+                    }
+                    this->net.close(this->pollfds[i].fd);
+                    if (this->pollfds[1].revents & POLLOUT && this->write_buffer[1].size() > 0) {
+                        ssize_t message_length = this->net.write(this->pollfds[1].fd, this->write_buffer[1].c_str(), this->write_buffer[1].size());
+                        if (message_length < 0) continue;
+                    }
+                    return this->return_code;
+                }
+                this->read_buffer[i] += string(buffer, message_length);
+            }
+
+            //Unix sockets report POLLHUP together with the last data, read it first
+            if (this->pollfds[i].revents & (POLLERR | POLLHUP | POLLNVAL) && !(this->pollfds[i].revents & POLLIN)) {
+                if (i == 0 && this->reconnect()) {
+                    reconnected = true;
+                    continue;
+                }
+                this->net.close(this->pollfds[i].fd);
+                return this->return_code;
+            }
+        }
+        if (reconnected) continue;
+
+        this->handle_server_messages();
+        if (!this->auto_place) this->handle_client_messages();
+        this->send_messages_to_server();
+
+        // Write to server socket
+        for (int i = 0; i < 2; i++) {
+            //The server socket is non-blocking, a reply goes out now instead of after another poll
+            if ((this->pollfds[i].revents & POLLOUT || i == 0) && this->write_buffer[i].size() > 0) {
+                ssize_t message_length = this->net.write(this->pollfds[i].fd, this->write_buffer[i].c_str(), this->write_buffer[i].size());
+                if (message_length < 0) continue;
+                this->write_buffer[i] = this->write_buffer[i].substr(message_length);
+            }
+        }
+
+        // Update pollfds
+        for (int i = 0; i < 2; i++) {
+            this->pollfds[i].events = POLLIN;
+            if (this->write_buffer[i].size() > 0) {
+                this->pollfds[i].events |= POLLOUT;
+            }
+        }
+    }
+}
+
+// Connects again with jittered exponential backoff and asks for the same seat.
+bool Client::reconnect() {
+    this->net.close(this->pollfds[0].fd);
+    this->pollfds[0].fd = -1;
+    if (this->reconnects == 0) return false;
+    //A seat taken by someone else is not worth coming back to
+    if (this->busy && !this->resuming) return this->give_up();
+    //TOTAL comes after every deal, the connection closing after one may be the end of the game or not
+    if (!this->resuming) {
+        this->lost_at = this->net.now();
+        this->lost_after_total = this->return_code == 0;
+    }
+    this->recovery.drops++;
+    int backoff = RECONNECT_BASE_DELAY;
+    for (int attempt = 0; attempt < this->reconnects; attempt++) {
+        //Half of the delay is random, so bots dropped together do not all come back together
+        int delay = backoff / 2 + random() % (backoff / 2 + 1);
+        this->net.sleep(delay);
+        ServerInfo server_info = connect_server(this->net, this->address);
+        if (server_info.socket_fd == -1) {
+            backoff = min(backoff * 2, RECONNECT_MAX_DELAY);
+            continue;
+        }
+        this->server_info = server_info;
+        this->client_info = get_client_info(this->net, server_info.socket_fd);
+        this->pollfds[0] = {server_info.socket_fd, POLLOUT, 0};
+        this->read_buffer[0].clear();
+        this->write_buffer[0].clear();
+        this->sent_iam = false;
+        this->put_card = false;
+        this->busy = false;
+        this->resuming = true;
+        if (this->drop_interval > 0) this->next_drop = this->net.now() + this->drop_interval;
+        return true;
+    }
+    return this->give_up();
+}
+
+// No way back to the seat. Right after a TOTAL that means the game is over and nothing was dropped.
+bool Client::give_up() {
+    this->return_code = this->lost_after_total ? 0 : 1;
+    if (this->lost_after_total) this->recovery.drops--;
+    return false;
+}
+
+void Client::print_reconnects() {
+    if (this->recovery.drops == 0) return;
+    cerr << "drops " << this->recovery.drops << " recovered " << this->recovery.recovered;
+    if (this->recovery.recovered > 0) {
+        cerr << " recovery_mean_ms " << this->recovery.recovery_total / this->recovery.recovered
+             << " recovery_max_ms " << this->recovery.recovery_max;
+    }
+    cerr << endl;
+}
+
+void Client::handle_server_messages() {
+    string message;
+    while (true) {
+        if (this->binary) {
+            if (!extract_frame(this->read_buffer[0], this->frame)) break;
+            if (this->auto_place) {
+                message.clear();
+                frame_to_text(this->frame, message);
+                this->print_log(message);
+            }
+            if (!decode_frame(this->frame, this->message)) {
+                this->return_code = 1;
+                continue;
+            }
+        }
+        else {
+            if (!extract_message(this->read_buffer[0], message)) break;
+            if (message.empty()) continue;
+            if (this->auto_place) this->print_log(message);
+            if (!parse_message(message, this->message)) {
+                this->return_code = 1;
+                continue;
+            }
+        }
+        this->return_code = this->message.kind == MESSAGE_TOTAL ? 0 : 1;
+        if (this->lost_at != -1 && this->message.kind != MESSAGE_BUSY) {
+            //The table is back once the server answers the new connection with its state
+            int64_t recovery = this->net.now() - this->lost_at;
+            this->recovery.recovered++;
+            this->recovery.recovery_total += recovery;
+            this->recovery.recovery_max = max(this->recovery.recovery_max, recovery);
+            this->lost_at = -1;
+        }
+        this->handle_server_message(this->message);
+    }
+}
+
+void Client::handle_server_message(Message &message) {
+    if (message.kind == MESSAGE_SEAT) {
+        //A reconnect asks for this seat again
+        this->place = message.place;
+        this->seat_token = message.token;
+        if (!this->auto_place) {
+            string response = "Assigned place ";
+            response += this->place;
+            response += ".\n";
+            this->write_buffer[1] += response;
+        }
+    }
+    else if (message.kind == MESSAGE_BUSY) {
+        //When resuming the server may not have noticed the old connection yet, try again, unless the
+        //seat was asked for by its token: the server knows it is the same client, the seat is gone
+        this->busy = true;
+        if (this->seat_token != 0) this->resuming = false;
+        if (!this->auto_place) {
+            string response = "Place busy, list of busy places received: ";
+            for (int i = 0; i < (int)message.places.size(); i++) {
+                response += message.places[i];
+                response += ", ";
+            }
+            response.pop_back();
+            response.pop_back();
+            response += ".\n";
+            this->write_buffer[1] += response;
+        }
+    }
+    else if (message.kind == MESSAGE_DEAL) {
+        uint64_t deal_mask = cards_to_mask(message.cards);
+        bool resumed = this->resuming && deal_mask == this->deal_mask && message.type == this->type;
+        this->resuming = false;
+        //The deal we were playing, keep the hand and tricks and apply only the TAKEN messages we missed
+        if (resumed) return;
+        this->type = message.type;
+        this->starting_player = message.place;
+        //The binary DEAL carries only the set of cards, keep the hand in that order for the text one too
+        mask_to_cards(deal_mask, this->cards);
+        this->deal_mask = deal_mask;
+        this->tricks_taken = 0;
+        this->played_mask = 0;
+        for (int i = 0; i < 4; i++) this->voids[i] = 0;
+        this->speculated_trick = 0;
+        this->log = "";
+        if (!this->auto_place) {
+            string response = "New deal " + to_string(this->type) + ": starting place " + this->starting_player + ", your cards: ";
+            for (int i = 0; i < (int)this->cards.size(); i++) {
+                response += card_to_string(this->cards[i]) + ", ";
+            }
+            response.pop_back();
+            response.pop_back();
+            response += ".\n";
+            this->write_buffer[1] += response;
+        }
+    } else if (message.kind == MESSAGE_TAKEN) {
+        if (message.number <= this->tricks_taken) return;
+        this->tricks_taken = message.number;
+        char winner = message.place;
+        int our_card = place_number(this->place) - place_number(this->starting_player);
+        if (our_card < 0) our_card += 4;
+        this->remove_card(message.cards[our_card]);
+        int lead = card_id(message.cards[0]) / 13;
+        for (int i = 0; i < (int)message.cards.size(); i++) {
+            int id = card_id(message.cards[i]);
+            this->played_mask |= 1ull << id;
+            if (id / 13 != lead) this->voids[(place_number(this->starting_player) + i) % 4] |= 1 << lead;
+        }
+        this->starting_player = winner;
+        if (this->auto_place) this->prepare_speculation();
+        if (!this->auto_place) {
+            string response = "A trick " + to_string(message.number) + " is taken by " + winner + ", cards ";
+            for (int i = 0; i < (int)message.cards.size(); i++) {
+                response += card_to_string(message.cards[i]) + ", ";
+                this->log += card_to_string(message.cards[i]) + ", ";
+            }
+            response.pop_back();
+            response.pop_back();
+            response += ".\n";
+            this->log.pop_back();
+            this->log.pop_back();
+            this->log += "\n";
+            this->write_buffer[1] += response;
+        }
+    } else if (message.kind == MESSAGE_TRICK) {
+        this->resuming = false;
+        this->trick_number = message.number;
+        this->trick_cards = message.cards;
+        //The cards before ours are known now, the ones not worked out yet are not needed
+        this->speculated_keys.resize(this->speculated_cards.size());
+        this->put_card = true;
+        this->card_to_put.value = 0;
+        if (!this->auto_place) {
+            string response = "Trick: (" + to_string(this->trick_number) + ") ";
+            for (int i = 0; i < (int)this->trick_cards.size(); i++) {
+                response += card_to_string(this->trick_cards[i]) + ", ";
+            }
+            if (this->trick_cards.size() > 0) {
+                response.pop_back();
+                response.pop_back();
+            }
+            response += "\n";
+            response += "Available: ";
+            for (int i = 0; i < (int)this->cards.size(); i++) {
+                response += card_to_string(this->cards[i]) + ", ";
+            }
+            response.pop_back();
+            response.pop_back();
+            response += "\n";
+            this->write_buffer[1] += response;
+        }
+    } else if (message.kind == MESSAGE_SCORE || message.kind == MESSAGE_TOTAL) {
+        this->resuming = false;
+        if (!this->auto_place) {
+            string response = message.kind == MESSAGE_SCORE ? "The scores are:\n" : "The total scores are:\n";
+            for (int i = 0; i < 4; i++) {
+                response += "NESW"[i];
+                response += " | " + to_string(message.scores[i]) + "\n";
+            }
+            this->write_buffer[1] += response;
+        }
+        if (message.kind == MESSAGE_TOTAL) this->cards.clear();
+    } else if (message.kind == MESSAGE_WRONG) {
+        if (!this->auto_place) {
+            string response = "Wrong message received in trick " + to_string(message.number) + ".\n";
+            this->write_buffer[1] += response;
+        }
+    }
+}
+
+void Client::print_log(const string &message) {
+    cout << "[" + server_info.ip + ":" + to_string(server_info.port) + "," + client_info.ip + ":" + to_string(client_info.port) + ',' + get_timestamp() + "] " + message + "\r\n";
+}
+
+void Client::handle_client_messages() {
+    string message = extract_stdin_message(this->read_buffer[1]);
+    while (message != "") {
+        if (message == "cards") {
+            string response = "Your cards: ";
+            for (int i = 0; i < (int)this->cards.size(); i++) {
+                response += card_to_string(this->cards[i]) + ", ";
+            }
+            response.pop_back();
+            response.pop_back();
+            response += ".\n";
+            this->write_buffer[1] += response;
+        } else if (message == "tricks") {
+            this->write_buffer[1] += this->log;
+        } else if (this->is_card(message.substr(1)) && this->put_card) {
+            this->card_to_put = string_to_card(message.substr(1));
+            if (!this->check_card(this->card_to_put)) {
+                this->card_to_put.value = 0;
+                this->write_buffer[1] += "Wrong card.\n";
+            }
+        } else {
+            string response = "Unknown command.\n";
+            this->write_buffer[1] += response;
+        }
+        message = extract_stdin_message(this->read_buffer[1]);
+    }
+}
+
+void Client::send_messages_to_server() {
+    if (!this->sent_iam) {
+        string response = "IAM" + string(1, this->place) + (this->binary ? "B" : "");
+        //In lobby mode the seat is named by its token, the place alone could be any table's
+        if (this->resuming && this->seat_token != 0) response += to_string(this->seat_token);
+        if (this->name != "") response += ":" + this->name;
+        response += "\r\n";
+        this->write_buffer[0] += response;
+        this->sent_iam = true;
+        if (this->auto_place) cout << "[" + server_info.ip + ":" + to_string(server_info.port) + "," + client_info.ip + ":" + to_string(client_info.port) + ',' + get_timestamp() + "] " + response;
+    }
+    if (this->put_card) {
+        if (this->auto_place) this->choose_card();
+        if (this->card_to_put.value == 0) return;
+        string response = "TRICK" + to_string(this->trick_number) + card_to_string(this->card_to_put) + "\r\n";
+        if (this->binary) {
+            char frame[FRAME_SIZE];
+            this->write_buffer[0].append(frame, encode_trick(frame, this->trick_number, &this->card_to_put, 1));
+        }
+        else this->write_buffer[0] += response;
+        this->put_card = false;
+        if (this->auto_place) cout << "[" + server_info.ip + ":" + to_string(server_info.port) + "," + client_info.ip + ":" + to_string(client_info.port) + ',' + get_timestamp() + "] " + response;
+    }
+}
+
+void Client::remove_card(Card card) {
+    for (int i = 0; i < (int)this->cards.size(); i++) {
+        if (this->cards[i].color == card.color && this->cards[i].value == card.value) {
+            this->cards.erase(this->cards.begin() + i);
+            break;
+        }
+    }
+}
+
+void Client::choose_card() {
+    if (this->trick_number == this->speculated_trick) {
+        uint32_t key = 0;
+        for (const Card &card : this->trick_cards) key = key << 6 | card_id(card);
+        for (size_t i = 0; i < this->speculated_cards.size(); i++) {
+            if (this->speculated_keys[i] != key || this->speculated_cards[i].value == 0) continue;
+            this->card_to_put = this->speculated_cards[i];
+            return;
+        }
+    }
+    if (this->guess_card(this->trick_number, this->trick_cards, this->card_to_put)) return;
+    this->card_to_put = ::choose_card(this->cards, this->trick_cards);
+}
+
+// Only the own hand is known, the last tricks are looked up for every way the other cards can lie.
+bool Client::guess_card(int trick_number, const vector<Card> &trick, Card &card) {
+    int seat = place_number(this->place);
+    if (seat == -1 || !this->endgame.covers(this->type, trick_number)) return false;
+    uint64_t hand = cards_to_mask(this->cards);
+    uint64_t unseen = ((1ull << 52) - 1) & ~(hand | this->played_mask | cards_to_mask(trick));
+    int leader = (seat - (int)trick.size() + 4) % 4;
+    return this->endgame.guess_card(this->type, trick_number, seat, hand, leader, trick, unseen, this->voids, card);
+}
+
+// After a TAKEN, lists every way the seats before ours may start the next trick when it is played from
+// the endgame table. Leading is left alone: its TRICK comes right after the TAKEN, there is no wait.
+void Client::prepare_speculation() {
+    this->speculated_keys.clear();
+    this->speculated_cards.clear();
+    this->speculated_trick = this->tricks_taken + 1;
+    int seat = place_number(this->place);
+    int leader = place_number(this->starting_player);
+    int before = (seat - leader + 4) % 4;
+    if (seat == -1 || before == 0 || this->cards.size() < 2) return;
+    if (!this->endgame.covers(this->type, this->speculated_trick)) return;
+    uint64_t unseen = ((1ull << 52) - 1) & ~(cards_to_mask(this->cards) | this->played_mask);
+    this->add_speculation(unseen, leader, before, 0);
+}
+
+// The cards seat and the ones after it may play, not from a suit they showed out of.
+void Client::add_speculation(uint64_t unseen, int seat, int left, uint32_t key) {
+    if (left == 0) {
+        this->speculated_keys.push_back(key);
+        return;
+    }
+    for (uint64_t cards = unseen; cards != 0; cards &= cards - 1) {
+        int id = __builtin_ctzll(cards);
+        if (this->voids[seat] >> (id / 13) & 1) continue;
+        this->add_speculation(unseen & ~(1ull << id), (seat + 1) % 4, left - 1, key << 6 | id);
+    }
+}
+
+void Client::speculate() {
+    uint32_t key = this->speculated_keys[this->speculated_cards.size()];
+    int before = (place_number(this->place) - place_number(this->starting_player) + 4) % 4;
+    this->speculated_trick_cards.clear();
+    for (int i = before - 1; i >= 0; i--) this->speculated_trick_cards.push_back(id_to_card(key >> (6 * i) & 63));
+    Card card;
+    if (!this->guess_card(this->speculated_trick, this->speculated_trick_cards, card)) card.value = 0;
+    this->speculated_cards.push_back(card);
+}
+
+bool Client::check_card(Card card) {
+    bool has_card = false;
+    for (int i = 0; i < (int)this->cards.size(); i++) {
+        if (card.value == this->cards[i].value && card.color == this->cards[i].color) has_card = true;
+    }
+    if ((int)this->trick_cards.size() == 0) return has_card;
+    if (this->trick_cards[0].color == card.color) return true;
+    for (int i = 0; i < (int)this->cards.size(); i++) {
+        if (this->trick_cards[0].color == this->cards[i].color) return false;
+    }
+    return true;
+}
+
+bool Client::is_card(string message) {
+    regex pattern(R"((10|[2-9]|J|Q|K|A)(C|D|H|S))");
+    return regex_match(message, pattern);
+}
+
+ServerInfo get_server_address(Net &net, const char *host, uint16_t port, bool ipv4, bool ipv6) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    if (ipv4) hints.ai_family = AF_INET;
+    else if (ipv6) hints.ai_family = AF_INET6;
+    else hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    struct addrinfo *address_result;
+    int errcode = getaddrinfo(host, to_string(port).c_str(), &hints, &address_result);
+    if (errcode != 0) {
+        fatal("getaddrinfo: %s", gai_strerror(errcode));
+    }
+
+    ServerInfo server_info;
+    server_info.socket_fd = net.connect(address_result->ai_addr, address_result->ai_addrlen);
+    if (server_info.socket_fd == -1) {
+        freeaddrinfo(address_result);
+        return server_info;
+    }
+
+    char server_ip[INET6_ADDRSTRLEN];
+    if (address_result->ai_family == AF_INET) {
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)address_result->ai_addr;
+        inet_ntop(AF_INET, &(addr_in->sin_addr), server_ip, INET_ADDRSTRLEN);
+        server_info.ip = string(server_ip);
+        server_info.port = ntohs(addr_in->sin_port);
+    } else if (address_result->ai_family == AF_INET6) {
+        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)address_result->ai_addr;
+        inet_ntop(AF_INET6, &(addr_in6->sin6_addr), server_ip, INET6_ADDRSTRLEN);
+        server_info.ip = string(server_ip);
+        server_info.port = ntohs(addr_in6->sin6_port);
+    }
+
+    freeaddrinfo(address_result);
+    return server_info;
+}
+
+ServerInfo get_unix_server_address(Net &net, const char *path) {
+    sockaddr_un server_address = {};
+    server_address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof server_address.sun_path) fatal("Socket path %s is too long", path);
+    strcpy(server_address.sun_path, path);
+
+    ServerInfo server_info;
+    server_info.socket_fd = net.connect((struct sockaddr *) &server_address, sizeof server_address);
+    if (server_info.socket_fd == -1) return server_info;
+    server_info.ip = path;
+    server_info.port = 0;
+    return server_info;
+}
+
+ServerInfo connect_server(Net &net, const ServerAddress &address) {
+    if (address.unix_path != "") return get_unix_server_address(net, address.unix_path.c_str());
+    return get_server_address(net, address.host.c_str(), address.port, address.ipv4, address.ipv6);
+}
+
+LocalInfo get_client_info(Net &net, int socket_fd) {
+    struct sockaddr_storage client_addr;
+    net.local_address(socket_fd, client_addr);
+
+    LocalInfo client_info;
+    char client_ip[INET6_ADDRSTRLEN];
+    if (client_addr.ss_family == AF_INET) {
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)&client_addr;
+        inet_ntop(AF_INET, &(addr_in->sin_addr), client_ip, INET_ADDRSTRLEN);
+        client_info.ip = string(client_ip);
+        client_info.port = ntohs(addr_in->sin_port);
+    } else if (client_addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&client_addr;
+        inet_ntop(AF_INET6, &(addr_in6->sin6_addr), client_ip, INET6_ADDRSTRLEN);
+        client_info.ip = string(client_ip);
+        client_info.port = ntohs(addr_in6->sin6_port);
+    } else if (client_addr.ss_family == AF_UNIX) {
+        client_info.ip = "unix";
+        client_info.port = 0;
+    }
+
+    return client_info;
+}
@@ -0,0 +1,129 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "net.h"
+#include "endgame.h"
+
+#ifndef MIM_CLIENT_H
+#define MIM_CLIENT_H
+
+struct ServerInfo {
+    std::string ip;
+    uint16_t port;
+    int socket_fd;
+};
+
+struct LocalInfo {
+    std::string ip;
+    uint16_t port;
+};
+
+// Where to connect, kept to connect again after losing the server.
+struct ServerAddress {
+    std::string host;
+    std::string unix_path;
+    uint16_t port;
+    bool ipv4;
+    bool ipv6;
+};
+
+// Times the server was lost and how long it took to get the table back.
+struct RecoveryStats {
+    int drops = 0;
+    int recovered = 0;
+    int64_t recovery_total = 0;
+    int64_t recovery_max = 0;
+};
+
+// socket_fd is -1 when the server cannot be reached.
+ServerInfo connect_server(Net &net, const ServerAddress &address);
+LocalInfo get_client_info(Net &net, int socket_fd);
+
+class Client {
+public:
+    // The clock, the server socket and the waits of run() go through net.
+    Client(Net &net, ServerInfo server_info, LocalInfo client_info, bool auto_place, char place, bool binary);
+    bool run();
+    // Comes back after a lost connection up to attempts times, dropping it every drop_interval ms if positive.
+    void set_reconnect(const ServerAddress &address, int attempts, int drop_interval);
+    void print_reconnects();
+    RecoveryStats recovery;
+    // The bot plays the last tricks from it, when it is open.
+    EndgameTable endgame;
+    // Given with IAM, the server's results store keeps the player's games under it. Empty for none.
+    std::string name;
+
+private:
+    Net &net;
+    ServerInfo server_info;
+    LocalInfo client_info;
+    pollfd pollfds[2];
+    std::string write_buffer[2];
+    std::string read_buffer[2];
+
+    bool auto_place;
+    bool binary;
+    bool put_card;
+    bool sent_iam;
+    char place;
+    char starting_player;
+    int return_code = 1;
+    int trick_number;
+    int type;
+
+    std::vector<Card> cards;
+    std::vector<Card> trick_cards;
+    Card card_to_put;
+    std::string log;
+    std::string frame;
+    Message message;
+
+    ServerAddress address;
+    int reconnects = 0;
+    int drop_interval = 0;
+    int64_t next_drop = -1;
+    // Set by BUSY, the seat belongs to someone else.
+    bool busy = false;
+    // Token of the lobby seat from SEAT, 0 outside the lobby.
+    uint64_t seat_token = 0;
+    // Set after connecting again until the server's resend is applied.
+    bool resuming = false;
+    int64_t lost_at = -1;
+    // Whether the connection was lost right after a TOTAL.
+    bool lost_after_total = false;
+    // Hand of the current deal and the tricks already applied, to skip them in a resend.
+    uint64_t deal_mask = 0;
+    int tricks_taken = 0;
+    // Cards of the tricks taken in the current deal, and per place the colours it did not follow.
+    uint64_t played_mask = 0;
+    int voids[4] = {};
+    // Replies to the next trick worked out while the seats before ours play it: every way the cards
+    // before ours may come, 6 bits per card, and the replies to those done so far.
+    int speculated_trick = 0;
+    std::vector<uint32_t> speculated_keys;
+    std::vector<Card> speculated_cards;
+    std::vector<Card> speculated_trick_cards;
+
+    void handle_server_messages();
+    void handle_client_messages();
+    void send_messages_to_server();
+    void remove_card(Card card);
+    void choose_card();
+    bool guess_card(int trick_number, const std::vector<Card> &trick, Card &card);
+    void prepare_speculation();
+    void add_speculation(uint64_t unseen, int seat, int left, uint32_t key);
+    void speculate();
+    bool check_card(Card card);
+    bool is_card(std::string message);
+    void handle_server_message(Message &message);
+    void print_log(const std::string &message);
+    bool reconnect();
+    bool give_up();
+};
+
+#endif
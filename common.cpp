@@ -9,6 +9,8 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
 #include <chrono>
 #include <iomanip>
@@ -26,17 +28,22 @@ bool is_color(char c) {
 
 string extract_message(string &buffer) {
     string message = "";
+    extract_message(buffer, message);
+    return message;
+}
+
+// Moves the first CRLF-terminated message into message, reusing its storage.
+bool extract_message(string &buffer, string &message) {
     int p = 0;
-    while (p < (int)buffer.size()) {
-        if (p + 1 == (int)buffer.size()) break;
+    while (p + 1 < (int)buffer.size()) {
         if (buffer[p] == '\r' && buffer[p + 1] == '\n') {
-            message = buffer.substr(0, p);
-            buffer = buffer.substr(p + 2);
-            break;
+            message.assign(buffer, 0, p);
+            buffer.erase(0, p + 2);
+            return true;
         }
         p++;
     }
-    return message;
+    return false;
 }
 
 string extract_stdin_message(string &buffer) {
@@ -81,22 +88,111 @@ string card_to_string(Card card) {
     return result;
 }
 
-vector<Card> string_to_card_vector(string input) {
-    int p = 0;
+// Writes the card without a terminating zero, returns the number of characters.
+int card_to_chars(Card card, char *output) {
+    int length = 0;
+    if (card.value == 10) {
+        output[length++] = '1';
+        output[length++] = '0';
+    }
+    else if (card.value < 10) output[length++] = '0' + card.value;
+    else output[length++] = "JQKA"[card.value - 11];
+    output[length++] = card.color;
+    return length;
+}
+
+vector<Card> string_to_card_vector(string_view input) {
     vector<Card> cards;
-    while (p < (int)input.size()) {
-        string card_string = "";
-        card_string += input[p];
-        if (input[p+1] == '0') {
-            p++;
-            card_string += input[p];
+    string_to_card_vector(input, cards);
+    return cards;
+}
+
+// Parses the cards in place, reusing the storage of cards.
+void string_to_card_vector(string_view input, vector<Card> &cards) {
+    cards.clear();
+    size_t p = 0;
+    while (p + 1 < input.size()) {
+        Card card;
+        if (input[p + 1] == '0') {
+            if (p + 2 >= input.size()) break;
+            card.value = 10;
+            card.color = input[p + 2];
+            p += 3;
         }
-        p++;
-        card_string += input[p];
-        p++;
-        cards.push_back(string_to_card(card_string));
+        else {
+            if (input[p] == 'J') card.value = 11;
+            else if (input[p] == 'Q') card.value = 12;
+            else if (input[p] == 'K') card.value = 13;
+            else if (input[p] == 'A') card.value = 14;
+            else card.value = input[p] - '0';
+            card.color = input[p + 1];
+            p += 2;
+        }
+        cards.push_back(card);
     }
-    return cards;
+}
+
+Card choose_card(vector<Card> &cards, vector<Card> &trick_cards) {
+    if (trick_cards.size() == 0) return cards[0];
+    char color = trick_cards[0].color;
+    for (int i = 0; i < (int)cards.size(); i++) {
+        if (cards[i].color == color) return cards[i];
+    }
+    return cards[0];
+}
+
+bool can_play(const vector<Card> &cards, const vector<Card> &trick_cards, Card card) {
+    bool has_card = false;
+    bool has_color = false;
+    for (const Card &c : cards) {
+        if (c.color == card.color && c.value == card.value) has_card = true;
+        if (trick_cards.size() > 0 && c.color == trick_cards[0].color) has_color = true;
+    }
+    if (!has_card) return false;
+    if (trick_cards.size() == 0) return true;
+    return trick_cards[0].color == card.color || !has_color;
+}
+
+// Position of the winning card: the highest one of the colour led.
+int trick_winner(const vector<Card> &trick_cards) {
+    int winner = 0;
+    int max_value = 0;
+    for (int i = 0; i < (int)trick_cards.size(); ++i) {
+        if (trick_cards[i].color == trick_cards[0].color && trick_cards[i].value > max_value) {
+            max_value = trick_cards[i].value;
+            winner = i;
+        }
+    }
+    return winner;
+}
+
+int trick_points(int round_type, int trick_number, const vector<Card> &trick_cards) {
+    int points = 0;
+    if (round_type == 1 || round_type == 7) points++;
+    if (round_type == 2 || round_type == 7) {
+        for (int i = 0; i < (int)trick_cards.size(); ++i) {
+            if (trick_cards[i].color == 'H') points++;
+        }
+    }
+    if (round_type == 3 || round_type == 7) {
+        for (int i = 0; i < (int)trick_cards.size(); ++i) {
+            if (trick_cards[i].value == 12) points += 5;
+        }
+    }
+    if (round_type == 4 || round_type == 7) {
+        for (int i = 0; i < (int)trick_cards.size(); ++i) {
+            if (trick_cards[i].value == 11 || trick_cards[i].value == 13) points += 2;
+        }
+    }
+    if (round_type == 5 || round_type == 7) {
+        for (int i = 0; i < (int)trick_cards.size(); ++i) {
+            if (trick_cards[i].value == 13 && trick_cards[i].color == 'H') points += 18;
+        }
+    }
+    if (round_type == 6 || round_type == 7) {
+        if (trick_number == 7 || trick_number == 13) points += 10;
+    }
+    return points;
 }
 
 int place_number(char player) {
@@ -117,6 +213,13 @@ uint16_t read_port(char const *string) {
 }
 
 std::string get_timestamp() {
+    char buffer[32];
+    int length = format_timestamp(buffer);
+    return std::string(buffer, length);
+}
+
+// Same format as get_timestamp, written into a buffer of at least 32 bytes.
+int format_timestamp(char *output) {
     auto now = std::chrono::system_clock::now();
     auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()) % 1000;
 
@@ -125,9 +228,35 @@ std::string get_timestamp() {
     std::tm tm_now;
     localtime_r(&time_t_now, &tm_now);
 
-    std::ostringstream oss;
-    oss << std::put_time(&tm_now, "%Y-%m-%dT%H:%M:%S");
-    oss << '.' << std::setfill('0') << std::setw(3) << milliseconds.count();
+    int length = strftime(output, 32, "%Y-%m-%dT%H:%M:%S", &tm_now);
+    int ms = milliseconds.count();
+    output[length++] = '.';
+    output[length++] = '0' + ms / 100;
+    output[length++] = '0' + ms / 10 % 10;
+    output[length++] = '0' + ms % 10;
+    return length;
+}
 
-    return oss.str();
-}
\ No newline at end of file
+int64_t monotonic_ms() {
+    auto now = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+}
+
+void append_log_line(string &line, string_view from_ip, uint16_t from_port, string_view to_ip, uint16_t to_port,
+                     string_view message) {
+    char number[8];
+    line += '[';
+    line += from_ip;
+    line += ':';
+    line.append(number, to_chars(number, number + sizeof number, from_port).ptr - number);
+    line += ',';
+    line += to_ip;
+    line += ':';
+    line.append(number, to_chars(number, number + sizeof number, to_port).ptr - number);
+    line += ',';
+    char timestamp[32];
+    line.append(timestamp, format_timestamp(timestamp));
+    line += "] ";
+    line += message;
+    line += "\r\n";
+}
@@ -1,4 +1,7 @@
 #include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
 
 #ifndef MIM_COMMON_H
 #define MIM_COMMON_H
@@ -10,12 +13,25 @@ struct Card {
 
 bool is_color(char c);
 std::string extract_message(std::string &buffer);
+bool extract_message(std::string &buffer, std::string &message);
 std::string extract_stdin_message(std::string &buffer);
 Card string_to_card(std::string input);
 int place_number(char player);
 std::string card_to_string(Card card);
-std::vector<Card> string_to_card_vector(std::string input);
+int card_to_chars(Card card, char *output);
+std::vector<Card> string_to_card_vector(std::string_view input);
+void string_to_card_vector(std::string_view input, std::vector<Card> &cards);
+Card choose_card(std::vector<Card> &cards, std::vector<Card> &trick_cards);
+// Rules of a trick, trick_cards in the order they were played.
+bool can_play(const std::vector<Card> &cards, const std::vector<Card> &trick_cards, Card card);
+int trick_winner(const std::vector<Card> &trick_cards);
+int trick_points(int round_type, int trick_number, const std::vector<Card> &trick_cards);
 uint16_t read_port(char const *string);
 std::string get_timestamp();
+int format_timestamp(char *output);
+int64_t monotonic_ms();
+// Appends "[from,to,timestamp] message" and CRLF, the transcript line format of the server.
+void append_log_line(std::string &line, std::string_view from_ip, uint16_t from_port, std::string_view to_ip,
+                     uint16_t to_port, std::string_view message);
 
 #endif
\ No newline at end of file
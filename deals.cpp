@@ -0,0 +1,190 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "common.h"
+#include "err.h"
+#include "protocol.h"
+#include "deals.h"
+
+using namespace std;
+
+DealSource::~DealSource() {
+    if (this->fd == -1) return;
+    if (this->original_flags != -1) fcntl(this->fd, F_SETFL, this->original_flags);
+    if (this->fd != STDIN_FILENO) close(this->fd);
+}
+
+void DealSource::open(const string &file, bool follow) {
+    this->follow = follow;
+    if (file == "-") this->fd = STDIN_FILENO;
+    else {
+        //Without a writer a FIFO would read as empty, so wait for one unless following
+        this->fd = ::open(file.c_str(), O_RDONLY | (follow ? O_NONBLOCK : 0));
+        if (this->fd == -1) fatal("Cannot open file %s", file.c_str());
+    }
+    struct stat status;
+    if (fstat(this->fd, &status) < 0) syserr("fstat");
+    if (!follow && !S_ISFIFO(status.st_mode)) {
+        if (this->fd == STDIN_FILENO) fatal("Standard input is not a pipe, use -F to follow it");
+        close(this->fd);
+        this->fd = -1;
+        ifstream infile(file);
+        if (!infile) {
+            fatal("Cannot open file %s", file.c_str());
+        }
+        string lines[5];
+        while (getline(infile, lines[0])) {
+            for (int i = 1; i < 5; ++i) getline(infile, lines[i]);
+            this->rounds.emplace_back();
+            this->parse(lines, this->rounds.back());
+            this->rounds.back().number = this->rounds.size() - 1;
+        }
+        infile.close();
+        return;
+    }
+    this->original_flags = fcntl(this->fd, F_GETFL);
+    fcntl(this->fd, F_SETFL, this->original_flags | O_NONBLOCK);
+    //The first table should not wait for a retry interval
+    this->fill(monotonic_ms());
+}
+
+bool DealSource::next(int round, Round &deal) {
+    if (!this->streaming()) {
+        if (round >= (int)this->rounds.size()) return false;
+        deal = this->rounds[round];
+        return true;
+    }
+    if (this->ahead.empty()) return false;
+    //Copied, so the table reuses the storage of its previous deal
+    deal = this->ahead.front();
+    this->ahead.pop_front();
+    return true;
+}
+
+bool DealSource::ready(int round) const {
+    if (!this->streaming()) return round < (int)this->rounds.size();
+    return !this->ahead.empty();
+}
+
+bool DealSource::exhausted(int round) const {
+    if (!this->streaming()) return round >= (int)this->rounds.size();
+    return this->ended && this->ahead.empty();
+}
+
+void DealSource::fill(int64_t now) {
+    if (!this->streaming() || this->ended || now < this->read_at) return;
+    if (this->ahead.size() >= DEAL_READ_AHEAD / 2) return;
+    char buffer[DEAL_READ_SIZE];
+    //A stream of lines which are no deals would otherwise be read whole in one call
+    for (size_t total = 0; this->ahead.size() < DEAL_READ_AHEAD && total < DEAL_READ_LIMIT; ) {
+        ssize_t length = read(this->fd, buffer, sizeof buffer);
+        if (length < 0 && errno == EINTR) continue;
+        if (length < 0 && errno != EAGAIN) syserr("read deals");
+        if (length <= 0) {
+            //A followed file may still grow and a FIFO get a new writer
+            if (length == 0 && !this->follow) this->ended = true;
+            this->read_at = now + DEAL_RETRY_INTERVAL;
+            return;
+        }
+        total += length;
+        this->append(buffer, length);
+        this->parse_pending();
+    }
+}
+
+// Adds what was read to pending, with every line too long left empty.
+void DealSource::append(const char *data, size_t length) {
+    const char *end = data + length;
+    while (data < end) {
+        const char *newline = (const char *)memchr(data, '\n', end - data);
+        size_t part = (newline == nullptr ? end : newline) - data;
+        if (!this->dropping) {
+            this->line_length += part;
+            if (this->line_length <= DEAL_LINE_LIMIT) this->pending.append(data, part);
+            else {
+                cerr << "dropping a line over " << DEAL_LINE_LIMIT << " bytes, " << ++this->dropped << " so far" << endl;
+                this->pending.resize(this->pending.size() - (this->line_length - part));
+                this->dropping = true;
+            }
+        }
+        if (newline == nullptr) break;
+        //An empty line keeps the next ones in place, the deal with it is skipped as incorrect
+        this->pending += '\n';
+        this->line_length = 0;
+        this->dropping = false;
+        data = newline + 1;
+    }
+}
+
+int64_t DealSource::next_read() const {
+    if (!this->streaming() || this->ended || this->ahead.size() >= DEAL_READ_AHEAD / 2) return -1;
+    return this->read_at;
+}
+
+// Moves every complete deal of pending to the read-ahead queue.
+void DealSource::parse_pending() {
+    string lines[5];
+    size_t start = 0;
+    while (true) {
+        size_t end = start;
+        size_t second = 0;
+        int count = 0;
+        for (; count < 5; count++) {
+            size_t newline = this->pending.find('\n', end);
+            if (newline == string::npos) break;
+            lines[count] = this->pending.substr(end, newline - end);
+            end = newline + 1;
+            if (count == 0) second = end;
+        }
+        if (count < 5) break;
+        Round deal;
+        if (!this->parse(lines, deal)) {
+            //A line too many or too few would throw every later deal off, so look for a deal from the next line
+            if (!this->resyncing) {
+                cerr << "skipping incorrect deal " << this->parsed << endl;
+                this->parsed++;
+            }
+            this->resyncing = true;
+            start = second;
+            continue;
+        }
+        start = end;
+        this->resyncing = false;
+        deal.number = this->parsed++;
+        this->ahead.push_back(move(deal));
+    }
+    this->pending.erase(0, start);
+}
+
+// A file read whole is trusted, a stream is checked for a full deck.
+bool DealSource::parse(string lines[5], Round &deal) {
+    for (int i = 0; i < 5; i++) {
+        if (!lines[i].empty() && lines[i].back() == '\r') lines[i].pop_back();
+    }
+    if (this->streaming() && (lines[0].size() != 2 || lines[0][0] < '1' || lines[0][0] > '7'
+                              || place_number(lines[0][1]) == -1)) return false;
+    deal.type = lines[0][0] - '0';
+    deal.starting_player = lines[0][1];
+    uint64_t deck = 0;
+    for (int i = 0; i < 4; ++i) {
+        deal.player_cards[i] = string_to_card_vector(lines[i + 1]);
+        deal.player_cards_string[i] = lines[i + 1];
+        if (this->streaming()) {
+            if (deal.player_cards[i].size() != 13) return false;
+            for (const Card &card : deal.player_cards[i]) {
+                if (!is_color(card.color) || card.value < 2 || card.value > 14) return false;
+            }
+        }
+        deal.player_hands[i] = cards_to_mask(deal.player_cards[i]);
+        deck |= deal.player_hands[i];
+    }
+    return !this->streaming() || deck == (1ULL << 52) - 1;
+}
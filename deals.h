@@ -0,0 +1,79 @@
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+#ifndef MIM_DEALS_H
+#define MIM_DEALS_H
+
+// A streamed source keeps at most DEAL_READ_AHEAD parsed deals and reads
+// again once fewer than half are left. When nothing could be read it is
+// tried again after DEAL_RETRY_INTERVAL ms. One fill reads at most
+// DEAL_READ_LIMIT bytes, and a line longer than DEAL_LINE_LIMIT, which
+// no deal has, is dropped as it comes in.
+#define DEAL_READ_AHEAD      64
+#define DEAL_RETRY_INTERVAL  20
+#define DEAL_READ_SIZE       4096
+#define DEAL_READ_LIMIT      65536
+#define DEAL_LINE_LIMIT      64
+
+struct Round {
+    // Position of the deal in the file or the stream, from 0.
+    int64_t number = 0;
+    int type;
+    char starting_player;
+    std::vector<Card> player_cards[4];
+    std::string player_cards_string[4];
+    uint64_t player_hands[4];
+};
+
+// Deals of the server. A regular file is read whole and every table plays
+// it from the start. A pipe, a FIFO or a followed file (tail mode) is read
+// as it grows, every deal is given to the next table which needs one, and
+// the stream ends at end of file unless followed.
+class DealSource {
+public:
+    DealSource() = default;
+    DealSource(const DealSource &) = delete;
+    DealSource &operator=(const DealSource &) = delete;
+    ~DealSource();
+    // "-" is the standard input.
+    void open(const std::string &file, bool follow);
+    bool streaming() const { return this->fd != -1; }
+    // Gives the deal played as the round-th one at a table, false if it is not there (yet).
+    bool next(int round, Round &deal);
+    // No deal is ever going to be given for a table which played round deals.
+    bool exhausted(int round) const;
+    // next would give a deal to a table which played round deals.
+    bool ready(int round) const;
+    // Reads ahead without blocking, at most once per DEAL_RETRY_INTERVAL when the source is dry.
+    void fill(int64_t now);
+    // Time of the next read worth waiting for, -1 when nothing is due.
+    int64_t next_read() const;
+    // Number of deals in a file read whole.
+    int64_t size() const { return this->rounds.size(); }
+private:
+    std::vector<Round> rounds;
+    std::deque<Round> ahead;
+    std::string pending;
+    int fd = -1;
+    int original_flags = -1;
+    bool follow = false;
+    bool ended = false;
+    int64_t read_at = 0;
+    int64_t parsed = 0;
+    // Lines dropped for being too long, and the length of the line pending ends with.
+    int64_t dropped = 0;
+    size_t line_length = 0;
+    // The rest of a line too long is skipped up to its newline.
+    bool dropping = false;
+    // Lines are being dropped one by one after an incorrect deal until a correct one starts.
+    bool resyncing = false;
+    bool parse(std::string lines[5], Round &deal);
+    void append(const char *data, size_t length);
+    void parse_pending();
+};
+
+#endif
@@ -0,0 +1,415 @@
+#include <cstring>
+#include <algorithm>
+#include <set>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "protocol.h"
+#include "endgame.h"
+
+using namespace std;
+
+// What every card is worth in every round type, and its class: the place of
+// that worth among the worths of the type, small enough for 3 bits.
+struct Worths {
+    int worth[8][52];
+    int kind[8][52];
+    int trick[8][14];
+    Worths() {
+        for (int type = 1; type <= 7; type++) {
+            set<int> distinct;
+            for (int id = 0; id < 52; id++) {
+                this->worth[type][id] = trick_points(type, 2, {id_to_card(id)}) - trick_points(type, 2, {});
+                distinct.insert(this->worth[type][id]);
+            }
+            vector<int> sorted(distinct.begin(), distinct.end());
+            for (int id = 0; id < 52; id++) {
+                this->kind[type][id] = lower_bound(sorted.begin(), sorted.end(), this->worth[type][id]) - sorted.begin();
+            }
+            for (int number = 1; number <= 13; number++) this->trick[type][number] = trick_points(type, number, {});
+        }
+    }
+};
+
+static const Worths worths;
+
+static const uint64_t SUIT_MASK = (1ull << 13) - 1;
+
+static uint64_t hash_key(uint64_t key) {
+    uint64_t hash = key * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Key of a position; order[i] is the suit at place i of the sorted order.
+static uint64_t canonical(const EndgamePosition &position, int order[4]) {
+    uint64_t all = position.hands[0] | position.hands[1] | position.hands[2] | position.hands[3];
+    uint64_t codes[4];
+    int lengths[4];
+    //Suit described as its length, then 5 bits per card from the highest, left aligned so that they sort
+    uint64_t sorting[4];
+    for (int suit = 0; suit < 4; suit++) {
+        codes[suit] = 0;
+        lengths[suit] = 0;
+        for (int value = 12; value >= 0; value--) {
+            int id = suit * 13 + value;
+            if ((all >> id & 1) == 0) continue;
+            int holder = 0;
+            while ((position.hands[holder] >> id & 1) == 0) holder++;
+            int seat = (holder - position.leader + 4) % 4;
+            codes[suit] = codes[suit] << 5 | seat << 3 | worths.kind[position.type][id];
+            lengths[suit]++;
+        }
+        sorting[suit] = (uint64_t)lengths[suit] << 60 | (lengths[suit] == 0 ? 0 : codes[suit] << (60 - 5 * lengths[suit]));
+        order[suit] = suit;
+    }
+    sort(order, order + 4, [&](int a, int b) { return sorting[a] > sorting[b]; });
+    //At most 3 + 4 * 4 + 5 * 4 * ENDGAME_MAX_CARDS bits
+    uint64_t key = position.type;
+    for (int i = 0; i < 4; i++) {
+        int suit = order[i];
+        key = key << 4 | lengths[suit];
+        key = key << (5 * lengths[suit]) | codes[suit];
+    }
+    return key;
+}
+
+EndgameTable::~EndgameTable() {
+    if (this->mapping != nullptr) munmap(this->mapping, this->mapping_size);
+}
+
+void EndgameTable::open(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) syserr("cannot open %s", path.c_str());
+    struct stat info;
+    if (fstat(fd, &info) < 0) syserr("fstat");
+    if ((size_t)info.st_size < sizeof(EndgameHeader)) fatal("Incompatible endgame file %s", path.c_str());
+    this->mapping_size = info.st_size;
+    void *data = mmap(nullptr, this->mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) syserr("mmap");
+    close(fd);
+    this->mapping = data;
+    const EndgameHeader *header = (const EndgameHeader *)data;
+    if (header->magic != ENDGAME_MAGIC || header->record_size != sizeof(EndgameRecord)
+        || *max_element(header->cards + 1, header->cards + 8) > ENDGAME_MAX_CARDS
+        || header->slots == 0 || (header->slots & (header->slots - 1)) != 0
+        || sizeof(EndgameHeader) + header->slots * sizeof(EndgameRecord) != this->mapping_size) {
+        fatal("Incompatible endgame file %s", path.c_str());
+    }
+    this->header = header;
+    this->records = (const EndgameRecord *)(header + 1);
+}
+
+bool EndgameTable::probe(const EndgamePosition &position, int points[4], int *lead) const {
+    if (this->header == nullptr) return false;
+    int order[4];
+    uint64_t key = canonical(position, order);
+    uint64_t slots = this->header->slots;
+    uint64_t i = hash_key(key) & (slots - 1);
+    for (uint64_t probes = 0; probes < slots; probes++) {
+        const EndgameRecord &record = this->records[i];
+        if (record.key == 0) return false;
+        if (record.key == key) {
+            for (int seat = 0; seat < 4; seat++) points[(position.leader + seat) % 4] = record.points[seat];
+            if (lead != nullptr) {
+                int suit = order[record.lead / 16];
+                uint64_t all = position.hands[0] | position.hands[1] | position.hands[2] | position.hands[3];
+                int place = record.lead % 16;
+                for (int value = 12; value >= 0; value--) {
+                    if ((all >> (suit * 13 + value) & 1) == 0) continue;
+                    if (place-- == 0) *lead = suit * 13 + value;
+                }
+            }
+            return true;
+        }
+        i = (i + 1) & (slots - 1);
+    }
+    return false;
+}
+
+// Fewer points for the seat, then more for the others, the seat after it first. Positions with one key
+// must choose alike, so the card itself cannot break ties.
+static bool better(const int result[4], const int points[4], int seat) {
+    if (result[seat] != points[seat]) return result[seat] < points[seat];
+    int sum = result[0] + result[1] + result[2] + result[3];
+    int total = points[0] + points[1] + points[2] + points[3];
+    if (sum != total) return sum > total;
+    for (int i = 1; i < 4; i++) {
+        int other = (seat + i) % 4;
+        if (result[other] != points[other]) return result[other] > points[other];
+    }
+    return false;
+}
+
+bool EndgameTable::search(int type, int trick_number, uint64_t hands[4], int leader, int trick[4], int played,
+                          int points[4], int &best) const {
+    if (played == 4) {
+        int winner = 0;
+        for (int i = 1; i < 4; i++) {
+            if (trick[i] / 13 == trick[0] / 13 && trick[i] > trick[winner]) winner = i;
+        }
+        winner = (leader + winner) % 4;
+        if (trick_number == 13) {
+            for (int seat = 0; seat < 4; seat++) points[seat] = 0;
+        }
+        else {
+            EndgamePosition next = {type, winner, {hands[0], hands[1], hands[2], hands[3]}};
+            if (!this->probe(next, points)) return false;
+        }
+        points[winner] += worths.trick[type][trick_number];
+        for (int i = 0; i < 4; i++) points[winner] += worths.worth[type][trick[i]];
+        return true;
+    }
+    int seat = (leader + played) % 4;
+    uint64_t legal = hands[seat];
+    if (played > 0 && (hands[seat] & SUIT_MASK << (trick[0] / 13 * 13)) != 0) {
+        legal &= SUIT_MASK << (trick[0] / 13 * 13);
+    }
+    if (legal == 0) return false;
+    best = -1;
+    for (; legal != 0; legal &= legal - 1) {
+        int id = __builtin_ctzll(legal);
+        int result[4];
+        int next;
+        hands[seat] ^= 1ull << id;
+        trick[played] = id;
+        bool found = this->search(type, trick_number, hands, leader, trick, played + 1, result, next);
+        hands[seat] ^= 1ull << id;
+        if (!found) return false;
+        if (best == -1 || better(result, points, seat)) {
+            for (int i = 0; i < 4; i++) points[i] = result[i];
+            best = id;
+        }
+    }
+    return true;
+}
+
+bool EndgameTable::best_card(int type, int trick_number, const uint64_t hands[4], int leader,
+                             const vector<Card> &trick, Card &card) const {
+    if (!this->covers(type, trick_number) || trick.size() >= 4) return false;
+    if (trick.empty()) {
+        EndgamePosition position = {type, leader, {hands[0], hands[1], hands[2], hands[3]}};
+        int points[4];
+        int lead;
+        if (!this->probe(position, points, &lead)) return false;
+        card = id_to_card(lead);
+        return true;
+    }
+    uint64_t left[4] = {hands[0], hands[1], hands[2], hands[3]};
+    int ids[4];
+    for (int i = 0; i < (int)trick.size(); i++) ids[i] = card_id(trick[i]);
+    int points[4];
+    int best;
+    if (!this->search(type, trick_number, left, leader, ids, trick.size(), points, best)) return false;
+    card = id_to_card(best);
+    return true;
+}
+
+// Deals the unseen cards to the seats which have room for them and have not shown out of their suit.
+struct Layouts {
+    const EndgameTable &table;
+    int type;
+    int trick_number;
+    int seat;
+    int leader;
+    int played;
+    int ids[4];
+    int voids[4];
+    int room[4];
+    vector<int> unseen;
+    uint64_t hands[4];
+    // Candidates of the seat and the points they took so far.
+    vector<int> candidates;
+    vector<int> taken;
+    bool failed = false;
+
+    void deal(size_t next) {
+        if (this->failed) return;
+        if (next == this->unseen.size()) {
+            this->play();
+            return;
+        }
+        int id = this->unseen[next];
+        for (int holder = 0; holder < 4; holder++) {
+            if (this->room[holder] == 0 || (this->voids[holder] >> (id / 13) & 1) != 0) continue;
+            this->room[holder]--;
+            this->hands[holder] |= 1ull << id;
+            this->deal(next + 1);
+            this->hands[holder] &= ~(1ull << id);
+            this->room[holder]++;
+        }
+    }
+
+    void play() {
+        for (size_t i = 0; i < this->candidates.size(); i++) {
+            int id = this->candidates[i];
+            int points[4];
+            int best;
+            this->hands[this->seat] ^= 1ull << id;
+            this->ids[this->played] = id;
+            bool found = this->table.search(this->type, this->trick_number, this->hands, this->leader, this->ids,
+                                            this->played + 1, points, best);
+            this->hands[this->seat] ^= 1ull << id;
+            if (!found) {
+                this->failed = true;
+                return;
+            }
+            this->taken[i] += points[this->seat];
+        }
+    }
+};
+
+bool EndgameTable::guess_card(int type, int trick_number, int seat, uint64_t hand, int leader,
+                              const vector<Card> &trick, uint64_t unseen, const int voids[4], Card &card) const {
+    if (!this->covers(type, trick_number) || trick.size() >= 4) return false;
+    Layouts layouts = {*this, type, trick_number, seat, leader, (int)trick.size(), {}, {}, {}, {}, {}, {}, {}};
+    for (int i = 0; i < 4; i++) {
+        layouts.voids[i] = voids[i];
+        layouts.hands[i] = 0;
+        layouts.room[i] = 14 - trick_number;
+    }
+    for (int i = 0; i < layouts.played; i++) {
+        layouts.ids[i] = card_id(trick[i]);
+        layouts.room[(leader + i) % 4]--;
+        if (layouts.ids[i] / 13 != layouts.ids[0] / 13) layouts.voids[(leader + i) % 4] |= 1 << (layouts.ids[0] / 13);
+    }
+    if (__builtin_popcountll(hand) != layouts.room[seat]) return false;
+    layouts.hands[seat] = hand;
+    layouts.room[seat] = 0;
+    for (; unseen != 0; unseen &= unseen - 1) layouts.unseen.push_back(__builtin_ctzll(unseen));
+    if ((int)layouts.unseen.size() != layouts.room[0] + layouts.room[1] + layouts.room[2] + layouts.room[3]) {
+        return false;
+    }
+    uint64_t legal = hand;
+    if (layouts.played > 0 && (hand & SUIT_MASK << (layouts.ids[0] / 13 * 13)) != 0) {
+        legal &= SUIT_MASK << (layouts.ids[0] / 13 * 13);
+    }
+    for (; legal != 0; legal &= legal - 1) layouts.candidates.push_back(__builtin_ctzll(legal));
+    if (layouts.candidates.empty()) return false;
+    layouts.taken.assign(layouts.candidates.size(), 0);
+    layouts.deal(0);
+    if (layouts.failed) return false;
+    size_t best = min_element(layouts.taken.begin(), layouts.taken.end()) - layouts.taken.begin();
+    card = id_to_card(layouts.candidates[best]);
+    return true;
+}
+
+void EndgameTable::insert(const EndgameRecord &record) {
+    uint64_t i = hash_key(record.key) & (this->built.slots - 1);
+    while (this->slots[i].key != 0) i = (i + 1) & (this->built.slots - 1);
+    this->slots[i] = record;
+    this->built.count++;
+}
+
+void EndgameTable::rehash(uint64_t slots) {
+    vector<EndgameRecord> old;
+    old.swap(this->slots);
+    this->built.slots = slots;
+    this->built.count = 0;
+    this->slots.assign(this->built.slots, EndgameRecord{});
+    this->header = &this->built;
+    this->records = this->slots.data();
+    for (const EndgameRecord &record : old) {
+        if (record.key != 0) this->insert(record);
+    }
+}
+
+void EndgameTable::build_level(int type, int cards) {
+    if (type < 1 || type > 7 || cards > ENDGAME_MAX_CARDS || cards != this->cards(type) + 1) {
+        fatal("Cannot build level %d of type %d", cards, type);
+    }
+    if (this->built.slots == 0) this->rehash(ENDGAME_SLOTS);
+    this->built.magic = ENDGAME_MAGIC;
+    this->built.record_size = sizeof(EndgameRecord);
+    int trick_number = 14 - cards;
+    int total = 4 * cards;
+    {
+        //Per suit and length, one set of values for every distinct list of worths from the highest card
+        vector<uint16_t> values[4][14];
+        for (int suit = 0; suit < 4; suit++) {
+            set<uint64_t> seen[14];
+            for (int mask = 0; mask < 1 << 13; mask++) {
+                int length = __builtin_popcount(mask);
+                if (length > total) continue;
+                uint64_t code = 0;
+                for (int value = 12; value >= 0; value--) {
+                    if (mask >> value & 1) code = code << 3 | worths.kind[type][suit * 13 + value];
+                }
+                if (seen[length].insert(code).second) values[suit][length].push_back(mask);
+            }
+        }
+        int lengths[4];
+        for (lengths[0] = 0; lengths[0] <= min(total, 13); lengths[0]++) {
+            for (lengths[1] = 0; lengths[1] <= min(total - lengths[0], 13); lengths[1]++) {
+                for (lengths[2] = 0; lengths[2] <= min(total - lengths[0] - lengths[1], 13); lengths[2]++) {
+                    lengths[3] = total - lengths[0] - lengths[1] - lengths[2];
+                    if (lengths[3] > 13) continue;
+                    size_t choice[4] = {0, 0, 0, 0};
+                    while (true) {
+                        vector<int> ids;
+                        for (int suit = 0; suit < 4; suit++) {
+                            uint16_t mask = values[suit][lengths[suit]][choice[suit]];
+                            for (int value = 0; value < 13; value++) {
+                                if (mask >> value & 1) ids.push_back(suit * 13 + value);
+                            }
+                        }
+                        vector<int> holders(total);
+                        for (int i = 0; i < total; i++) holders[i] = i / cards;
+                        do {
+                            EndgamePosition position = {type, 0, {0, 0, 0, 0}};
+                            for (int i = 0; i < total; i++) position.hands[holders[i]] |= 1ull << ids[i];
+                            int points[4];
+                            if (this->probe(position, points)) continue;
+                            EndgameRecord record = {};
+                            int order[4];
+                            record.key = canonical(position, order);
+                            int trick[4];
+                            int best;
+                            if (!this->search(type, trick_number, position.hands, 0, trick, 0, points, best)) {
+                                fatal("Endgame level %d of type %d is missing positions", cards - 1, type);
+                            }
+                            for (int seat = 0; seat < 4; seat++) record.points[seat] = points[seat];
+                            int place = find(order, order + 4, best / 13) - order;
+                            uint64_t all = position.hands[0] | position.hands[1] | position.hands[2] | position.hands[3];
+                            uint64_t above = all & SUIT_MASK << (best / 13 * 13) & ~((2ull << best) - 1);
+                            record.lead = place * 16 + __builtin_popcountll(above);
+                            if ((this->built.count + 1) * 2 > this->built.slots) this->rehash(this->built.slots * 2);
+                            this->insert(record);
+                        } while (next_permutation(holders.begin(), holders.end()));
+                        //Next combination of values, the last suit fastest
+                        int suit = 3;
+                        while (suit >= 0 && ++choice[suit] == values[suit][lengths[suit]].size()) choice[suit--] = 0;
+                        if (suit < 0) break;
+                    }
+                }
+            }
+        }
+    }
+    this->built.cards[type] = cards;
+}
+
+void EndgameTable::save(const string &path) {
+    //Lookups only hit, a fuller table probes little more and maps much less
+    uint64_t slots = ENDGAME_SLOTS;
+    while (slots * 3 < this->built.count * 4) slots *= 2;
+    if (slots < this->built.slots) this->rehash(slots);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) syserr("cannot open %s", path.c_str());
+    const char *data[2] = {(const char *)&this->built, (const char *)this->slots.data()};
+    size_t sizes[2] = {sizeof this->built, this->slots.size() * sizeof(EndgameRecord)};
+    for (int part = 0; part < 2; part++) {
+        size_t done = 0;
+        while (done < sizes[part]) {
+            ssize_t written = write(fd, data[part] + done, sizes[part] - done);
+            if (written < 0) syserr("write");
+            done += written;
+        }
+    }
+    if (close(fd) < 0) syserr("close");
+}
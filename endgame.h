@@ -0,0 +1,98 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+#ifndef MIM_ENDGAME_H
+#define MIM_ENDGAME_H
+
+// An endgame table gives, for every round type and every way the cards of
+// the last tricks can lie, the points each seat takes from the start of a
+// trick to the end of the deal. Play is with all hands known, every seat
+// taking as few points as it can; between cards as good for it, a seat
+// leaves the others the most.
+//
+// Positions are abstract. Within a suit only the order of the cards left
+// matters and what each card is worth in the round type, so a suit is the
+// list of (seat, worth) from its highest card down, seats counted from the
+// leader, and the suits are sorted. Records are an open-addressing hash in
+// a file mapped read only, shared by every process that plays with it.
+#define ENDGAME_MAGIC      0x4b454731
+#define ENDGAME_MAX_CARDS  2
+#define ENDGAME_SLOTS      65536
+
+struct EndgameHeader {
+    uint32_t magic;
+    uint32_t record_size;
+    // Per round type, cards per hand at the start of the earliest trick in the table.
+    uint8_t cards[8];
+    uint64_t count;
+    // A power of two.
+    uint64_t slots;
+};
+
+struct EndgameRecord {
+    // 0 in an empty slot.
+    uint64_t key;
+    // Points from the leader on, clockwise.
+    uint8_t points[4];
+    // Card to lead, the suit in the sorted order times 16 plus the place of
+    // the card in its suit, from the highest card left.
+    uint8_t lead;
+    uint8_t unused[3];
+};
+
+// Start of a trick, hands as masks of card_id.
+struct EndgamePosition {
+    int type;
+    int leader;
+    uint64_t hands[4];
+};
+
+struct Layouts;
+
+class EndgameTable {
+public:
+    EndgameTable() = default;
+    EndgameTable(const EndgameTable &) = delete;
+    EndgameTable &operator=(const EndgameTable &) = delete;
+    ~EndgameTable();
+    void open(const std::string &path);
+    // Cards per hand the table starts at in a round type, 0 when there is no table.
+    int cards(int type) const { return this->header == nullptr || type < 1 || type > 7 ? 0 : this->header->cards[type]; }
+    // Whether a trick is close enough to the end to be played from the table.
+    bool covers(int type, int trick_number) const { return 13 - trick_number < this->cards(type); }
+    // Points of every seat by place number, false if the position is not in the table.
+    bool probe(const EndgamePosition &position, int points[4], int *lead = nullptr) const;
+    // Card of the seat to play with all hands known, trick the cards played so far.
+    bool best_card(int type, int trick_number, const uint64_t hands[4], int leader,
+                   const std::vector<Card> &trick, Card &card) const;
+    // Card of a seat which knows only its own hand. Every layout of the unseen cards which fits the hand
+    // sizes and the suits seats have shown out of is played out with all hands known, and the card taking
+    // the fewest points over all of them is chosen. voids holds a mask of suits per seat.
+    bool guess_card(int type, int trick_number, int seat, uint64_t hand, int leader, const std::vector<Card> &trick,
+                    uint64_t unseen, const int voids[4], Card &card) const;
+    // Generator: adds every position of a round type with cards cards per hand, in memory. The levels
+    // below must be in.
+    void build_level(int type, int cards);
+    // Packs the hash before it writes it.
+    void save(const std::string &path);
+    uint64_t size() const { return this->header == nullptr ? 0 : this->header->count; }
+    uint64_t capacity() const { return this->header == nullptr ? 0 : this->header->slots; }
+private:
+    friend struct Layouts;
+    const EndgameHeader *header = nullptr;
+    const EndgameRecord *records = nullptr;
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+    // Storage of a table being built.
+    EndgameHeader built = {};
+    std::vector<EndgameRecord> slots;
+    bool search(int type, int trick_number, uint64_t hands[4], int leader, int trick[4], int played, int points[4],
+                int &best) const;
+    void insert(const EndgameRecord &record);
+    void rehash(uint64_t slots);
+};
+
+#endif
@@ -0,0 +1,1612 @@
+#include <iostream>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "err.h"
+#include "alloc.h"
+#include "trace.h"
+#include "results.h"
+#include "pipeline.h"
+#include "handoff.h"
+#include "slab.h"
+#include "deals.h"
+#include "admin.h"
+#include "net.h"
+#include "game.h"
+
+#define QUEUE_LENGTH     5
+// Reads start at READ_SIZE_MIN bytes and double for a connection whose
+// reads fill them, up to READ_SIZE_MAX, and halve again when they don't.
+#define READ_SIZE_MIN    1024
+#define READ_SIZE_MAX    16384
+// Messages handled per connection in one iteration of the loop. A peer
+// with more waiting is not read from until they are handled, so a burst
+// waits in its own socket instead of in front of everyone else.
+#define MESSAGE_BUDGET   16
+// WRONG answers per connection: a burst of WRONG_BURST, then one per
+// WRONG_INTERVAL ms. Cards over the limit are logged but not answered.
+#define WRONG_BURST      20
+#define WRONG_INTERVAL   100
+// Output queue limits per connection, in bytes. Above the high watermark
+// TRICK resends are dropped until the queue drains below the low one,
+// a peer whose queue reaches the limit is disconnected.
+#define WRITE_LOW_WATERMARK   4096
+#define WRITE_HIGH_WATERMARK  16384
+#define WRITE_LIMIT           65536
+#define MESSAGE_SIZE          64
+
+using namespace std;
+
+static volatile sig_atomic_t stats_requested = 0;
+
+void request_stats(int) {
+    stats_requested = 1;
+}
+
+int listen_tcp(Net &net, uint16_t port) {
+    sockaddr_in6 server_address = {};
+    server_address.sin6_family = AF_INET6;
+    server_address.sin6_addr = in6addr_any;
+    server_address.sin6_port = htons(port);
+    return net.listen((struct sockaddr *) &server_address, (socklen_t) sizeof server_address, QUEUE_LENGTH);
+}
+
+int listen_unix(Net &net, const string &path) {
+    sockaddr_un server_address = {};
+    server_address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof server_address.sun_path) fatal("Socket path %s is too long", path.c_str());
+    strcpy(server_address.sun_path, path.c_str());
+    ::unlink(path.c_str());
+    return net.listen((struct sockaddr *) &server_address, (socklen_t) sizeof server_address, QUEUE_LENGTH);
+}
+
+static string cards_to_string(const vector<Card> &cards) {
+    string result;
+    for (Card card : cards) result += card_to_string(card);
+    return result;
+}
+
+void Player::save(StateWriter &state) const {
+    state.put(this->id);
+    state.put(this->round_points);
+    state.put(this->total_points);
+    state.put(this->bot);
+    state.put(this->vacated);
+    state.put((int64_t)this->token);
+    state.put(this->name);
+    state.put(this->named);
+    state.put(cards_to_string(this->cards));
+}
+
+void Player::load(StateReader &state) {
+    this->id = state.get();
+    this->round_points = state.get();
+    this->total_points = state.get();
+    this->bot = state.get();
+    this->vacated = state.get();
+    this->token = state.get();
+    this->name = state.get_string();
+    this->named = state.get();
+    this->cards = string_to_card_vector(state.get_string());
+}
+
+void Player::remove_card(Card card) {
+    for (int i = 0; i < (int)this->cards.size(); i++) {
+        if (this->cards[i].color == card.color && this->cards[i].value == card.value) {
+            this->cards.erase(this->cards.begin() + i);
+            break;
+        }
+    }
+}
+
+void Player::give_cards(vector<Card> cards) {
+    this->cards = cards;
+}
+
+bool Player::can_play(vector<Card> &trick_cards, Card card) {
+    return ::can_play(this->cards, trick_cards, card);
+}
+
+Card Player::choose_card(vector<Card> &trick_cards) {
+    return ::choose_card(this->cards, trick_cards);
+}
+
+uint64_t Player::hand() const {
+    return cards_to_mask(this->cards);
+}
+
+Game::Game(Net &net, uint16_t port, string unix_path, string admin_path, string file, bool follow, int timeout,
+           bool lobby, int bot_grace, int tournament, int control) : net(net) {
+    this->deals.open(file, follow);
+    this->timeout = timeout;
+    this->lobby = lobby;
+    this->bot_grace = bot_grace;
+    this->tournament = tournament;
+    if (control != -1) {
+        this->adopt(control);
+        return;
+    }
+    this->add_listener(listen_tcp(this->net, port));
+    if (unix_path != "") {
+        this->add_listener(listen_unix(this->net, unix_path));
+        this->unix_path = unix_path;
+    }
+    if (admin_path != "") {
+        this->admin.open(admin_path);
+        this->admin_slot = this->pollfds.size();
+        this->pollfds.push_back({this->admin.fd(), POLLIN, 0});
+        this->clients.emplace_back();
+        this->clients.back().used = true;
+        this->listener_names.push_back("");
+    }
+    this->first_client = this->pollfds.size();
+    if (!this->lobby) this->open_table();
+}
+
+void Game::run() {
+    char buffer[READ_SIZE_MAX];
+
+    while(true) {
+        for (int i = 0; i < (int)this->pollfds.size(); i++) this->pollfds[i].revents = 0;
+        int64_t poll_start = this->trace.start();
+        int timeout = this->poll_timeout(this->net.now());
+        int poll_status = this->net.poll(this->pollfds.data(), this->pollfds.size(), timeout);
+        if (poll_status < 0 && errno != EINTR) syserr("poll");
+        this->trace.span(TRACE_POLL, poll_start, -1, -1);
+        if (stats_requested) {
+            stats_requested = 0;
+            this->print_stats();
+        }
+        this->check_timeouts(this->net.now());
+        //Read from all clients
+        for (int i = this->first_client; i < (int)this->pollfds.size(); i++) {
+            if (this->pollfds[i].fd == -1) continue;
+            if (this->pollfds[i].revents & POLLIN) {
+                ClientInfo &client = this->clients[i];
+                int64_t read_start = this->trace.start();
+                int read_size = READ_SIZE_MIN << client.read_shift;
+                ssize_t message_length = this->net.read(this->pollfds[i].fd, buffer, read_size);
+                this->trace.span(TRACE_READ, read_start, client.table, client.place);
+                if (message_length < 0) continue;
+                if (message_length == 0) {
+                    this->drop_client(i);
+                    continue;
+                }
+                if (message_length == read_size && read_size < READ_SIZE_MAX) client.read_shift++;
+                else if (message_length < read_size / 2 && client.read_shift > 0) client.read_shift--;
+                ALLOC_BEGIN(ALLOC_READ);
+                bool stored = this->clients[i].read_buffer.append(this->buffers, string_view(buffer, message_length));
+                ALLOC_END();
+                //Hundreds of kilobytes without a whole message
+                if (!stored) {
+                    this->drop_client(i);
+                    continue;
+                }
+            }
+            if (this->pollfds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                this->drop_client(i);
+            }
+        }
+        int64_t handle_start = this->trace.start();
+        this->handle_messages();
+        this->trace.span(TRACE_HANDLE, handle_start, -1, -1);
+        this->remove_disconnected();
+        //Write to all clients
+        for (int i = this->first_client; i < (int)this->pollfds.size(); i++) {
+            if (this->pollfds[i].fd == -1) continue;
+            if (this->pollfds[i].revents & POLLOUT) this->write_client(i);
+        }
+        //Update pollfds
+        for (int i = this->first_client; i < (int)this->pollfds.size(); i++) {
+            if (this->pollfds[i].fd == -1) continue;
+            if (this->clients[i].disconnect) {
+                this->pollfds[i].events = POLLOUT;
+                continue;
+            }
+            //A backlogged peer's further messages wait in its socket
+            this->pollfds[i].events = this->clients[i].backlogged ? 0 : POLLIN;
+            if (this->clients[i].pending() > 0) {
+                this->pollfds[i].events |= POLLOUT;
+            }
+        }
+        //Accept new clients
+        for (int i = 0; i < this->first_client; i++) {
+            if (i == this->control && (this->pollfds[i].revents & (POLLIN | POLLHUP))) this->handle_control();
+            else if (i == this->admin_slot) {
+                if (this->pollfds[i].revents & POLLIN) this->handle_admin();
+            }
+            else if (this->pollfds[i].revents & POLLIN) this->accept_client(i);
+            this->pollfds[i].revents = 0;
+            this->pollfds[i].events = POLLIN;
+        }
+        if (this->game_over) break;
+    }
+    //Flush remaining messages
+    for (int i = 0; i < this->first_client; i++) this->pollfds[i].events = 0;
+    while (true) {
+        bool pending = false;
+        for (int i = this->first_client; i < (int)this->pollfds.size(); i++) {
+            if (this->pollfds[i].fd == -1) continue;
+            if (this->clients[i].pending() == 0) {
+                this->net.close(this->pollfds[i].fd);
+                this->pollfds[i].fd = -1;
+                continue;
+            }
+            pending = true;
+            this->pollfds[i].events = POLLOUT;
+            this->pollfds[i].revents = 0;
+        }
+        if (!pending) break;
+        int poll_status = this->net.poll(this->pollfds.data(), this->pollfds.size(), this->timeout);
+        if (poll_status < 0 && errno != EINTR) syserr("poll");
+        if (poll_status == 0) break;
+        for (int i = this->first_client; i < (int)this->pollfds.size(); i++) {
+            if (this->pollfds[i].fd == -1) continue;
+            if (this->pollfds[i].revents & POLLOUT) this->write_client(i);
+            else if (this->pollfds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                this->clients[i].write_buffer.clear(this->buffers);
+                this->clients[i].sent = this->clients[i].queued;
+            }
+        }
+    }
+    //The console closes its own sockets
+    for (int i = 0; i < this->first_client; i++) {
+        if (i != this->admin_slot) this->net.close(this->pollfds[i].fd);
+    }
+    if (this->unix_path != "") ::unlink(this->unix_path.c_str());
+    this->print_stats();
+    ALLOC_REPORT();
+}
+
+void Game::run_pipelined() {
+    vector<string> ips;
+    vector<uint16_t> ports;
+    for (int i = 0; i < this->first_client; i++) {
+        ips.push_back(this->listener_names[i]);
+        ports.push_back(this->clients[i].port);
+    }
+    vector<pollfd> listeners(this->pollfds.begin(), this->pollfds.begin() + this->first_client);
+    //The admin console stays with the game state
+    if (this->admin_slot != -1) listeners[this->admin_slot].fd = -1;
+    this->io = make_unique<IoThread>(listeners, ips, ports, this->timeout);
+    this->io->start();
+    pollfd wakeup[2] = {{this->io->logic_fd(), POLLIN, 0}, {this->admin.fd(), POLLIN, 0}};
+    PipeEvent event;
+    while (!this->game_over) {
+        wakeup[0].revents = 0;
+        wakeup[1].revents = 0;
+        int poll_status = this->net.poll(wakeup, this->admin_slot != -1 ? 2 : 1, this->poll_timeout(this->net.now()));
+        if (poll_status < 0 && errno != EINTR) syserr("poll");
+        this->io->clear_logic_fd();
+        if (stats_requested) {
+            stats_requested = 0;
+            this->print_stats();
+        }
+        this->check_timeouts(this->net.now());
+        int64_t handle_start = this->trace.start();
+        while (this->io->pop(event)) this->handle_event(event);
+        this->play_tables();
+        this->trace.span(TRACE_HANDLE, handle_start, -1, -1);
+        this->remove_disconnected();
+        if (wakeup[1].revents & POLLIN) this->handle_admin();
+        this->io->flush();
+    }
+    //The I/O thread flushes what is queued and closes every socket
+    this->io->join();
+    for (int i = this->first_client; i < (int)this->clients.size(); i++) {
+        if (this->clients[i].used) this->clients[i].sent = this->io->sent(i);
+    }
+    if (this->unix_path != "") ::unlink(this->unix_path.c_str());
+    this->print_stats();
+    ALLOC_REPORT();
+}
+
+void Game::handle_event(const PipeEvent &event) {
+    int id = event.slot;
+    if (event.kind == PIPE_CONNECT) {
+        if (id >= (int)this->clients.size()) {
+            this->clients.resize(id + 1);
+            this->pollfds.resize(id + 1, {-1, 0, 0});
+        }
+        ClientInfo client_info;
+        memcpy(&client_info.address, event.data, sizeof client_info.address);
+        client_info.port = event.port;
+        client_info.server = event.server;
+        client_info.deadline = this->net.now() + this->timeout;
+        client_info.used = true;
+        this->clients[id] = client_info;
+        //Only marks the slot as open, the socket belongs to the I/O thread
+        this->pollfds[id] = {id, 0, 0};
+        return;
+    }
+    if (!this->clients[id].used) return;
+    ClientInfo &client = this->clients[id];
+    if (event.kind == PIPE_MESSAGE) {
+        if (this->pollfds[id].fd == -1 || client.disconnect) return;
+        this->message.assign(event.data, event.length);
+        this->handle_message(id, this->message);
+    }
+    else if (event.kind == PIPE_SENT) {
+        client.sent = event.sent;
+        if (client.pending() < WRITE_LOW_WATERMARK) client.congested = false;
+    }
+    else if (event.kind == PIPE_LINE_TOO_LONG) this->stats.lines_too_long++;
+    else if (event.kind == PIPE_CLOSED) this->drop_client(id);
+}
+
+void Game::remove_disconnected() {
+    for (int i = this->first_client; i < (int)this->pollfds.size(); i++) {
+        if (!this->clients[i].used) continue;
+        if (this->clients[i].disconnect && this->clients[i].pending() == 0) {
+            this->drop_client(i);
+        }
+        if (this->pollfds[i].fd == -1) this->release_client(i);
+    }
+}
+
+void Game::add_listener(int socket_fd) {
+    this->pollfds.push_back({socket_fd, POLLIN, 0});
+
+    ClientInfo server_info;
+    sockaddr_storage server_address;
+    this->net.local_address(socket_fd, server_address);
+    if (server_address.ss_family == AF_UNIX) {
+        this->unix_listener = this->clients.size();
+        this->listener_names.push_back(((sockaddr_un *) &server_address)->sun_path);
+        server_info.port = 0;
+    }
+    else {
+        sockaddr_in6 *address = (sockaddr_in6 *) &server_address;
+        server_info.port = ntohs(address->sin6_port);
+        char buffer[INET6_ADDRSTRLEN];
+        if (inet_ntop(AF_INET6, &address->sin6_addr, buffer, INET6_ADDRSTRLEN) == nullptr) {
+            syserr("inet_ntop");
+        }
+        this->listener_names.push_back(buffer);
+    }
+    server_info.used = true;
+    this->clients.push_back(server_info);
+}
+
+void Game::adopt(int channel) {
+    vector<int> fds;
+    string state;
+    if (!receive_handoff(channel, fds, state)) fatal("No handoff from the supervisor");
+    if (!state.empty()) {
+        StateReader reader(state);
+        this->load_state(reader, fds);
+        this->pollfds[this->control].fd = channel;
+        //Only now the previous process may exit
+        if (!send_command(channel, COMMAND_ACCEPTED, -1)) fatal("Handoff channel closed");
+        return;
+    }
+    //A fresh worker gets just the listeners
+    for (int fd : fds) this->add_listener(fd);
+    this->control = this->pollfds.size();
+    this->pollfds.push_back({channel, POLLIN, 0});
+    this->clients.emplace_back();
+    this->clients.back().used = true;
+    this->listener_names.push_back("");
+    this->first_client = this->pollfds.size();
+    if (!this->lobby) this->open_table();
+}
+
+void Game::handle_control() {
+    int control_fd = this->pollfds[this->control].fd;
+    char command;
+    int channel;
+    if (!receive_command(control_fd, command, channel)) {
+        //The supervisor is gone, the games in progress are played out
+        close(control_fd);
+        this->pollfds[this->control].fd = -1;
+        return;
+    }
+    if (command != COMMAND_UPGRADE || channel == -1) {
+        if (channel != -1) close(channel);
+        return;
+    }
+    //The transcript of this process ends before the next one starts writing
+    cout.flush();
+    StateWriter state;
+    this->save_state(state);
+    vector<int> fds;
+    for (int i = 0; i < this->first_client; i++) {
+        if (i != this->control) fds.push_back(this->pollfds[i].fd);
+    }
+    for (int i = this->first_client; i < (int)this->clients.size(); i++) {
+        if (this->clients[i].used && this->pollfds[i].fd != -1) fds.push_back(this->pollfds[i].fd);
+    }
+    char reply;
+    int unused;
+    bool accepted = send_handoff(channel, fds, state.data) && receive_command(channel, reply, unused)
+                    && reply == COMMAND_ACCEPTED;
+    close(channel);
+    if (!accepted) {
+        cerr << "handoff failed, keeping the games" << endl;
+        return;
+    }
+    //Sockets stay open in the new process, closing our copies does not end the connections
+    exit(HANDOFF_EXIT);
+}
+
+// Runs between two iterations of the game loop, so every answer sees one state of the game.
+void Game::handle_admin() {
+    this->admin.serve();
+    int connection;
+    while (this->admin.next_command(connection, this->message)) this->admin_command(connection, this->message);
+    this->admin.flush();
+}
+
+void Game::admin_command(int connection, const string &command) {
+    if (command == "tables" || command == "clients" || command == "all") {
+        this->take_snapshot(this->admin.list(connection), command != "clients", command != "tables");
+    }
+    else if (command.starts_with("kick ")) {
+        int id = 0;
+        from_chars(command.data() + 5, command.data() + command.size(), id);
+        if (id < this->first_client || id >= (int)this->clients.size() || !this->clients[id].used
+            || this->pollfds[id].fd == -1) {
+            this->admin.reply(connection, "ERROR no client " + command.substr(5));
+            return;
+        }
+        this->drop_client(id);
+        this->remove_disconnected();
+        this->admin.reply(connection, "OK");
+    }
+    else if (command == "stats") {
+        int active = 0;
+        for (const Table &table : this->tables) active += table.active;
+        int connected = 0;
+        int64_t queued_now = 0;
+        for (int i = this->first_client; i < (int)this->clients.size(); i++) {
+            if (!this->clients[i].used) continue;
+            connected++;
+            queued_now += this->clients[i].pending();
+        }
+        char line[256];
+        snprintf(line, sizeof line, "tables %d finished %d clients %d waiting N:%d E:%d S:%d W:%d any:%d "
+                 "bytes_queued %lld bytes_pending %lld peers_dropped %lld tricks_coalesced %lld lines_too_long %lld "
+                 "wrongs_suppressed %lld",
+                 active, this->tables_finished, connected, this->queue_size[0], this->queue_size[1],
+                 this->queue_size[2], this->queue_size[3], this->queue_size[4], (long long)this->stats.bytes_queued,
+                 (long long)queued_now, (long long)this->stats.peers_dropped, (long long)this->stats.tricks_coalesced,
+                 (long long)this->stats.lines_too_long, (long long)this->stats.wrongs_suppressed);
+        this->admin.reply(connection, line);
+    }
+    else this->admin.reply(connection, "ERROR commands are tables, clients, all, stats and kick <client>");
+}
+
+// Plain copies, formatting is left to the console a slice at a time.
+void Game::take_snapshot(AdminSnapshot &snapshot, bool tables, bool clients) {
+    for (int t = 0; tables && t < (int)this->tables.size(); t++) {
+        const Table &table = this->tables[t];
+        if (!table.active) continue;
+        AdminTable row;
+        row.table = t;
+        row.number = table.number;
+        row.phase = table.phase;
+        row.round = table.round;
+        row.trick_number = table.phase == 1 ? table.trick_number : 0;
+        row.current_player = table.phase == 1 ? table.current_player : 0;
+        row.connected_clients = table.connected_clients;
+        row.cards_on_table = table.trick_cards.size();
+        for (int i = 0; i < 4; i++) {
+            row.seats[i] = table.players[i].id;
+            row.bots[i] = table.players[i].bot;
+        }
+        snapshot.tables.push_back(row);
+    }
+    for (int i = this->first_client; clients && i < (int)this->clients.size(); i++) {
+        const ClientInfo &client = this->clients[i];
+        if (!client.used) continue;
+        AdminClient row;
+        row.slot = i;
+        row.address = client.address;
+        row.port = client.port;
+        row.unix_peer = client.server == this->unix_listener;
+        row.place = client.place;
+        row.queue = client.queue;
+        row.binary = client.binary;
+        row.congested = client.congested;
+        row.disconnect = client.disconnect;
+        row.table = client.table;
+        //Pipelined, the buffers are the I/O thread's and only the pending count is known here
+        row.read_size = client.read_buffer.size();
+        row.write_size = client.write_buffer.size();
+        row.pending = client.pending();
+        snapshot.clients.push_back(row);
+    }
+}
+
+template <typename List>
+static void save_list(StateWriter &state, const List &list) {
+    state.put((int64_t)list.size());
+    for (int value : list) state.put(value);
+}
+
+template <typename List>
+static void load_list(StateReader &state, List &list) {
+    list.clear();
+    int64_t size = state.get();
+    for (int64_t i = 0; i < size; i++) list.push_back(state.get());
+}
+
+void Game::save_state(StateWriter &state) {
+    state.put(HANDOFF_VERSION);
+    state.put(this->deals.size());
+    state.put(this->first_client);
+    state.put(this->control);
+    state.put(this->tables_opened);
+    state.put(this->tables_finished);
+    state.put((int64_t)this->seatings);
+    for (int i = 0; i < 4; i++) state.put(this->seat_totals[i]);
+    state.put(this->unix_connections);
+    state.put(this->stats.bytes_queued);
+    state.put(this->stats.peers_dropped);
+    state.put(this->stats.tricks_coalesced);
+    state.put(this->stats.lines_too_long);
+    state.put(this->stats.wrongs_suppressed);
+
+    state.put((int64_t)this->clients.size());
+    for (int i = this->first_client; i < (int)this->clients.size(); i++) {
+        const ClientInfo &client = this->clients[i];
+        state.put(client.used);
+        if (!client.used) continue;
+        state.put(this->pollfds[i].fd != -1);
+        state.put(string((const char *) &client.address, sizeof client.address));
+        state.put(client.port);
+        state.put(string(client.write_buffer.view()));
+        state.put(string(client.read_buffer.view()));
+        state.put(client.place);
+        state.put(client.table);
+        state.put(client.queue);
+        state.put(client.queue_prev);
+        state.put(client.queue_next);
+        state.put(client.deadline);
+        state.put(client.server);
+        state.put(client.queued);
+        state.put(client.sent);
+        state.put(client.trick_end);
+        state.put(client.binary);
+        state.put(client.congested);
+        state.put(client.disconnect);
+        auto name = this->names.find(i);
+        state.put(name == this->names.end() ? string() : name->second);
+    }
+    save_list(state, this->free_slots);
+    for (int queue = 0; queue < 5; queue++) {
+        state.put(this->queue_head[queue]);
+        state.put(this->queue_tail[queue]);
+        state.put(this->queue_size[queue]);
+    }
+    for (int place = 0; place < 4; place++) save_list(state, this->vacant[place]);
+
+    state.put((int64_t)this->tables.size());
+    for (const Table &table : this->tables) {
+        state.put(table.number);
+        state.put(table.active);
+        state.put(table.game_over);
+        state.put(table.timeout_passed);
+        state.put(table.connected_clients);
+        state.put(table.current_player);
+        state.put(table.phase);
+        state.put(table.round);
+        state.put(table.trick_number);
+        state.put(table.deadline);
+        state.put(table.trick_sent_at);
+        state.put(table.trick_sent_to);
+        for (int i = 0; i < 4; i++) table.players[i].save(state);
+        for (int i = 0; i < 4; i++) state.put(table.last_scores[i]);
+        state.put(cards_to_string(table.trick_cards));
+        state.put(table.log);
+        state.put(table.frame_log);
+    }
+    save_list(state, this->free_tables);
+    state.put((int64_t)this->standings.size());
+    for (const Standing &standing : this->standings) {
+        state.put(standing.table);
+        state.put(standing.place);
+        state.put(standing.player);
+        state.put(standing.total);
+    }
+}
+
+// Inverse of save_state, fds are the listeners and then the open client sockets in slot order.
+void Game::load_state(StateReader &state, const vector<int> &fds) {
+    if (state.get() != HANDOFF_VERSION) fatal("Unsupported handoff state");
+    if (state.get() != this->deals.size()) fatal("Handoff from a server with other deals");
+    this->first_client = state.get();
+    this->control = state.get();
+    if ((int)fds.size() < this->first_client - 1) fatal("Handoff is missing sockets");
+    size_t next_fd = 0;
+    for (int i = 0; i < this->first_client; i++) {
+        if (i != this->control) this->add_listener(fds[next_fd++]);
+        else {
+            //The channel the state came through is the control channel from now on
+            this->pollfds.push_back({-1, POLLIN, 0});
+            this->clients.emplace_back();
+            this->clients.back().used = true;
+            this->listener_names.push_back("");
+        }
+    }
+    this->tables_opened = state.get();
+    this->tables_finished = state.get();
+    this->seatings = state.get();
+    for (int i = 0; i < 4; i++) this->seat_totals[i] = state.get();
+    this->unix_connections = state.get();
+    this->stats.bytes_queued = state.get();
+    this->stats.peers_dropped = state.get();
+    this->stats.tricks_coalesced = state.get();
+    this->stats.lines_too_long = state.get();
+    this->stats.wrongs_suppressed = state.get();
+
+    this->clients.resize(state.get());
+    this->pollfds.resize(this->clients.size(), {-1, 0, 0});
+    for (int i = this->first_client; i < (int)this->clients.size(); i++) {
+        ClientInfo &client = this->clients[i];
+        client.used = state.get();
+        if (!client.used) continue;
+        if (state.get()) {
+            if (next_fd == fds.size()) fatal("Handoff is missing sockets");
+            this->pollfds[i].fd = fds[next_fd++];
+        }
+        string address = state.get_string();
+        if (address.size() != sizeof client.address) fatal("Corrupted handoff state");
+        memcpy(&client.address, address.data(), sizeof client.address);
+        client.port = state.get();
+        client.write_buffer.append(this->buffers, state.get_string());
+        client.read_buffer.append(this->buffers, state.get_string());
+        client.place = state.get();
+        client.table = state.get();
+        client.queue = state.get();
+        client.queue_prev = state.get();
+        client.queue_next = state.get();
+        client.deadline = state.get();
+        client.server = state.get();
+        client.queued = state.get();
+        client.sent = state.get();
+        client.trick_end = state.get();
+        client.binary = state.get();
+        client.congested = state.get();
+        client.disconnect = state.get();
+        string name = state.get_string();
+        if (!name.empty()) this->names[i] = name;
+        this->pollfds[i].events = POLLIN;
+        if (client.pending() > 0) this->pollfds[i].events |= POLLOUT;
+        if (client.disconnect) this->pollfds[i].events = POLLOUT;
+    }
+    load_list(state, this->free_slots);
+    for (int queue = 0; queue < 5; queue++) {
+        this->queue_head[queue] = state.get();
+        this->queue_tail[queue] = state.get();
+        this->queue_size[queue] = state.get();
+    }
+    for (int place = 0; place < 4; place++) load_list(state, this->vacant[place]);
+
+    this->tables.resize(state.get());
+    for (Table &table : this->tables) {
+        table.number = state.get();
+        table.active = state.get();
+        table.game_over = state.get();
+        table.timeout_passed = state.get();
+        table.connected_clients = state.get();
+        table.current_player = state.get();
+        table.phase = state.get();
+        table.round = state.get();
+        table.trick_number = state.get();
+        table.deadline = state.get();
+        table.trick_sent_at = state.get();
+        table.trick_sent_to = state.get();
+        for (int i = 0; i < 4; i++) table.players[i].load(state);
+        for (int i = 0; i < 4; i++) table.last_scores[i] = state.get();
+        table.trick_cards = string_to_card_vector(state.get_string());
+        table.log = state.get_string();
+        table.frame_log = state.get_string();
+        if (table.active && table.phase == 1) this->deals.next(table.round, table.deal);
+    }
+    //Whatever the previous process had read but not handled yet
+    this->backlogged = true;
+    load_list(state, this->free_tables);
+    this->standings.resize(state.get());
+    for (Standing &standing : this->standings) {
+        standing.table = state.get();
+        standing.place = state.get();
+        standing.player = state.get_string();
+        standing.total = state.get();
+    }
+}
+
+void Game::accept_client(int listener) {
+    sockaddr_storage client_address;
+    int client_fd = this->net.accept(this->pollfds[listener].fd, client_address);
+    if (client_fd < 0) return;
+    ClientInfo client_info;
+    if (client_address.ss_family == AF_INET6) {
+        sockaddr_in6 *address = (sockaddr_in6 *) &client_address;
+        client_info.address = address->sin6_addr;
+        client_info.port = ntohs(address->sin6_port);
+    }
+    else {
+        //Unix peers are unnamed, number them instead of a port
+        client_info.port = ++this->unix_connections;
+    }
+    client_info.server = listener;
+    client_info.deadline = this->net.now() + this->timeout;
+    client_info.used = true;
+    if (this->free_slots.empty()) {
+        this->pollfds.push_back({client_fd, POLLIN, 0});
+        this->clients.push_back(client_info);
+    }
+    else {
+        int id = this->free_slots.back();
+        this->free_slots.pop_back();
+        this->pollfds[id] = {client_fd, POLLIN, 0};
+        this->clients[id] = client_info;
+    }
+}
+
+void Game::drop_client(int id) {
+    if (this->pollfds[id].fd == -1) return;
+    if (this->io) {
+        PipeEvent event = {};
+        event.kind = PIPE_CLOSE;
+        event.slot = id;
+        this->io->send(event);
+    }
+    else this->net.close(this->pollfds[id].fd);
+    this->pollfds[id].fd = -1;
+}
+
+void Game::write_client(int id) {
+    ClientInfo &client = this->clients[id];
+    int64_t write_start = this->trace.start();
+    const char *data = client.write_buffer.data();
+    ssize_t message_length = this->net.write(this->pollfds[id].fd, data, client.write_buffer.size());
+    this->trace.span(TRACE_WRITE, write_start, client.table, client.place);
+    if (message_length < 0) return;
+    client.write_buffer.consume(this->buffers, message_length);
+    client.sent += message_length;
+    if (client.pending() < WRITE_LOW_WATERMARK) client.congested = false;
+}
+
+void Game::print_stats() {
+    int64_t queued_now = 0;
+    for (int i = this->first_client; i < (int)this->clients.size(); i++) {
+        if (this->clients[i].used) queued_now += this->clients[i].pending();
+    }
+    ALLOC_REPORT();
+    this->trace.flush();
+    cerr << "bytes_queued " << this->stats.bytes_queued << " bytes_pending " << queued_now
+         << " peers_dropped " << this->stats.peers_dropped
+         << " tricks_coalesced " << this->stats.tricks_coalesced
+         << " lines_too_long " << this->stats.lines_too_long
+         << " wrongs_suppressed " << this->stats.wrongs_suppressed;
+    if (this->trace.enabled()) cerr << " trace_dropped " << this->trace.dropped();
+    cerr << endl;
+}
+
+void Game::release_client(int id) {
+    ClientInfo &client = this->clients[id];
+    int vacated = -1;
+    if (client.queue != -1) this->unlink(id);
+    if (client.place != -1) {
+        Table &table = this->tables[client.table];
+        table.players[client.place].id = 0;
+        if (table.round > 0 || table.phase > 0) table.players[client.place].vacated = this->net.now();
+        table.connected_clients--;
+        if (this->lobby && !table.game_over) {
+            this->vacant[client.place].push_back(client.table);
+            vacated = client.place;
+        }
+    }
+    client.read_buffer.clear(this->buffers);
+    client.write_buffer.clear(this->buffers);
+    client = ClientInfo();
+    this->names.erase(id);
+    //The I/O thread hands out slots when pipelined
+    if (!this->io) this->free_slots.push_back(id);
+    if (vacated != -1) this->fill_vacancy(vacated);
+}
+
+// A seat given up at a running table goes to a client already waiting for it, before any new arrival.
+void Game::fill_vacancy(int place) {
+    int queue = this->queue_size[place] > 0 ? place : 4;
+    if (this->queue_size[queue] == 0) return;
+    int id = this->dequeue(queue);
+    if (!this->take_vacant_seat(id, queue)) this->enqueue(id, queue);
+}
+
+void Game::check_timeouts(int64_t now) {
+    for (int i = this->first_client; i < (int)this->clients.size(); i++) {
+        ClientInfo &client = this->clients[i];
+        if (!client.used || client.disconnect || client.place != -1 || client.queue != -1) continue;
+        if (now >= client.deadline) this->drop_client(i);
+    }
+    for (int t = 0; t < (int)this->tables.size(); t++) {
+        Table &table = this->tables[t];
+        table.timeout_passed = table.active && table.phase == 1 && table.deadline != -1 && now >= table.deadline;
+        if (!table.active || this->bot_grace < 0) continue;
+        for (int i = 0; i < 4; i++) {
+            Player &player = table.players[i];
+            if (player.id != 0 || player.bot || player.vacated == -1) continue;
+            if (now >= player.vacated + this->bot_grace) {
+                player.bot = true;
+                table.connected_clients++;
+            }
+        }
+    }
+}
+
+int Game::poll_timeout(int64_t now) {
+    if (this->backlogged) return 0;
+    int64_t next = -1;
+    for (int i = this->first_client; i < (int)this->clients.size(); i++) {
+        ClientInfo &client = this->clients[i];
+        if (!client.used || client.disconnect || client.place != -1 || client.queue != -1) continue;
+        if (next == -1 || client.deadline < next) next = client.deadline;
+    }
+    for (int t = 0; t < (int)this->tables.size(); t++) {
+        Table &table = this->tables[t];
+        if (!table.active) continue;
+        if (this->bot_grace >= 0) {
+            for (int i = 0; i < 4; i++) {
+                Player &player = table.players[i];
+                if (player.id != 0 || player.bot || player.vacated == -1) continue;
+                if (next == -1 || player.vacated + this->bot_grace < next) next = player.vacated + this->bot_grace;
+            }
+        }
+        //A full table between deals is dealt to without any input, and one of bots plays the deal through
+        if (table.phase == 0 && table.connected_clients == 4 && this->deals.ready(table.round)) return 0;
+        //Waiting for the deal stream
+        int64_t read_at = this->deals.next_read();
+        if (table.phase == 0 && table.connected_clients == 4 && read_at != -1 && (next == -1 || read_at < next)) {
+            next = read_at;
+        }
+        //A table short of players waits for them, not for its deadline
+        if (table.phase != 1 || table.deadline == -1 || table.connected_clients != 4) continue;
+        if (next == -1 || table.deadline < next) next = table.deadline;
+    }
+    if (next == -1) return -1;
+    return next > now ? (int)(next - now) : 0;
+}
+
+void Game::handle_messages() {
+    //Recieve messages, round robin and at most MESSAGE_BUDGET per connection
+    int count = this->pollfds.size() - this->first_client;
+    int start = this->next_served < this->first_client || this->next_served >= (int)this->pollfds.size()
+                ? this->first_client : this->next_served;
+    this->next_served = start + 1;
+    this->backlogged = false;
+    for (int k = 0; k < count; k++) {
+        int i = start + k < (int)this->pollfds.size() ? start + k : start + k - count;
+        ClientInfo &client = this->clients[i];
+        client.backlogged = false;
+        if (this->pollfds[i].fd == -1 || client.disconnect) continue;
+        string &message = this->message;
+        int budget = MESSAGE_BUDGET;
+        while (budget > 0 && this->next_message(i, message)) {
+            budget--;
+            if (message.empty()) continue;
+            this->log_message(i, this->clients[i].server, message);
+            if (!this->handle_message(i, message)) break;
+        }
+        if (budget == 0 && !this->clients[i].disconnect) {
+            this->clients[i].backlogged = true;
+            this->backlogged = true;
+        }
+    }
+    this->play_tables();
+}
+
+// Returns false once the client is dropped or disconnecting, its further messages are ignored.
+bool Game::handle_message(int i, const string &message) {
+    if (this->clients[i].place == -1) {
+        ALLOC_BEGIN(ALLOC_IAM);
+        bool binary;
+        uint64_t token;
+        string_view name;
+        bool iam = this->clients[i].queue == -1 && parse_iam(message, binary, token, name);
+        if (iam) {
+            this->clients[i].binary = binary;
+            this->handle_iam(i, message[3], token, name);
+        }
+        ALLOC_END();
+        if (!iam) {
+            this->drop_client(i);
+            return false;
+        }
+    }
+    else {
+        ALLOC_BEGIN(ALLOC_TRICK_IN);
+        int t = this->clients[i].table;
+        int number;
+        Card card;
+        bool trick = this->is_trick(message, number, card);
+        if (trick) {
+            if (this->check_trick(t, card, clients[i].place)) {
+                Table &table = this->tables[t];
+                this->trace.instant(TRACE_TRICK_RECEIVED, t, table.current_player);
+                //No span for a card the server has not asked for since the last one
+                if (table.trick_sent_at != 0) this->trace.span(TRACE_WAIT, table.trick_sent_at, t, table.current_player);
+                table.trick_sent_at = 0;
+                table.trick_cards.push_back(card);
+                table.players[table.current_player].remove_card(card);
+                table.current_player = (table.current_player + 1) % 4;
+                table.trick_sent_to = 0;
+                table.timeout_passed = true;
+            }
+            else if (this->allow_wrong(i)) {
+                ALLOC_BEGIN(ALLOC_WRONG);
+                char response[MESSAGE_SIZE] = "WRONG";
+                char *end = to_chars(response + 5, response + MESSAGE_SIZE, this->tables[t].trick_number).ptr;
+                memcpy(end, "\r\n", 2);
+                char frame[FRAME_SIZE];
+                int frame_length = encode_wrong(frame, this->tables[t].trick_number);
+                this->send_message(i, string_view(response, end + 2 - response), string_view(frame, frame_length));
+            }
+        }
+        ALLOC_END();
+        if (!trick) {
+            this->drop_client(i);
+            return false;
+        }
+    }
+    return !this->clients[i].disconnect;
+}
+
+void Game::play_tables() {
+    this->deals.fill(this->net.now());
+    for (int t = 0; t < (int)this->tables.size(); t++) {
+        if (!this->tables[t].active) continue;
+        this->play_table(t);
+        if (this->tables[t].game_over) {
+            if (this->results.enabled()) this->store_result(t, RESULT_GAME);
+            if (this->tournament > 0) this->record_result(t);
+            if (this->lobby) this->close_table(t);
+            else this->game_over = true;
+        }
+    }
+}
+
+void Game::handle_iam(int id, char place, uint64_t token, string_view name) {
+    if (!name.empty()) this->names[id] = name;
+    if (!this->lobby) {
+        if (place == '*') {
+            this->drop_client(id);
+            return;
+        }
+        Table &table = this->tables[0];
+        if (table.players[place_number(place)].id == 0) {
+            this->seat_client(id, 0, place_number(place));
+        }
+        else {
+            string response = "BUSY";
+            for (int i = 0; i < 4; ++i) {
+                if (table.players[i].id != 0) response += "NESW"[i];
+            }
+            char frame[FRAME_SIZE];
+            int frame_length = encode_busy(frame, response.data() + 4, response.size() - 4);
+            response += "\r\n";
+            this->send_message(id, response, string_view(frame, frame_length));
+            this->clients[id].disconnect = true;
+        }
+        return;
+    }
+    if (token != 0) {
+        if (this->take_back_seat(id, token)) return;
+        //The game is over or the seat went to someone else, BUSY tells the client not to try again
+        char busy = "NESW"[token % 4];
+        char frame[FRAME_SIZE];
+        int frame_length = encode_busy(frame, &busy, 1);
+        this->send_message(id, string("BUSY") + busy + "\r\n", string_view(frame, frame_length));
+        this->clients[id].disconnect = true;
+        return;
+    }
+    int queue = place == '*' ? 4 : place_number(place);
+    if (this->take_vacant_seat(id, queue)) return;
+    this->enqueue(id, queue);
+    this->match_players();
+}
+
+// A token is the table slot and place in its low 32 bits and the seating number above them, so a seat
+// given to anyone since matches no longer.
+bool Game::take_back_seat(int id, uint64_t token) {
+    int t = (token & 0xffffffff) / 4;
+    int place = token % 4;
+    if (t >= (int)this->tables.size()) return false;
+    Table &table = this->tables[t];
+    if (!table.active || table.game_over || table.players[place].token != token) return false;
+    int old = table.players[place].id;
+    if (old != 0) {
+        //The old connection of the same client, not noticed closed yet
+        this->clients[old].table = -1;
+        this->clients[old].place = -1;
+        this->clients[old].disconnect = true;
+        table.players[place].id = 0;
+        table.connected_clients--;
+    }
+    //Still the same player, whichever connection it came back on
+    Player &player = table.players[place];
+    string name = std::move(player.name);
+    bool named = player.named;
+    this->seat_client(id, t, place);
+    player.name = std::move(name);
+    player.named = named;
+    return true;
+}
+
+bool Game::take_vacant_seat(int id, int queue) {
+    for (int place = 0; place < 4; place++) {
+        if (queue != 4 && queue != place) continue;
+        while (!this->vacant[place].empty()) {
+            int t = this->vacant[place].front();
+            this->vacant[place].pop_front();
+            Table &table = this->tables[t];
+            if (!table.active || table.game_over || table.players[place].id != 0) continue;
+            this->seat_client(id, t, place);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Game::enqueue(int id, int queue) {
+    ClientInfo &client = this->clients[id];
+    client.queue = queue;
+    client.queue_prev = this->queue_tail[queue];
+    client.queue_next = 0;
+    if (this->queue_tail[queue] != 0) this->clients[this->queue_tail[queue]].queue_next = id;
+    else this->queue_head[queue] = id;
+    this->queue_tail[queue] = id;
+    this->queue_size[queue]++;
+}
+
+int Game::dequeue(int queue) {
+    int id = this->queue_head[queue];
+    this->unlink(id);
+    return id;
+}
+
+void Game::unlink(int id) {
+    ClientInfo &client = this->clients[id];
+    int queue = client.queue;
+    if (client.queue_prev != 0) this->clients[client.queue_prev].queue_next = client.queue_next;
+    else this->queue_head[queue] = client.queue_next;
+    if (client.queue_next != 0) this->clients[client.queue_next].queue_prev = client.queue_prev;
+    else this->queue_tail[queue] = client.queue_prev;
+    this->queue_size[queue]--;
+    client.queue = -1;
+    client.queue_prev = 0;
+    client.queue_next = 0;
+}
+
+void Game::match_players() {
+    //A table can be formed when every seat without its own queue is covered by the "any seat" queue
+    int missing = 0;
+    for (int place = 0; place < 4; place++) {
+        if (this->queue_size[place] == 0) missing++;
+    }
+    if (missing > this->queue_size[4]) return;
+    if (this->tournament > 0 && this->tables_opened == this->tournament) return;
+    int t = this->open_table();
+    for (int place = 0; place < 4; place++) {
+        bool any = this->queue_size[place] == 0;
+        this->seat_client(this->dequeue(any ? 4 : place), t, place);
+    }
+}
+
+int Game::open_table() {
+    int t;
+    if (this->free_tables.empty()) {
+        t = this->tables.size();
+        this->tables.emplace_back();
+    }
+    else {
+        t = this->free_tables.back();
+        this->free_tables.pop_back();
+        this->tables[t] = Table();
+    }
+    this->tables[t].active = true;
+    this->tables[t].number = ++this->tables_opened;
+    return t;
+}
+
+void Game::close_table(int t) {
+    Table &table = this->tables[t];
+    for (int i = 0; i < 4; i++) {
+        int id = table.players[i].id;
+        if (id == 0) continue;
+        this->clients[id].table = -1;
+        this->clients[id].place = -1;
+        this->clients[id].disconnect = true;
+    }
+    table.active = false;
+    this->free_tables.push_back(t);
+}
+
+void Game::record_result(int t) {
+    Table &table = this->tables[t];
+    Standing added[4];
+    for (int i = 0; i < 4; i++) {
+        added[i] = {table.number, i, this->seat_name(t, i), table.players[i].total_points};
+        auto position = upper_bound(this->standings.begin(), this->standings.end(), added[i],
+                                    [](const Standing &a, const Standing &b) {
+            return a.place != b.place ? a.place < b.place : a.total < b.total;
+        });
+        this->standings.insert(position, added[i]);
+        this->seat_totals[i] += table.players[i].total_points;
+    }
+    this->tables_finished++;
+    if (this->tables_finished == this->tournament) {
+        this->print_standings();
+        this->game_over = true;
+        return;
+    }
+    //Only the rows of the table just finished, the full list is printed once at the end
+    cerr << "table " << table.number << " finished, " << this->tables_finished << " of " << this->tournament
+         << " tables" << endl;
+    for (int i = 0; i < 4; i++) this->print_standing(this->standing_rank(added[i]), added[i]);
+}
+
+string Game::seat_name(int t, int place) {
+    const Player &player = this->tables[t].players[place];
+    if (player.id == 0) return player.bot ? "bot" : "empty";
+    return player.name;
+}
+
+void Game::store_result(int t, int kind) {
+    Table &table = this->tables[t];
+    ResultEvent event;
+    event.kind = kind;
+    event.table = table.number;
+    event.deal = kind == RESULT_GAME ? table.round : table.deal.number;
+    event.time = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    for (int i = 0; i < 4; i++) {
+        event.players[i] = this->seat_name(t, i);
+        event.no_client[i] = table.players[i].id == 0;
+        event.named[i] = table.players[i].named;
+        event.scores[i] = kind == RESULT_GAME ? table.players[i].total_points : table.last_scores[i];
+        event.totals[i] = table.players[i].total_points;
+    }
+    this->results.push(event);
+}
+
+double Game::duplicate_score(const Standing &standing) const {
+    //Every table plays the same deals, so a seat is scored against the average of the same seat elsewhere
+    return (double)this->seat_totals[standing.place] / this->tables_finished - standing.total;
+}
+
+int Game::standing_rank(const Standing &standing) const {
+    double score = this->duplicate_score(standing);
+    int rank = 1;
+    auto begin = this->standings.begin();
+    for (int place = 0; place < 4; place++) {
+        auto end = partition_point(begin, this->standings.end(), [&](const Standing &s) { return s.place == place; });
+        rank += partition_point(begin, end, [&](const Standing &s) { return this->duplicate_score(s) > score; }) - begin;
+        begin = end;
+    }
+    return rank;
+}
+
+void Game::print_standing(int rank, const Standing &standing) const {
+    char line[128];
+    snprintf(line, sizeof line, "%4d. table %d %c %-22s total %4d duplicate %+.2f", rank, standing.table,
+             "NESW"[standing.place], standing.player.c_str(), standing.total, this->duplicate_score(standing));
+    cerr << line << endl;
+}
+
+void Game::print_standings() {
+    vector<const Standing *> order;
+    order.reserve(this->standings.size());
+    for (const Standing &standing : this->standings) order.push_back(&standing);
+    stable_sort(order.begin(), order.end(), [&](const Standing *a, const Standing *b) {
+        return this->duplicate_score(*a) > this->duplicate_score(*b);
+    });
+    cerr << "standings after " << this->tables_finished << " of " << this->tournament << " tables" << endl;
+    int rank = 0;
+    for (int i = 0; i < (int)order.size(); i++) {
+        //Tied standings share a rank, as standing_rank gives them
+        if (i == 0 || this->duplicate_score(*order[i]) != this->duplicate_score(*order[i - 1])) rank = i + 1;
+        this->print_standing(rank, *order[i]);
+    }
+}
+
+void Game::seat_client(int id, int t, int place) {
+    Table &table = this->tables[t];
+    this->clients[id].table = t;
+    this->clients[id].place = place;
+    table.players[place].id = id;
+    table.players[place].vacated = -1;
+    auto name = this->names.find(id);
+    table.players[place].named = name != this->names.end();
+    if (table.players[place].named) {
+        table.players[place].name = std::move(name->second);
+        this->names.erase(name);
+    }
+    else {
+        char buffer[INET6_ADDRSTRLEN];
+        table.players[place].name = string(this->address_text(id, buffer)) + ":" + to_string(this->clients[id].port);
+    }
+    //Hand the seat back from the bot
+    if (table.players[place].bot) table.players[place].bot = false;
+    else table.connected_clients++;
+    if (this->lobby) {
+        //Every lobby seating gets a new token, an old one of the seat is no good any more
+        uint64_t token = ++this->seatings << 32 | (uint64_t)(t * 4 + place);
+        table.players[place].token = token;
+        string message = "SEAT";
+        message += "NESW"[place];
+        message += to_string(token);
+        message += "\r\n";
+        char frame[FRAME_SIZE];
+        int frame_length = encode_seat(frame, "NESW"[place], token);
+        this->send_message(id, message, string_view(frame, frame_length));
+    }
+    if (table.phase == 1) this->reconnect_player(t, place);
+}
+
+void Game::play_table(int t) {
+    Table &table = this->tables[t];
+    if (table.connected_clients != 4) return;
+    if (table.phase == 0) {
+        //Send DEAL
+        if (!this->deals.next(table.round, table.deal)) {
+            //The stream ended while the table was between deals, otherwise it waits for more
+            if (this->deals.exhausted(table.round)) table.game_over = true;
+            return;
+        }
+        ALLOC_BEGIN(ALLOC_DEAL);
+        const Round &r = table.deal;
+        for (int i = 0; i < 4; i++) {
+            string message = "DEAL" + to_string(r.type) + r.starting_player + r.player_cards_string[i] + "\r\n";
+            char frame[FRAME_SIZE];
+            int frame_length = encode_deal(frame, r.type, r.starting_player, r.player_hands[i]);
+            table.players[i].give_cards(r.player_cards[i]);
+            this->send_message(table.players[i].id, message, string_view(frame, frame_length));
+        }
+        table.phase = 1;
+        table.trick_number = 1;
+        table.current_player = place_number(r.starting_player);
+        table.timeout_passed = true;
+        ALLOC_END();
+    }
+    if (table.phase == 1) {
+        //Send TRICK or TAKEN, bots play straight away
+        while (true) {
+            if (table.trick_cards.size() == 4) this->send_taken(t);
+            if (table.phase != 1 || !table.players[table.current_player].bot) break;
+            this->play_bot(t);
+        }
+        if (table.phase == 1 && table.trick_cards.size() != 4 && table.timeout_passed) this->send_trick(t);
+    }
+    if (table.phase == 2) {
+        //Send SCORE and TOTAL
+        ALLOC_BEGIN(ALLOC_SCORE);
+        this->send_score_and_total(t);
+        ALLOC_END();
+        ALLOC_WARMED_UP();
+    }
+}
+
+void Game::play_bot(int t) {
+    Table &table = this->tables[t];
+    Player &player = table.players[table.current_player];
+    Card card;
+    bool found = false;
+    //A bot seat sees every hand, the last tricks are looked up rather than played by the first rule
+    if (this->endgame.covers(table.deal.type, table.trick_number)) {
+        uint64_t hands[4];
+        for (int i = 0; i < 4; i++) hands[i] = table.players[i].hand();
+        int leader = (table.current_player - (int)table.trick_cards.size() + 4) % 4;
+        found = this->endgame.best_card(table.deal.type, table.trick_number, hands, leader, table.trick_cards, card);
+    }
+    if (!found) card = player.choose_card(table.trick_cards);
+    table.trick_cards.push_back(card);
+    player.remove_card(card);
+    table.current_player = (table.current_player + 1) % 4;
+    table.trick_sent_to = 0;
+}
+
+// Matches TRICK(1[0-3]|[1-9])(10|[2-9]|J|Q|K|A)(C|D|H|S) without a regex.
+static bool parse_trick_number(const string &message, size_t end, int &number) {
+    if (end == 6 && message[5] >= '1' && message[5] <= '9') {
+        number = message[5] - '0';
+        return true;
+    }
+    if (end == 7 && message[5] == '1' && message[6] >= '0' && message[6] <= '3') {
+        number = 10 + message[6] - '0';
+        return true;
+    }
+    return false;
+}
+
+bool Game::is_trick(const string &message, int &number, Card &card) {
+    if (message.size() < 8 || message.size() > 10 || !message.starts_with("TRICK")) return false;
+    size_t color = message.size() - 1;
+    card.color = message[color];
+    if (!is_color(card.color)) return false;
+    if (message[color - 2] == '1' && message[color - 1] == '0' && parse_trick_number(message, color - 2, number)) {
+        card.value = 10;
+        return true;
+    }
+    char value = message[color - 1];
+    if (value >= '2' && value <= '9') card.value = value - '0';
+    else if (value == 'J') card.value = 11;
+    else if (value == 'Q') card.value = 12;
+    else if (value == 'K') card.value = 13;
+    else if (value == 'A') card.value = 14;
+    else return false;
+    return parse_trick_number(message, color - 1, number);
+}
+
+void Game::send_trick(int t) {
+    Table &table = this->tables[t];
+    int id = table.players[table.current_player].id;
+    if (id == 0) return;
+    table.timeout_passed = false;
+    table.deadline = this->net.now() + this->timeout;
+    ClientInfo &client = this->clients[id];
+    if (table.trick_sent_to == id && (client.congested || client.sent < client.trick_end)) {
+        //The previous copy is still queued or the peer is not reading
+        this->stats.tricks_coalesced++;
+        return;
+    }
+    table.trick_sent_to = id;
+    ALLOC_BEGIN(ALLOC_TRICK_OUT);
+    char message[MESSAGE_SIZE] = "TRICK";
+    char *end = to_chars(message + 5, message + MESSAGE_SIZE, table.trick_number).ptr;
+    for (int i = 0; i < (int)table.trick_cards.size(); ++i) {
+        end += card_to_chars(table.trick_cards[i], end);
+    }
+    memcpy(end, "\r\n", 2);
+    char frame[FRAME_SIZE];
+    int frame_length = encode_trick(frame, table.trick_number, table.trick_cards.data(), table.trick_cards.size());
+    this->send_message(id, string_view(message, end + 2 - message), string_view(frame, frame_length));
+    client.trick_end = client.queued;
+    table.trick_sent_at = this->trace.start();
+    this->trace.instant(TRACE_TRICK_SENT, t, table.current_player);
+    ALLOC_END();
+}
+
+void Game::send_taken(int t) {
+    Table &table = this->tables[t];
+    ALLOC_BEGIN(ALLOC_TAKEN);
+    int winner_id = trick_winner(table.trick_cards);
+    char winner = "NESW"[(table.current_player + winner_id) % 4];
+    this->count_points(t, winner, table.deal.type);
+
+    char buffer[MESSAGE_SIZE] = "TAKEN";
+    char *end = to_chars(buffer + 5, buffer + MESSAGE_SIZE, table.trick_number).ptr;
+    for (int i = 0; i < (int)table.trick_cards.size(); ++i) {
+        end += card_to_chars(table.trick_cards[i], end);
+    }
+    *end++ = winner;
+    memcpy(end, "\r\n", 2);
+    string_view message(buffer, end + 2 - buffer);
+    char frame_buffer[FRAME_SIZE];
+    string_view frame(frame_buffer, encode_taken(frame_buffer, table.trick_number, table.trick_cards.data(), winner));
+    for (int i = 0; i < 4; ++i) {
+        this->send_message(table.players[i].id, message, frame);
+    }
+    table.log += message;
+    table.frame_log += frame;
+    this->trace.instant(TRACE_TAKEN, t, -1);
+    table.trick_cards.clear();
+    table.trick_sent_to = 0;
+    table.trick_number++;
+    table.timeout_passed = true;
+    table.current_player = place_number(winner);
+    if (table.trick_number == 14) {
+        table.timeout_passed = false;
+        table.phase = 2;
+        table.log.clear();
+        table.frame_log.clear();
+    }
+    ALLOC_END();
+}
+
+void Game::send_score_and_total(int t) {
+    Table &table = this->tables[t];
+    int scores[4];
+    char frame[FRAME_SIZE];
+    string message = "SCORE";
+    for (int i = 0; i < 4; ++i) {
+        message += "NESW"[i];
+        message += to_string(table.players[i].round_points);
+        scores[i] = table.players[i].round_points;
+    }
+    message += "\r\n";
+    int frame_length = encode_scores(frame, MESSAGE_SCORE, scores);
+    for (int i = 0; i < 4; ++i) {
+        this->send_message(table.players[i].id, message, string_view(frame, frame_length));
+    }
+    for (int i = 0; i < 4; ++i) {
+        table.players[i].total_points += table.players[i].round_points;
+        table.last_scores[i] = table.players[i].round_points;
+        table.players[i].round_points = 0;
+    }
+    message = "TOTAL";
+    for (int i = 0; i < 4; ++i) {
+        message += "NESW"[i];
+        message += to_string(table.players[i].total_points);
+        scores[i] = table.players[i].total_points;
+    }
+    message += "\r\n";
+    frame_length = encode_scores(frame, MESSAGE_TOTAL, scores);
+    for (int i = 0; i < 4; ++i) {
+        this->send_message(table.players[i].id, message, string_view(frame, frame_length));
+    }
+    table.round++;
+    table.phase = 0;
+    table.log.clear();
+    table.frame_log.clear();
+    if (this->results.enabled()) this->store_result(t, RESULT_ROUND);
+    if (this->deals.exhausted(table.round)) {
+        table.game_over = true;
+    }
+}
+
+void Game::reconnect_player(int t, int place) {
+    Table &table = this->tables[t];
+    const Round &r = table.deal;
+    string message = "DEAL" + to_string(r.type) + r.starting_player + r.player_cards_string[place] + "\r\n";
+    char frame[FRAME_SIZE];
+    int frame_length = encode_deal(frame, r.type, r.starting_player, r.player_hands[place]);
+    this->send_message(table.players[place].id, message, string_view(frame, frame_length));
+    //The log holds one TAKEN per line, sent as separate messages for the transcript
+    size_t start = 0;
+    size_t frame_start = 0;
+    while (start < table.log.size()) {
+        size_t end = table.log.find('\n', start) + 1;
+        size_t frame_end = frame_start + (unsigned char)table.frame_log[frame_start] + 1;
+        this->send_message(table.players[place].id, string_view(table.log).substr(start, end - start),
+                           string_view(table.frame_log).substr(frame_start, frame_end - frame_start));
+        start = end;
+        frame_start = frame_end;
+    }
+    if (table.phase == 1 && table.current_player == place) {
+        table.trick_sent_to = 0;
+        table.timeout_passed = true;
+    }
+}
+
+bool Game::check_trick(int t, Card card, int id) {
+    Table &table = this->tables[t];
+    if (table.phase != 1) return false;
+    if (table.current_player != id) return false;
+    if (table.trick_cards.size() == 4) return false;
+    return table.players[id].can_play(table.trick_cards, card);
+}
+
+void Game::count_points(int t, char winner, int round_type) {
+    Table &table = this->tables[t];
+    table.players[place_number(winner)].round_points += trick_points(round_type, table.trick_number, table.trick_cards);
+}
+
+bool Game::next_message(int id, string &message) {
+    ClientInfo &client = this->clients[id];
+    string_view buffer = client.read_buffer.view();
+    size_t length;
+    if (!client.binary) {
+        //Resumes where the last scan stopped and never looks past the longest line allowed
+        size_t end = buffer.substr(0, LINE_LIMIT + 2).find("\r\n", client.scanned);
+        if (end == string_view::npos) {
+            if (buffer.size() >= LINE_LIMIT + 2) {
+                this->stats.lines_too_long++;
+                this->drop_client(id);
+                return false;
+            }
+            //A CR at the end may be completed by the next read
+            client.scanned = buffer.empty() ? 0 : buffer.size() - 1;
+            return false;
+        }
+        message.assign(buffer.substr(0, end));
+        length = end + 2;
+        client.scanned = 0;
+    }
+    else {
+        if (buffer.empty() || buffer.size() < (size_t)(unsigned char)buffer[0] + 1) return false;
+        length = (unsigned char)buffer[0] + 1;
+        //Handled and logged in the text form
+        message.clear();
+        frame_to_text(buffer.substr(0, length), message);
+    }
+    client.read_buffer.consume(this->buffers, length);
+    return true;
+}
+
+// Token bucket kept as the time it is full again (GCRA), in the low 32 bits of the clock.
+// A bucket is never more than WRONG_BURST intervals ahead, anything else is a
+// new connection's 0 or a time so old it wrapped around, and counts as full.
+bool Game::allow_wrong(int id) {
+    ClientInfo &client = this->clients[id];
+    uint32_t now = this->net.now();
+    int32_t ahead = client.wrong_at - now;
+    if (ahead < 0 || ahead > WRONG_BURST * WRONG_INTERVAL) ahead = 0;
+    if (ahead > (WRONG_BURST - 1) * WRONG_INTERVAL) {
+        this->stats.wrongs_suppressed++;
+        return false;
+    }
+    client.wrong_at = now + ahead + WRONG_INTERVAL;
+    return true;
+}
+
+void Game::send_message(int id, string_view message, string_view frame) {
+    if (id == 0) return;
+    ClientInfo &client = this->clients[id];
+    string_view data = client.binary ? frame : message;
+    if (this->io) {
+        //The I/O thread writes the wire form and logs the text one, a message longer than an event goes in parts
+        string_view text = message.substr(0, message.size() - 2);
+        size_t total = data.size() + text.size();
+        size_t offset = 0;
+        do {
+            PipeEvent event;
+            event.kind = PIPE_SEND;
+            event.slot = id;
+            event.length = min(total - offset, (size_t)PIPE_DATA);
+            event.wire = offset < data.size() ? min(data.size() - offset, (size_t)event.length) : 0;
+            if (event.wire > 0) memcpy(event.data, data.data() + offset, event.wire);
+            if (event.length > event.wire) {
+                memcpy(event.data + event.wire, text.data() + (offset + event.wire - data.size()), event.length - event.wire);
+            }
+            offset += event.length;
+            event.more = offset < total;
+            this->io->send(event);
+        } while (offset < total);
+    }
+    else if (!client.write_buffer.append(this->buffers, data)) {
+        this->drop_client(id);
+        return;
+    }
+    client.queued += data.size();
+    this->stats.bytes_queued += data.size();
+    if (client.pending() >= WRITE_LIMIT) {
+        if (this->pollfds[id].fd != -1) this->stats.peers_dropped++;
+        this->drop_client(id);
+    }
+    else if (client.pending() > WRITE_HIGH_WATERMARK) client.congested = true;
+    if (!this->io) this->log_message(client.server, id, message.substr(0, message.size() - 2));
+}
+
+void Game::log_message(int from, int to, string_view message) {
+    string &line = this->log_line;
+    line.clear();
+    char from_buffer[INET6_ADDRSTRLEN];
+    char to_buffer[INET6_ADDRSTRLEN];
+    append_log_line(line, this->address_text(from, from_buffer), this->clients[from].port,
+                    this->address_text(to, to_buffer), this->clients[to].port, message);
+    cout.write(line.data(), line.size());
+}
+
+// Formats the address of a peer into buffer, listeners have their names ready.
+string_view Game::address_text(int id, char *buffer) {
+    if (id < this->first_client) return this->listener_names[id];
+    const ClientInfo &client = this->clients[id];
+    if (client.server == this->unix_listener) return this->listener_names[client.server];
+    if (inet_ntop(AF_INET6, &client.address, buffer, INET6_ADDRSTRLEN) == nullptr) syserr("inet_ntop");
+    return buffer;
+}
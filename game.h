@@ -0,0 +1,261 @@
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <netinet/in.h>
+#include <poll.h>
+
+#include "common.h"
+#include "trace.h"
+#include "results.h"
+#include "pipeline.h"
+#include "handoff.h"
+#include "slab.h"
+#include "deals.h"
+#include "admin.h"
+#include "net.h"
+#include "endgame.h"
+
+#ifndef MIM_GAME_H
+#define MIM_GAME_H
+
+// Kept small for servers with many parked connections: the peer address
+// is stored raw and only formatted for the log, buffers take a chunk from
+// the slab pool while they hold data.
+struct ClientInfo {
+    in6_addr address = {};
+    uint16_t port = 0;
+    // Listener slot the connection came through, used as the server end in the log.
+    uint8_t server = 0;
+    int8_t place = -1;
+    int8_t queue = -1;
+    // Negotiated with IAM<place>B, frames from protocol.h instead of text.
+    bool binary : 1 = false;
+    bool congested : 1 = false;
+    bool disconnect : 1 = false;
+    bool used : 1 = false;
+    // Left with messages by MESSAGE_BUDGET.
+    bool backlogged : 1 = false;
+    // Reads are READ_SIZE_MIN << read_shift bytes.
+    uint8_t read_shift = 0;
+    // Bytes of read_buffer known to hold no CRLF, at most LINE_LIMIT.
+    uint8_t scanned = 0;
+    int table = -1;
+    int queue_prev = 0;
+    int queue_next = 0;
+    // Low bits of the time at which the WRONG bucket is full again, 0 in a new one.
+    uint32_t wrong_at = 0;
+    int64_t deadline = -1;
+    int64_t queued = 0;
+    int64_t sent = 0;
+    int64_t trick_end = 0;
+    SlabBuffer read_buffer;
+    SlabBuffer write_buffer;
+    size_t pending() const { return this->queued - this->sent; }
+};
+
+// Result of one seat at a finished tournament table.
+struct Standing {
+    int table;
+    int place;
+    std::string player;
+    int total;
+};
+
+struct ServerStats {
+    int64_t bytes_queued = 0;
+    int64_t peers_dropped = 0;
+    int64_t tricks_coalesced = 0;
+    int64_t lines_too_long = 0;
+    int64_t wrongs_suppressed = 0;
+};
+
+class Player {
+public:
+    int id = 0;
+    int round_points = 0;
+    int total_points = 0;
+    // Seat is played in-process after its client has been gone for the grace period.
+    bool bot = false;
+    int64_t vacated = -1;
+    // Given with SEAT in lobby mode, the client names it to come back to the seat.
+    uint64_t token = 0;
+    // Who results are credited to: the name the client gave in IAM, or else the address and port
+    // of the connection that took the seat. Kept when the client comes back by its token.
+    std::string name;
+    bool named = false;
+    void remove_card(Card card);
+    void give_cards(std::vector<Card> cards);
+    bool can_play(std::vector<Card> &trick_cards, Card card);
+    Card choose_card(std::vector<Card> &trick_cards);
+    // Cards left, as a mask of card_id.
+    uint64_t hand() const;
+    void save(StateWriter &state) const;
+    void load(StateReader &state);
+private:
+    std::vector<Card> cards;
+};
+
+struct Table {
+    // Sequential number of the game played at the table, from 1.
+    int number = 0;
+    bool active = false;
+    bool game_over = false;
+    bool timeout_passed = true;
+    int connected_clients = 0;
+    int current_player;
+    int phase = 0;
+    int round = 0;
+    int trick_number;
+    int64_t deadline = -1;
+    int64_t trick_sent_at = 0;
+    // Client which already got a TRICK for the current state of the trick.
+    int trick_sent_to = 0;
+    // Deal being played, valid while phase is 1.
+    Round deal;
+
+    Player players[4];
+    // SCORE of the last finished deal.
+    int last_scores[4] = {};
+    std::vector<Card> trick_cards;
+    // TAKEN messages of the current deal, resent on reconnect.
+    std::string log;
+    std::string frame_log;
+};
+
+// Non-blocking listening sockets of the server.
+int listen_tcp(Net &net, uint16_t port);
+int listen_unix(Net &net, const std::string &path);
+// SIGUSR1 handler, the game prints its statistics in its next iteration.
+void request_stats(int);
+
+class Game {
+public:
+    // A worker started by the supervisor gets its listeners and state over control instead of binding.
+    // The clock and client sockets of run() go through net, the pipelined loop needs the system one.
+    Game(Net &net, uint16_t port, std::string unix_path, std::string admin_path, std::string file, bool follow,
+         int timeout, bool lobby, int bot_grace, int tournament, int control);
+    void run();
+    // Same game with socket I/O and the transcript on a separate thread.
+    void run_pipelined();
+    void print_stats();
+    Trace trace;
+    ResultsWriter results;
+    // Bot seats play the last tricks from it, when it is open.
+    EndgameTable endgame;
+private:
+    Net &net;
+    bool game_over = false;
+    bool lobby;
+    int bot_grace;
+    // Number of tables in a duplicate tournament, 0 when not playing one.
+    int tournament;
+    int tables_opened = 0;
+    int tables_finished = 0;
+    // Seatings so far in lobby mode, the high bits of the next seat token.
+    uint64_t seatings = 0;
+    // Sum of the totals of finished tables per seat, the par of each seat.
+    int64_t seat_totals[4] = {};
+    // Ordered by seat, then by total. A seat's duplicate score moves with its par, so the
+    // order within a seat never changes and a standing is ranked by a search of each seat.
+    std::vector<Standing> standings;
+    // Slots before first_client hold the listening sockets.
+    int first_client = 1;
+    // Their addresses as logged, peers of the Unix listener are logged with its path.
+    std::vector<std::string> listener_names;
+    int unix_listener = -1;
+    // Slot of the channel to the supervisor among them, -1 when running alone.
+    int control = -1;
+    // Slot of the admin console among them, -1 without one.
+    int admin_slot = -1;
+    AdminConsole admin;
+    uint16_t unix_connections = 0;
+    std::string unix_path;
+    int timeout;
+    // Messages are handled round robin, from this slot on in the next iteration.
+    int next_served = 0;
+    // Some connection has messages left over, the next poll must not wait.
+    bool backlogged = false;
+    ServerStats stats;
+    // Set while running pipelined, client sockets are then owned by the I/O thread.
+    std::unique_ptr<IoThread> io;
+
+    std::vector<Table> tables;
+    std::vector<ClientInfo> clients;
+    DealSource deals;
+    std::vector<pollfd> pollfds;
+    std::vector<int> free_slots;
+    std::vector<int> free_tables;
+    SlabPool buffers;
+    // Reused so that handling a message does not allocate.
+    std::string message;
+    std::string log_line;
+
+    // Matchmaking queues: one per seat and the last one for "any seat".
+    // Clients are linked through queue_prev/queue_next, 0 ends the list.
+    int queue_head[5] = {};
+    int queue_tail[5] = {};
+    int queue_size[5] = {};
+    // Names given in IAM by clients not seated yet.
+    std::unordered_map<int, std::string> names;
+    // Started tables which lost a player, checked lazily when popped.
+    std::deque<int> vacant[4];
+
+    void add_listener(int socket_fd);
+    void adopt(int channel);
+    void handle_control();
+    void handle_admin();
+    void take_snapshot(AdminSnapshot &snapshot, bool tables, bool clients);
+    void admin_command(int connection, const std::string &command);
+    void save_state(StateWriter &state);
+    void load_state(StateReader &state, const std::vector<int> &fds);
+    void accept_client(int listener);
+    void release_client(int id);
+    void drop_client(int id);
+    void write_client(int id);
+    void check_timeouts(int64_t now);
+    int poll_timeout(int64_t now);
+    void handle_messages();
+    bool handle_message(int id, const std::string &message);
+    void handle_event(const PipeEvent &event);
+    void play_tables();
+    void remove_disconnected();
+    void handle_iam(int id, char place, uint64_t token, std::string_view name);
+    bool take_back_seat(int id, uint64_t token);
+    bool take_vacant_seat(int id, int queue);
+    void fill_vacancy(int place);
+    void enqueue(int id, int queue);
+    int dequeue(int queue);
+    void unlink(int id);
+    void match_players();
+    int open_table();
+    void close_table(int t);
+    void record_result(int t);
+    double duplicate_score(const Standing &standing) const;
+    int standing_rank(const Standing &standing) const;
+    void print_standing(int rank, const Standing &standing) const;
+    void print_standings();
+    std::string seat_name(int t, int place);
+    void store_result(int t, int kind);
+    void seat_client(int id, int t, int place);
+    void play_table(int t);
+    void play_bot(int t);
+    bool is_trick(const std::string &message, int &number, Card &card);
+    void send_trick(int t);
+    void send_taken(int t);
+    void send_score_and_total(int t);
+    void reconnect_player(int t, int place);
+    bool check_trick(int t, Card card, int id);
+    void count_points(int t, char winner, int round_type);
+    bool next_message(int id, std::string &message);
+    bool allow_wrong(int id);
+    void send_message(int id, std::string_view message, std::string_view frame);
+    void log_message(int from, int to, std::string_view message);
+    std::string_view address_text(int id, char *buffer);
+};
+
+#endif
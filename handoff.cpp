@@ -0,0 +1,142 @@
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "err.h"
+#include "handoff.h"
+
+// Descriptors per message, the kernel takes at most 253.
+#define HANDOFF_FDS 250
+
+using namespace std;
+
+void StateWriter::put(int64_t value) {
+    this->data.append((const char *) &value, sizeof value);
+}
+
+void StateWriter::put(const string &value) {
+    this->put((int64_t)value.size());
+    this->data += value;
+}
+
+int64_t StateReader::get() {
+    int64_t value;
+    if (this->offset + sizeof value > this->data.size()) fatal("Truncated handoff state");
+    memcpy(&value, this->data.data() + this->offset, sizeof value);
+    this->offset += sizeof value;
+    return value;
+}
+
+string StateReader::get_string() {
+    int64_t size = this->get();
+    if (size < 0 || this->offset + size > this->data.size()) fatal("Truncated handoff state");
+    string value = this->data.substr(this->offset, size);
+    this->offset += size;
+    return value;
+}
+
+static bool write_all(int channel, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t length = send(channel, data, size, MSG_NOSIGNAL);
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0) return false;
+        data += length;
+        size -= length;
+    }
+    return true;
+}
+
+static bool read_all(int channel, char *data, size_t size) {
+    while (size > 0) {
+        ssize_t length = read(channel, data, size);
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0) return false;
+        data += length;
+        size -= length;
+    }
+    return true;
+}
+
+// Sends one byte carrying up to HANDOFF_FDS descriptors.
+static bool send_fds(int channel, char byte, const int *fds, int count) {
+    iovec data = {&byte, 1};
+    msghdr message = {};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)] = {};
+    if (count > 0) {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(header), fds, sizeof(int) * count);
+    }
+    while (true) {
+        ssize_t length = sendmsg(channel, &message, MSG_NOSIGNAL);
+        if (length < 0 && errno == EINTR) continue;
+        return length == 1;
+    }
+}
+
+static bool receive_fds(int channel, char &byte, vector<int> &fds) {
+    iovec data = {&byte, 1};
+    msghdr message = {};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+    message.msg_control = control;
+    message.msg_controllen = sizeof control;
+    ssize_t length;
+    do length = recvmsg(channel, &message, MSG_CMSG_CLOEXEC);
+    while (length < 0 && errno == EINTR);
+    if (length != 1) return false;
+    if (message.msg_flags & MSG_CTRUNC) fatal("Too many descriptors in one handoff message");
+    for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+        int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int *) CMSG_DATA(header);
+        fds.insert(fds.end(), received, received + count);
+    }
+    return true;
+}
+
+bool send_handoff(int channel, const vector<int> &fds, const string &state) {
+    uint64_t header[2] = {fds.size(), state.size()};
+    if (!write_all(channel, (const char *) header, sizeof header)) return false;
+    for (size_t sent = 0; sent < fds.size(); sent += HANDOFF_FDS) {
+        int count = min(fds.size() - sent, (size_t)HANDOFF_FDS);
+        if (!send_fds(channel, 'F', fds.data() + sent, count)) return false;
+    }
+    return write_all(channel, state.data(), state.size());
+}
+
+bool receive_handoff(int channel, vector<int> &fds, string &state) {
+    uint64_t header[2];
+    if (!read_all(channel, (char *) header, sizeof header)) return false;
+    fds.clear();
+    //Each message is read on its own, a plain read would drop the descriptors
+    while (fds.size() < header[0]) {
+        char byte;
+        if (!receive_fds(channel, byte, fds)) return false;
+    }
+    state.resize(header[1]);
+    return read_all(channel, state.data(), state.size());
+}
+
+bool send_command(int channel, char command, int fd) {
+    return send_fds(channel, command, &fd, fd == -1 ? 0 : 1);
+}
+
+bool receive_command(int channel, char &command, int &fd) {
+    vector<int> fds;
+    if (!receive_fds(channel, command, fds)) return false;
+    fd = fds.empty() ? -1 : fds[0];
+    for (int i = 1; i < (int)fds.size(); i++) close(fds[i]);
+    return true;
+}
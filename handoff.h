@@ -0,0 +1,45 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifndef MIM_HANDOFF_H
+#define MIM_HANDOFF_H
+
+// Handing a running server over to another process: sockets travel with
+// SCM_RIGHTS over a Unix socket, the game state as a flat byte string.
+// A process started by the supervisor gets its channel as -W <fd>.
+#define HANDOFF_VERSION  5
+// Exit status of a worker which gave its games to its successor.
+#define HANDOFF_EXIT     3
+
+// Control commands, one byte with an optional descriptor.
+#define COMMAND_UPGRADE  'U'
+#define COMMAND_ACCEPTED 'A'
+
+// Integers and strings of a state, read back in the same order. Both
+// ends run on the same machine, so integers are kept in native order.
+class StateWriter {
+public:
+    void put(int64_t value);
+    void put(const std::string &value);
+    std::string data;
+};
+
+class StateReader {
+public:
+    StateReader(const std::string &data) : data(data) {}
+    int64_t get();
+    std::string get_string();
+private:
+    const std::string &data;
+    size_t offset = 0;
+};
+
+// Return false when the other end is gone.
+bool send_handoff(int channel, const std::vector<int> &fds, const std::string &state);
+bool receive_handoff(int channel, std::vector<int> &fds, std::string &state);
+bool send_command(int channel, char command, int fd);
+// fd is -1 when the command came without one.
+bool receive_command(int channel, char &command, int &fd);
+
+#endif
@@ -0,0 +1,492 @@
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <climits>
+#include <ctime>
+#include <algorithm>
+
+#include <zlib.h>
+
+#include "err.h"
+
+// Transcript lines are packed into blocks of about ARCHIVE_BLOCK bytes,
+// each compressed on its own. The index keeps per block its time range,
+// per endpoint the blocks it has lines in, the DEAL and TOTAL boundaries,
+// and the games found by grouping the DEALs a table sends at once.
+// While writing, the index is saved after INDEX_SAVE_BLOCKS new blocks or
+// INDEX_SAVE_SECONDS, whichever comes first, and at the end.
+#define ARCHIVE_BLOCK   262144
+#define ARCHIVE_MAGIC   0x4b524132
+#define INDEX_SAVE_BLOCKS   64
+#define INDEX_SAVE_SECONDS  1
+#define BOUNDARY_DEAL   0
+#define BOUNDARY_TOTAL  1
+
+using namespace std;
+
+struct Block {
+    uint64_t offset;
+    uint32_t compressed;
+    uint32_t size;
+    int64_t first_time;
+    int64_t last_time;
+};
+
+struct Endpoint {
+    string name;
+    // In increasing order, never empty.
+    vector<uint32_t> blocks;
+};
+
+struct Boundary {
+    int64_t time;
+    uint32_t block;
+    uint32_t endpoint;
+    uint32_t kind;
+};
+
+struct GameEntry {
+    uint32_t endpoints[4];
+    uint32_t count;
+    uint32_t first_block;
+    uint32_t last_block;
+    int64_t time;
+};
+
+struct Line {
+    string_view from;
+    string_view to;
+    string_view timestamp;
+    string_view message;
+};
+
+class ArchiveIndex {
+public:
+    vector<Block> blocks;
+    vector<Endpoint> endpoints;
+    vector<Boundary> boundaries;
+    vector<GameEntry> games;
+    unordered_map<string, uint32_t> endpoint_ids;
+    void load(const string &path);
+    void save(const string &path);
+    int64_t find_endpoint(const string &name) const;
+    // Blocks from first to last with lines of any of the endpoints, all of them for none.
+    vector<uint32_t> endpoint_blocks(const vector<string> &names, uint32_t first, uint32_t last) const;
+};
+
+// "[from,to,2024-05-01T12:00:00.000] message", the endpoints contain no commas.
+static bool parse_line(string_view text, Line &line) {
+    if (text.empty() || text[0] != '[') return false;
+    size_t first = text.find(',');
+    size_t second = text.find(',', first + 1);
+    size_t end = text.find("] ", second + 1);
+    if (first == string_view::npos || second == string_view::npos || end == string_view::npos) return false;
+    line.from = text.substr(1, first - 1);
+    line.to = text.substr(first + 1, second - first - 1);
+    line.timestamp = text.substr(second + 1, end - second - 1);
+    line.message = text.substr(end + 2);
+    return true;
+}
+
+// Keeps the digits of the timestamp, YYYYMMDDhhmmssmmm orders like the time itself.
+static int64_t parse_time(string_view timestamp) {
+    int64_t time = 0;
+    for (char c : timestamp) {
+        if (c >= '0' && c <= '9') time = time * 10 + (c - '0');
+    }
+    return time;
+}
+
+template <typename T>
+static void write_vector(FILE *file, const vector<T> &items) {
+    uint64_t count = items.size();
+    fwrite(&count, sizeof count, 1, file);
+    fwrite(items.data(), sizeof(T), count, file);
+}
+
+template <typename T>
+static void read_vector(FILE *file, vector<T> &items) {
+    uint64_t count;
+    if (fread(&count, sizeof count, 1, file) != 1) fatal("Truncated archive index");
+    items.resize(count);
+    if (fread(items.data(), sizeof(T), count, file) != count) fatal("Truncated archive index");
+}
+
+void ArchiveIndex::save(const string &path) {
+    //Written next to the old one and renamed, so readers of a live archive see a whole index
+    string temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr) syserr("cannot open %s", temporary.c_str());
+    uint32_t magic = ARCHIVE_MAGIC;
+    fwrite(&magic, sizeof magic, 1, file);
+    write_vector(file, this->blocks);
+    write_vector(file, this->boundaries);
+    write_vector(file, this->games);
+    uint64_t count = this->endpoints.size();
+    fwrite(&count, sizeof count, 1, file);
+    for (const Endpoint &endpoint : this->endpoints) {
+        uint32_t length = endpoint.name.size();
+        fwrite(&length, sizeof length, 1, file);
+        fwrite(endpoint.name.data(), 1, length, file);
+        write_vector(file, endpoint.blocks);
+    }
+    if (fclose(file) != 0) syserr("write %s", temporary.c_str());
+    if (rename(temporary.c_str(), path.c_str()) < 0) syserr("rename");
+}
+
+void ArchiveIndex::load(const string &path) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr) syserr("cannot open %s", path.c_str());
+    uint32_t magic;
+    if (fread(&magic, sizeof magic, 1, file) != 1 || magic != ARCHIVE_MAGIC) fatal("Not an archive index %s", path.c_str());
+    read_vector(file, this->blocks);
+    read_vector(file, this->boundaries);
+    read_vector(file, this->games);
+    uint64_t count;
+    if (fread(&count, sizeof count, 1, file) != 1) fatal("Truncated archive index");
+    this->endpoints.resize(count);
+    for (uint64_t i = 0; i < count; i++) {
+        Endpoint &endpoint = this->endpoints[i];
+        uint32_t length;
+        if (fread(&length, sizeof length, 1, file) != 1) fatal("Truncated archive index");
+        endpoint.name.resize(length);
+        if (fread(endpoint.name.data(), 1, length, file) != length) fatal("Truncated archive index");
+        read_vector(file, endpoint.blocks);
+        if (endpoint.blocks.empty()) fatal("Corrupted archive index");
+        this->endpoint_ids[endpoint.name] = i;
+    }
+    fclose(file);
+}
+
+int64_t ArchiveIndex::find_endpoint(const string &name) const {
+    auto found = this->endpoint_ids.find(name);
+    return found == this->endpoint_ids.end() ? -1 : (int64_t)found->second;
+}
+
+vector<uint32_t> ArchiveIndex::endpoint_blocks(const vector<string> &names, uint32_t first, uint32_t last) const {
+    vector<uint32_t> result;
+    if (this->blocks.empty()) return result;
+    last = min(last, (uint32_t)this->blocks.size() - 1);
+    if (names.empty()) {
+        for (uint32_t block = first; block <= last; block++) result.push_back(block);
+        return result;
+    }
+    for (const string &name : names) {
+        int64_t id = this->find_endpoint(name);
+        if (id == -1) continue;
+        const vector<uint32_t> &blocks = this->endpoints[id].blocks;
+        auto begin = lower_bound(blocks.begin(), blocks.end(), first);
+        auto end = upper_bound(begin, blocks.end(), last);
+        result.insert(result.end(), begin, end);
+    }
+    sort(result.begin(), result.end());
+    result.erase(unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+class ArchiveWriter {
+public:
+    ArchiveWriter(const string &path, size_t block_size);
+    void add(const string &text);
+    void finish();
+private:
+    string path;
+    size_t block_size;
+    FILE *data;
+    ArchiveIndex index;
+    string block;
+    Block current = {};
+    bool empty = true;
+    uint32_t saved_blocks = 0;
+    time_t saved_at = 0;
+    // Endpoints which got a first DEAL in the lines just before, and the game of every endpoint.
+    vector<uint32_t> pending;
+    unordered_map<uint32_t, uint32_t> endpoint_games;
+    uint32_t endpoint(string_view name);
+    void close_pending();
+    void flush();
+};
+
+ArchiveWriter::ArchiveWriter(const string &path, size_t block_size) {
+    this->path = path;
+    this->block_size = block_size;
+    this->data = fopen((path + ".blocks").c_str(), "wb");
+    if (this->data == nullptr) syserr("cannot open %s.blocks", path.c_str());
+    this->block.reserve(block_size + 1024);
+}
+
+uint32_t ArchiveWriter::endpoint(string_view name) {
+    auto found = this->index.endpoint_ids.find(string(name));
+    uint32_t id;
+    if (found == this->index.endpoint_ids.end()) {
+        id = this->index.endpoints.size();
+        this->index.endpoints.push_back({string(name), {}});
+        this->index.endpoint_ids.emplace(string(name), id);
+    }
+    else id = found->second;
+    vector<uint32_t> &blocks = this->index.endpoints[id].blocks;
+    uint32_t block = this->index.blocks.size();
+    if (blocks.empty() || blocks.back() != block) blocks.push_back(block);
+    return id;
+}
+
+void ArchiveWriter::close_pending() {
+    if (this->pending.empty()) return;
+    GameEntry game = {};
+    game.count = this->pending.size();
+    game.first_block = this->index.endpoints[this->pending[0]].blocks.back();
+    game.last_block = game.first_block;
+    game.time = this->current.last_time;
+    uint32_t id = this->index.games.size();
+    for (uint32_t i = 0; i < game.count && i < 4; i++) {
+        game.endpoints[i] = this->pending[i];
+        this->endpoint_games[this->pending[i]] = id;
+    }
+    this->index.games.push_back(game);
+    this->pending.clear();
+}
+
+void ArchiveWriter::add(const string &text) {
+    Line line;
+    if (!parse_line(text, line)) return;
+    int64_t time = parse_time(line.timestamp);
+    if (this->empty) this->current.first_time = time;
+    this->current.last_time = time;
+    this->empty = false;
+    uint32_t from = this->endpoint(line.from);
+    uint32_t to = this->endpoint(line.to);
+    uint32_t block = this->index.blocks.size();
+    //A table deals to its four players one after another, so a run of first DEALs is one game
+    bool deal = line.message.starts_with("DEAL");
+    bool first_deal = deal && !this->endpoint_games.contains(to);
+    if (!first_deal || this->pending.size() == 4) this->close_pending();
+    if (first_deal) this->pending.push_back(to);
+    if (deal || line.message.starts_with("TOTAL")) {
+        this->index.boundaries.push_back({time, block, to, deal ? (uint32_t)BOUNDARY_DEAL : (uint32_t)BOUNDARY_TOTAL});
+    }
+    for (uint32_t id : {from, to}) {
+        auto game = this->endpoint_games.find(id);
+        if (game != this->endpoint_games.end()) this->index.games[game->second].last_block = block;
+    }
+    this->block += text;
+    this->block += '\n';
+    if (this->block.size() >= this->block_size) this->flush();
+}
+
+void ArchiveWriter::flush() {
+    if (this->block.empty()) return;
+    uLongf compressed = compressBound(this->block.size());
+    vector<Bytef> output(compressed);
+    if (compress2(output.data(), &compressed, (const Bytef *)this->block.data(), this->block.size(), 6) != Z_OK) {
+        fatal("compress failed");
+    }
+    this->current.offset = ftell(this->data);
+    this->current.compressed = compressed;
+    this->current.size = this->block.size();
+    if (fwrite(output.data(), 1, compressed, this->data) != compressed) syserr("write");
+    fflush(this->data);
+    this->index.blocks.push_back(this->current);
+    //Saving the whole index after every block would make its writes grow with the square of the archive
+    time_t now = time(nullptr);
+    if (this->index.blocks.size() - this->saved_blocks >= INDEX_SAVE_BLOCKS || now - this->saved_at >= INDEX_SAVE_SECONDS) {
+        this->index.save(this->path + ".index");
+        this->saved_blocks = this->index.blocks.size();
+        this->saved_at = now;
+    }
+    this->block.clear();
+    this->current = {};
+    this->empty = true;
+}
+
+void ArchiveWriter::finish() {
+    this->close_pending();
+    this->flush();
+    fclose(this->data);
+    //Also when the last blocks were not saved yet, or the transcript was empty
+    this->index.save(this->path + ".index");
+}
+
+class ArchiveReader {
+public:
+    ArchiveReader(const string &path);
+    ArchiveIndex index;
+    // Passes the lines of a block to visit, unless its time range rules it out.
+    void read_block(uint32_t block, int64_t from, int64_t to, const function<void(string_view, const Line &)> &visit);
+    void print_lines(uint32_t first, uint32_t last, const vector<string> &names, int64_t from, int64_t to);
+    int blocks_read = 0;
+private:
+    FILE *data;
+    string text;
+};
+
+ArchiveReader::ArchiveReader(const string &path) {
+    this->index.load(path + ".index");
+    this->data = fopen((path + ".blocks").c_str(), "rb");
+    if (this->data == nullptr) syserr("cannot open %s.blocks", path.c_str());
+}
+
+void ArchiveReader::read_block(uint32_t id, int64_t from, int64_t to, const function<void(string_view, const Line &)> &visit) {
+    const Block &block = this->index.blocks[id];
+    if (block.last_time < from || block.first_time > to) return;
+    vector<Bytef> input(block.compressed);
+    if (fseek(this->data, block.offset, SEEK_SET) < 0) syserr("fseek");
+    if (fread(input.data(), 1, block.compressed, this->data) != block.compressed) fatal("Truncated archive");
+    this->text.resize(block.size);
+    uLongf size = block.size;
+    if (uncompress((Bytef *)this->text.data(), &size, input.data(), block.compressed) != Z_OK) fatal("Corrupted block %u", id);
+    this->blocks_read++;
+    size_t start = 0;
+    while (start < this->text.size()) {
+        size_t end = this->text.find('\n', start);
+        string_view text = string_view(this->text).substr(start, end - start);
+        start = end + 1;
+        Line line;
+        if (parse_line(text, line)) visit(text, line);
+    }
+}
+
+void ArchiveReader::print_lines(uint32_t first, uint32_t last, const vector<string> &names, int64_t from, int64_t to) {
+    for (uint32_t block : this->index.endpoint_blocks(names, first, last)) {
+        this->read_block(block, from, to, [&](string_view text, const Line &line) {
+            int64_t time = parse_time(line.timestamp);
+            if (time < from || time > to) return;
+            bool match = names.empty();
+            for (const string &name : names) match |= line.from == name || line.to == name;
+            if (match) cout << text << '\n';
+        });
+    }
+}
+
+static void print_game(ArchiveReader &reader, uint32_t id) {
+    const GameEntry &game = reader.index.games[id];
+    vector<string> names;
+    for (uint32_t i = 0; i < game.count && i < 4; i++) names.push_back(reader.index.endpoints[game.endpoints[i]].name);
+    reader.print_lines(game.first_block, game.last_block, names, INT64_MIN, INT64_MAX);
+}
+
+// The n-th deal seen by an endpoint, from its DEAL to the TOTAL after it.
+static void print_round(ArchiveReader &reader, uint32_t endpoint, int number) {
+    const vector<Boundary> &boundaries = reader.index.boundaries;
+    size_t deal = 0;
+    int deals = 0;
+    while (deal < boundaries.size()) {
+        if (boundaries[deal].endpoint == endpoint && boundaries[deal].kind == BOUNDARY_DEAL && ++deals == number) break;
+        deal++;
+    }
+    if (deal == boundaries.size()) fatal("No deal %d", number);
+    size_t total = deal + 1;
+    while (total < boundaries.size() && (boundaries[total].endpoint != endpoint || boundaries[total].kind != BOUNDARY_TOTAL)) total++;
+    uint32_t last = total < boundaries.size() ? boundaries[total].block : reader.index.blocks.size() - 1;
+    string name = reader.index.endpoints[endpoint].name;
+    //Timestamps have millisecond resolution, so the exact lines are cut by their content
+    bool inside = false;
+    bool done = false;
+    int seen = 0;
+    for (size_t i = 0; i < deal; i++) {
+        if (boundaries[i].endpoint == endpoint && boundaries[i].kind == BOUNDARY_DEAL && boundaries[i].block < boundaries[deal].block) seen++;
+    }
+    for (uint32_t block : reader.index.endpoint_blocks({name}, boundaries[deal].block, last)) {
+        if (done) break;
+        reader.read_block(block, INT64_MIN, INT64_MAX, [&](string_view text, const Line &line) {
+            if (done || (line.from != name && line.to != name)) return;
+            if (line.to == name && line.message.starts_with("DEAL") && ++seen == deals) inside = true;
+            if (!inside) return;
+            cout << text << '\n';
+            if (line.to == name && line.message.starts_with("TOTAL")) done = true;
+        });
+    }
+}
+
+static void list_games(ArchiveReader &reader) {
+    for (uint32_t id = 0; id < reader.index.games.size(); id++) {
+        const GameEntry &game = reader.index.games[id];
+        cout << id << " " << game.time;
+        for (uint32_t i = 0; i < game.count && i < 4; i++) cout << " " << reader.index.endpoints[game.endpoints[i]].name;
+        cout << " blocks " << game.first_block << "-" << game.last_block << '\n';
+    }
+}
+
+int main(int argc, char *argv[]) {
+    vector<string> args;
+    size_t block_size = ARCHIVE_BLOCK;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-b") {
+            if (i + 1 >= argc) fatal("Missing argument for -b");
+            else block_size = stoul(argv[++i]) * 1024;
+        }
+        else args.push_back(arg);
+    }
+    if (args.size() < 2 || block_size == 0) {
+        fatal("Usage: %s write <archive> [-b block_kb] [transcript] | games <archive> | game <archive> <id|endpoint> |"
+              " endpoint <archive> <endpoint> | round <archive> <endpoint> <n> | range <archive> <from> <to>", argv[0]);
+    }
+    string mode = args[0];
+    string path = args[1];
+
+    if (mode == "write") {
+        ifstream file;
+        if (args.size() > 2) {
+            file.open(args[2]);
+            if (!file) fatal("Cannot open file %s", args[2].c_str());
+        }
+        istream &input = args.size() > 2 ? file : cin;
+        ArchiveWriter writer(path, block_size);
+        string line;
+        while (getline(input, line)) writer.add(line);
+        writer.finish();
+        return 0;
+    }
+
+    ArchiveReader reader(path);
+    if (mode == "games") list_games(reader);
+    else if (mode == "game" && args.size() == 3) {
+        int64_t endpoint = reader.index.find_endpoint(args[2]);
+        int64_t id = -1;
+        if (endpoint != -1) {
+            for (uint32_t g = 0; g < reader.index.games.size() && id == -1; g++) {
+                const GameEntry &game = reader.index.games[g];
+                for (uint32_t i = 0; i < game.count && i < 4; i++) {
+                    if (game.endpoints[i] == endpoint) id = g;
+                }
+            }
+        }
+        else if (args[2].find_first_not_of("0123456789") == string::npos) id = stoll(args[2]);
+        if (id < 0 || id >= (int64_t)reader.index.games.size()) fatal("Unknown game %s", args[2].c_str());
+        print_game(reader, id);
+    }
+    else if (mode == "endpoint" && args.size() == 3) {
+        int64_t id = reader.index.find_endpoint(args[2]);
+        if (id == -1) fatal("Unknown endpoint %s", args[2].c_str());
+        const Endpoint &endpoint = reader.index.endpoints[id];
+        reader.print_lines(endpoint.blocks.front(), endpoint.blocks.back(), {endpoint.name}, INT64_MIN, INT64_MAX);
+    }
+    else if (mode == "round" && args.size() == 4) {
+        int64_t id = reader.index.find_endpoint(args[2]);
+        if (id == -1) fatal("Unknown endpoint %s", args[2].c_str());
+        print_round(reader, id, stoi(args[3]));
+    }
+    else if (mode == "range" && args.size() == 4) {
+        for (int i = 2; i < 4; i++) {
+            if (args[i].find_first_of("0123456789") == string::npos) fatal("Incorrect timestamp %s", args[i].c_str());
+        }
+        int64_t from = parse_time(args[2]);
+        int64_t to = parse_time(args[3]);
+        //Shorter timestamps cover everything they are a prefix of, all zeros is the beginning
+        if (from == 0) from = INT64_MIN;
+        while (from > 0 && from < 10000000000000000ll) from *= 10;
+        while (to < 10000000000000000ll) to = to * 10 + 9;
+        reader.print_lines(0, reader.index.blocks.size() - 1, {}, from, to);
+    }
+    else fatal("Incorrect arguments");
+    cout.flush();
+    cerr << reader.blocks_read << " of " << reader.index.blocks.size() << " blocks decompressed" << endl;
+    return 0;
+}
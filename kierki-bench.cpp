@@ -0,0 +1,679 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <random>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "common.h"
+#include "err.h"
+#include "protocol.h"
+#include "results.h"
+#include "tuning.h"
+
+#define WARMUP 1000
+#define BENCH_PLAYERS 10000
+// Connections per second which send a bad greeting, as background load.
+#define CHURN_RATE    200
+// Microseconds between idle connections.
+#define IDLE_CONNECT_PAUSE 300
+// Messages an abusive peer queues whenever it has written its last burst.
+#define FLOOD_BURST   256
+
+using namespace std;
+
+struct Result {
+    string name;
+    vector<int64_t> samples;
+};
+
+static int64_t now_ns() {
+    auto now = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
+}
+
+static void write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) syserr("write");
+        data += written;
+        size -= written;
+    }
+}
+
+// Reads one CRLF-terminated message, returns false on end of stream.
+static bool read_message(int fd, string &buffer, string &message) {
+    char chunk[256];
+    while (!extract_message(buffer, message)) {
+        ssize_t length = read(fd, chunk, sizeof chunk);
+        if (length < 0) syserr("read");
+        if (length == 0) return false;
+        buffer.append(chunk, length);
+    }
+    return true;
+}
+
+static void print_result(const Result &result) {
+    vector<int64_t> samples = result.samples;
+    sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) { return samples[min(samples.size() - 1, (size_t)(p * samples.size()))] / 1000.0; };
+    double sum = 0;
+    for (int64_t sample : samples) sum += sample;
+    printf("%-12s %10zu %9.2f %9.2f %9.2f %9.2f %9.2f\n", result.name.c_str(), samples.size(), samples[0] / 1000.0,
+           percentile(0.5), percentile(0.99), percentile(0.999), sum / samples.size() / 1000.0);
+}
+
+static void print_header() {
+    printf("%-12s %10s %9s %9s %9s %9s %9s\n", "", "samples", "min us", "p50 us", "p99 us", "p999 us", "mean us");
+}
+
+// A TRICK/reply round trip between two processes over a connected pair of sockets.
+static Result ping_pong(string name, int client_fd, int server_fd, int iterations) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) syserr("fork");
+    if (pid == 0) {
+        close(client_fd);
+        string buffer, message;
+        while (read_message(server_fd, buffer, message)) {
+            write_all(server_fd, "TRICK110H\r\n", 11);
+        }
+        _exit(0);
+    }
+    close(server_fd);
+    Result result = {name, {}};
+    result.samples.reserve(iterations);
+    string buffer, message;
+    for (int i = 0; i < WARMUP + iterations; i++) {
+        int64_t start = now_ns();
+        write_all(client_fd, "TRICK1\r\n", 8);
+        if (!read_message(client_fd, buffer, message)) fatal("peer closed");
+        if (i >= WARMUP) result.samples.push_back(now_ns() - start);
+    }
+    close(client_fd);
+    waitpid(pid, nullptr, 0);
+    return result;
+}
+
+static void tcp_pair(int fds[2]) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) syserr("socket");
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof address;
+    if (bind(listener, (sockaddr *) &address, length) < 0) syserr("bind");
+    if (listen(listener, 1) < 0) syserr("listen");
+    if (getsockname(listener, (sockaddr *) &address, &length) < 0) syserr("getsockname");
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fds[0], (sockaddr *) &address, length) < 0) syserr("connect");
+    fds[1] = accept(listener, nullptr, nullptr);
+    if (fds[1] < 0) syserr("accept");
+    close(listener);
+}
+
+static void unix_pair(int fds[2]) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) syserr("socket");
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof address.sun_path, "/tmp/kierki-bench-%d.sock", getpid());
+    ::unlink(address.sun_path);
+    if (bind(listener, (sockaddr *) &address, sizeof address) < 0) syserr("bind");
+    if (listen(listener, 1) < 0) syserr("listen");
+    fds[0] = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fds[0], (sockaddr *) &address, sizeof address) < 0) syserr("connect");
+    fds[1] = accept(listener, nullptr, nullptr);
+    if (fds[1] < 0) syserr("accept");
+    close(listener);
+    ::unlink(address.sun_path);
+}
+
+static void bench_transport(int iterations) {
+    int fds[2];
+    print_header();
+    tcp_pair(fds);
+    print_result(ping_pong("tcp", fds[0], fds[1], iterations));
+    unix_pair(fds);
+    print_result(ping_pong("unix", fds[0], fds[1], iterations));
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) syserr("socketpair");
+    print_result(ping_pong("socketpair", fds[0], fds[1], iterations));
+}
+
+// The messages one player receives during a deal, in both encodings.
+static void build_deal(mt19937 &random, string &text, string &frames) {
+    vector<Card> deck;
+    for (char color : {'C', 'D', 'H', 'S'}) {
+        for (int value = 2; value <= 14; value++) deck.push_back({color, value});
+    }
+    shuffle(deck.begin(), deck.end(), random);
+    char frame[FRAME_SIZE];
+    auto add = [&](int length) {
+        frames.append(frame, length);
+        frame_to_text(string_view(frame, length), text);
+        text += "\r\n";
+    };
+    vector<Card> hand(deck.begin(), deck.begin() + 13);
+    add(encode_deal(frame, 1 + random() % 7, "NESW"[random() % 4], cards_to_mask(hand)));
+    for (int trick = 0; trick < 13; trick++) {
+        const Card *cards = &deck[trick * 4];
+        add(encode_trick(frame, trick + 1, cards, trick % 4));
+        add(encode_taken(frame, trick + 1, cards, "NESW"[random() % 4]));
+    }
+    int scores[4];
+    for (int i = 0; i < 4; i++) scores[i] = random() % 20;
+    add(encode_scores(frame, MESSAGE_SCORE, scores));
+    for (int i = 0; i < 4; i++) scores[i] = random() % 200;
+    add(encode_scores(frame, MESSAGE_TOTAL, scores));
+}
+
+// Client-side cost of splitting and decoding a stream of messages.
+static Result decode_stream(string name, const vector<string> &streams, bool binary, int iterations) {
+    Result result = {name, {}};
+    result.samples.reserve(iterations);
+    string buffer, message;
+    Message decoded;
+    int64_t checksum = 0;
+    for (int i = 0; i < WARMUP + iterations; i++) {
+        buffer = streams[i % streams.size()];
+        int64_t start = now_ns();
+        if (binary) {
+            while (extract_frame(buffer, message)) {
+                if (!decode_frame(message, decoded)) fatal("bad frame");
+                checksum += decoded.kind;
+            }
+        }
+        else {
+            while (extract_message(buffer, message)) {
+                if (!parse_message(message, decoded)) fatal("bad message %s", message.c_str());
+                checksum += decoded.kind;
+            }
+        }
+        if (i >= WARMUP) result.samples.push_back(now_ns() - start);
+    }
+    if (checksum == 0) fatal("nothing decoded");
+    return result;
+}
+
+static void bench_protocol(int iterations) {
+    mt19937 random(1);
+    vector<string> texts(64), frames(64);
+    size_t text_bytes = 0, frame_bytes = 0;
+    for (size_t i = 0; i < texts.size(); i++) {
+        build_deal(random, texts[i], frames[i]);
+        text_bytes += texts[i].size();
+        frame_bytes += frames[i].size();
+    }
+    printf("bytes per deal and player: text %.1f, binary %.1f\n", (double)text_bytes / texts.size(),
+           (double)frame_bytes / frames.size());
+    print_header();
+    print_result(decode_stream("text", texts, false, iterations));
+    print_result(decode_stream("binary", frames, true, iterations));
+}
+
+// Appends games with random players straight into a store, then times
+// the queries the way kierki-results runs them.
+static void bench_results(int games) {
+    string path = "/tmp/kierki-bench-" + to_string(getpid());
+    mt19937 random(1);
+    {
+        ResultsStore store;
+        store.open(path, true);
+        vector<uint32_t> players(BENCH_PLAYERS);
+        for (int i = 0; i < BENCH_PLAYERS; i++) players[i] = store.player("player" + to_string(i));
+        int64_t start = now_ns();
+        for (int g = 0; g < games; g++) {
+            ResultRecord record = {};
+            record.kind = RESULT_GAME;
+            record.deal = 7;
+            record.game = store.new_game();
+            record.time = g;
+            for (int i = 0; i < 4; i++) {
+                record.players[i] = players[random() % BENCH_PLAYERS];
+                record.scores[i] = random() % 100;
+                record.totals[i] = record.scores[i];
+            }
+            store.append(record);
+        }
+        int64_t elapsed = now_ns() - start;
+        printf("appended %d games in %.2f s, %.0f ns per game\n", games, elapsed / 1e9, (double)elapsed / games);
+    }
+    ResultsStore store;
+    store.open(path, false);
+    Result leaderboard = {"leaderboard", {}};
+    Result history = {"history", {}};
+    vector<uint32_t> top;
+    vector<uint64_t> records;
+    for (int i = 0; i < 1000; i++) {
+        int64_t start = now_ns();
+        store.leaderboard(10, 1, top);
+        leaderboard.samples.push_back(now_ns() - start);
+        string name = "player" + to_string(random() % BENCH_PLAYERS);
+        start = now_ns();
+        store.history(store.find_player(name), 20, true, records);
+        history.samples.push_back(now_ns() - start);
+    }
+    print_header();
+    print_result(leaderboard);
+    print_result(history);
+    for (string suffix : {".log", ".players", ".index"}) ::unlink((path + suffix).c_str());
+}
+
+struct LoadPlayer {
+    int fd = -1;
+    bool connected = false;
+    string buffer;
+    vector<Card> cards;
+    // When the card completing a trick went out, 0 when not waiting for TAKEN.
+    int64_t completed = 0;
+    // Unwritten output of an abusive peer.
+    string output;
+};
+
+// Connects without blocking, a full listen queue must not stall the other players.
+static int connect_local(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) syserr("socket");
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    //The card must not wait for an ACK of the previous one
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (connect(fd, (sockaddr *) &address, sizeof address) < 0 && errno != EINPROGRESS) syserr("connect");
+    return fd;
+}
+
+// Greets once a connection of connect_local is up, false when it failed.
+static bool finish_connect(LoadPlayer &player) {
+    int error = 0;
+    socklen_t length = sizeof error;
+    getsockopt(player.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+        close(player.fd);
+        player.fd = -1;
+        return false;
+    }
+    //Blocking writes from here on, replies are tiny
+    fcntl(player.fd, F_SETFL, 0);
+    player.connected = true;
+    write_all(player.fd, "IAM*\r\n", 6);
+    return true;
+}
+
+// Answers a TRICK the way the bot of the client does.
+static void play_card(LoadPlayer &player, const Message &trick) {
+    vector<Card> trick_cards = trick.cards;
+    Card card = choose_card(player.cards, trick_cards);
+    for (int k = 0; k < (int)player.cards.size(); k++) {
+        if (player.cards[k].color == card.color && player.cards[k].value == card.value) {
+            player.cards.erase(player.cards.begin() + k);
+            break;
+        }
+    }
+    string reply = "TRICK" + to_string(trick.number) + card_to_string(card) + "\r\n";
+    write_all(player.fd, reply.data(), reply.size());
+}
+
+// A card which is not in the hand, never a legal move.
+static Card missing_card(const vector<Card> &cards) {
+    for (char color : string("CDHS")) {
+        for (int value = 2; value <= 14; value++) {
+            bool held = false;
+            for (const Card &card : cards) held |= card.color == color && card.value == value;
+            if (!held) return {color, value};
+        }
+    }
+    return {'C', 2};
+}
+
+// Players which take a seat like any other, play their cards when asked
+// and otherwise keep FLOOD_BURST cards they do not have in flight, each
+// answered with WRONG. Run in a process of their own, so reading those
+// answers does not slow down the players being measured.
+static void flood(uint16_t port, int abusers, int seconds) {
+    vector<LoadPlayer> players(abusers);
+    int64_t end = now_ns() + (int64_t)seconds * 1000000000;
+    vector<pollfd> pollfds;
+    string message;
+    Message decoded;
+    int64_t wrong = 0;
+    while (now_ns() < end) {
+        pollfds.clear();
+        for (LoadPlayer &player : players) {
+            if (player.fd == -1) {
+                player = LoadPlayer();
+                player.fd = connect_local(port);
+            }
+            //Cards only once dealt, before that there is no seat to send them from
+            if (player.connected && player.output.empty() && !player.cards.empty()) {
+                string card = "TRICK1" + card_to_string(missing_card(player.cards)) + "\r\n";
+                for (int k = 0; k < FLOOD_BURST; k++) player.output += card;
+            }
+            short events = player.connected ? POLLIN : POLLOUT;
+            if (player.connected && !player.output.empty()) events |= POLLOUT;
+            pollfds.push_back({player.fd, events, 0});
+        }
+        if (poll(pollfds.data(), pollfds.size(), 100) < 0) syserr("poll");
+        for (int i = 0; i < abusers; i++) {
+            LoadPlayer &player = players[i];
+            short revents = pollfds[i].revents;
+            if (!player.connected) {
+                if (revents == 0) continue;
+                int error = 0;
+                socklen_t length = sizeof error;
+                getsockopt(player.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                player.connected = error == 0;
+                if (player.connected) player.output = "IAM*\r\n";
+                else {
+                    close(player.fd);
+                    player.fd = -1;
+                }
+                continue;
+            }
+            if (revents & POLLOUT) {
+                ssize_t written = send(player.fd, player.output.data(), player.output.size(), MSG_NOSIGNAL);
+                if (written > 0) player.output.erase(0, written);
+            }
+            if (!(revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            char chunk[4096];
+            ssize_t length = read(player.fd, chunk, sizeof chunk);
+            if (length < 0 && errno == EAGAIN) continue;
+            if (length <= 0) {
+                close(player.fd);
+                player.fd = -1;
+                continue;
+            }
+            player.buffer.append(chunk, length);
+            while (extract_message(player.buffer, message)) {
+                if (!parse_message(message, decoded)) continue;
+                if (decoded.kind == MESSAGE_DEAL) player.cards = decoded.cards;
+                else if (decoded.kind == MESSAGE_WRONG) wrong++;
+                else if (decoded.kind == MESSAGE_TRICK) {
+                    Card card = choose_card(player.cards, decoded.cards);
+                    for (int k = 0; k < (int)player.cards.size(); k++) {
+                        if (player.cards[k].color == card.color && player.cards[k].value == card.value) {
+                            player.cards.erase(player.cards.begin() + k);
+                            break;
+                        }
+                    }
+                    //Behind whatever is still queued, like a real pipelining client
+                    player.output += "TRICK" + to_string(decoded.number) + card_to_string(card) + "\r\n";
+                }
+            }
+        }
+    }
+    for (LoadPlayer &player : players) {
+        if (player.fd != -1) close(player.fd);
+    }
+    printf("%d abusive peers got %ld WRONG answers\n", abusers, wrong);
+}
+
+// Keeps 4 * tables bots playing against a lobby server (-l) and measures
+// how long the server takes from the card completing a trick to TAKEN,
+// while other connections keep arriving with bad greetings. With abusers,
+// that many of the players flood the server from another process and
+// only the others are measured.
+static void bench_load(uint16_t port, int tables, int seconds, int abusers) {
+    pid_t flooder = -1;
+    if (abusers > 0) {
+        flooder = fork();
+        if (flooder < 0) syserr("fork");
+        if (flooder == 0) {
+            flood(port, abusers, seconds);
+            exit(0);
+        }
+    }
+    vector<LoadPlayer> players(tables * 4 - abusers);
+    Result result = {"trick", {}};
+    int64_t end = now_ns() + (int64_t)seconds * 1000000000;
+    int64_t next_churn = now_ns();
+    vector<pollfd> pollfds;
+    // Churn connections still connecting, with the time they were opened.
+    vector<pair<int, int64_t>> churn;
+    string message;
+    Message decoded;
+    while (now_ns() < end) {
+        pollfds.clear();
+        for (int i = 0; i < (int)players.size(); i++) {
+            LoadPlayer &player = players[i];
+            if (player.fd == -1) {
+                player = LoadPlayer();
+                player.fd = connect_local(port);
+            }
+            pollfds.push_back({player.fd, (short)(player.connected ? POLLIN : POLLOUT), 0});
+        }
+        if (now_ns() >= next_churn) {
+            churn.push_back({connect_local(port), now_ns()});
+            next_churn += 1000000000 / CHURN_RATE;
+        }
+        for (auto [fd, opened] : churn) pollfds.push_back({fd, POLLOUT, 0});
+        if (poll(pollfds.data(), pollfds.size(), 1000 / CHURN_RATE) < 0) syserr("poll");
+        int64_t now = now_ns();
+        for (int k = churn.size() - 1; k >= 0; k--) {
+            short revents = pollfds[players.size() + k].revents;
+            if (revents == 0 && now - churn[k].second < 1000000000) continue;
+            if (revents & POLLOUT) write(churn[k].first, "IAMX\r\n", 6);
+            close(churn[k].first);
+            churn.erase(churn.begin() + k);
+        }
+        for (int i = 0; i < (int)players.size(); i++) {
+            if (pollfds[i].revents == 0) continue;
+            LoadPlayer &player = players[i];
+            if (!player.connected) {
+                finish_connect(player);
+                continue;
+            }
+            char chunk[4096];
+            ssize_t length = read(player.fd, chunk, sizeof chunk);
+            if (length <= 0) {
+                close(player.fd);
+                player.fd = -1;
+                continue;
+            }
+            player.buffer.append(chunk, length);
+            while (extract_message(player.buffer, message)) {
+                if (!parse_message(message, decoded)) continue;
+                if (decoded.kind == MESSAGE_DEAL) player.cards = decoded.cards;
+                else if (decoded.kind == MESSAGE_TAKEN && player.completed != 0) {
+                    result.samples.push_back(now - player.completed);
+                    player.completed = 0;
+                }
+                else if (decoded.kind == MESSAGE_TRICK) {
+                    play_card(player, decoded);
+                    if (decoded.cards.size() == 3) player.completed = now_ns();
+                }
+            }
+        }
+    }
+    for (LoadPlayer &player : players) {
+        if (player.fd != -1) close(player.fd);
+    }
+    for (auto [fd, opened] : churn) close(fd);
+    if (flooder > 0 && waitpid(flooder, nullptr, 0) < 0) syserr("waitpid");
+    if (result.samples.empty()) fatal("No tricks completed");
+    print_header();
+    print_result(result);
+}
+
+// A single table of four bots and nothing else, each waiting for the
+// server in turn: "card" is the time from a card to the next TRICK of the
+// table, "trick" from the first TRICK of a trick to its TAKEN.
+static void bench_pingpong(uint16_t port, int seconds) {
+    vector<LoadPlayer> players(4);
+    Result card = {"card", {}};
+    Result trick = {"trick", {}};
+    // When the last card went out and when the trick was opened, 0 when answered.
+    int64_t card_sent = 0;
+    int64_t trick_opened = 0;
+    int trick_number = 0;
+    int64_t end = now_ns() + (int64_t)seconds * 1000000000;
+    pollfd pollfds[4];
+    string message;
+    Message decoded;
+    while (now_ns() < end) {
+        for (int i = 0; i < 4; i++) {
+            LoadPlayer &player = players[i];
+            if (player.fd == -1) {
+                player = LoadPlayer();
+                player.fd = connect_local(port);
+            }
+            pollfds[i] = {player.fd, (short)(player.connected ? POLLIN : POLLOUT), 0};
+        }
+        if (spin_poll(pollfds, 4, 100) < 0) syserr("poll");
+        for (int i = 0; i < 4; i++) {
+            if (pollfds[i].revents == 0) continue;
+            LoadPlayer &player = players[i];
+            if (!player.connected) {
+                finish_connect(player);
+                continue;
+            }
+            char chunk[4096];
+            ssize_t length = read(player.fd, chunk, sizeof chunk);
+            if (length <= 0) {
+                close(player.fd);
+                player.fd = -1;
+                continue;
+            }
+            player.buffer.append(chunk, length);
+            while (extract_message(player.buffer, message)) {
+                //Read together with messages of the other seats, but not before the card they answer
+                int64_t now = now_ns();
+                if (!parse_message(message, decoded)) continue;
+                if (decoded.kind == MESSAGE_DEAL) player.cards = decoded.cards;
+                else if (decoded.kind == MESSAGE_SCORE) card_sent = 0;
+                else if (decoded.kind == MESSAGE_TAKEN && trick_opened != 0 && decoded.number == trick_number) {
+                    trick.samples.push_back(now - trick_opened);
+                    trick_opened = 0;
+                }
+                else if (decoded.kind == MESSAGE_TRICK) {
+                    if (card_sent != 0) card.samples.push_back(now - card_sent);
+                    if (decoded.cards.empty()) {
+                        trick_opened = now;
+                        trick_number = decoded.number;
+                    }
+                    play_card(player, decoded);
+                    card_sent = now_ns();
+                }
+            }
+        }
+    }
+    for (LoadPlayer &player : players) {
+        if (player.fd != -1) close(player.fd);
+    }
+    if (trick.samples.empty()) fatal("No tricks completed");
+    print_header();
+    print_result(card);
+    print_result(trick);
+}
+
+static int64_t resident_kb(int pid) {
+    ifstream status("/proc/" + to_string(pid) + "/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.starts_with("VmRSS:")) return stol(line.substr(6));
+    }
+    fatal("Cannot read the memory of process %d", pid);
+}
+
+// Parks connections in a lobby (-l) queue which never fills, every one
+// asks for N, and reports how much the server's resident memory grew.
+static void bench_idle(uint16_t port, int server_pid, int connections) {
+    int64_t before = resident_kb(server_pid);
+    vector<int> fds;
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    for (int i = 0; i < connections; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) syserr("socket");
+        if (connect(fd, (sockaddr *) &address, sizeof address) < 0) syserr("connect");
+        if (write(fd, "IAMN\r\n", 6) != 6) syserr("write");
+        fds.push_back(fd);
+        //The server accepts one connection per loop, a full backlog costs a second per dropped SYN
+        usleep(IDLE_CONNECT_PAUSE);
+    }
+    //Let the server read every greeting
+    sleep(2);
+    int64_t after = resident_kb(server_pid);
+    printf("%d idle connections: server resident %ld kB -> %ld kB, %.0f bytes per connection\n", connections,
+           before, after, (after - before) * 1024.0 / connections);
+    for (int fd : fds) close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    string mode = "";
+    int iterations = -1;
+    uint16_t port = 0;
+    int tables = 8;
+    int server_pid = 0;
+    int abusers = 0;
+    string cores = "";
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-n") {
+            if (i + 1 >= argc) fatal("Missing argument for -n");
+            else iterations = stoi(argv[++i]);
+        }
+        else if (arg == "-p") {
+            if (i + 1 >= argc) fatal("Missing argument for -p");
+            else port = read_port(argv[++i]);
+        }
+        else if (arg == "-t") {
+            if (i + 1 >= argc) fatal("Missing argument for -t");
+            else tables = stoi(argv[++i]);
+        }
+        else if (arg == "-a") {
+            if (i + 1 >= argc) fatal("Missing argument for -a");
+            else abusers = stoi(argv[++i]);
+        }
+        else if (arg == "-s") {
+            if (i + 1 >= argc) fatal("Missing argument for -s");
+            else server_pid = stoi(argv[++i]);
+        }
+        else if (arg == "-y") {
+            if (i + 1 >= argc) fatal("Missing argument for -y");
+            else tuning.spin = stoi(argv[++i]);
+        }
+        else if (arg == "-c") {
+            if (i + 1 >= argc) fatal("Missing argument for -c");
+            else cores = argv[++i];
+        }
+        else if (mode == "") mode = arg;
+        else fatal("Incorrect arguments");
+    }
+    if (iterations == 0 || iterations < -1) fatal("Incorrect number of iterations");
+    if (tuning.spin < -1) fatal("Incorrect spin time");
+    if (cores != "") tuning.cores = parse_cores(cores);
+    prefault_memory();
+    pin_thread(0);
+
+    if (mode == "transport") bench_transport(iterations == -1 ? 20000 : iterations);
+    else if (mode == "protocol") bench_protocol(iterations == -1 ? 20000 : iterations);
+    else if (mode == "results") bench_results(iterations == -1 ? 1000000 : iterations);
+    else if (mode == "load" && port != 0 && tables > 0 && abusers >= 0 && abusers < tables * 4) {
+        bench_load(port, tables, iterations == -1 ? 10 : iterations, abusers);
+    }
+    else if (mode == "pingpong" && port != 0) bench_pingpong(port, iterations == -1 ? 10 : iterations);
+    else if (mode == "idle" && port != 0 && server_pid > 0) bench_idle(port, server_pid, iterations == -1 ? 10000 : iterations);
+    else fatal("Usage: %s transport|protocol|results [-n iterations] | load -p port [-t tables] [-a abusers] [-n seconds]"
+               " | pingpong -p port [-n seconds] | idle -p port -s server_pid [-n connections] [-y spin_us] [-c core]",
+               argv[0]);
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "err.h"
+#include "endgame.h"
+
+using namespace std;
+
+static int64_t now_ns() {
+    auto now = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
+}
+
+// One number for every round type, or seven, types 1 to 7.
+static vector<int> parse_depths(const string &list) {
+    vector<int> cards(1, 0);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos) end = list.size();
+        string depth = list.substr(start, end - start);
+        if (depth.size() != 1 || depth[0] < '0' || depth[0] > '0' + ENDGAME_MAX_CARDS) {
+            fatal("Cards per hand must be from 0 to %d", ENDGAME_MAX_CARDS);
+        }
+        cards.push_back(depth[0] - '0');
+        start = end + 1;
+    }
+    if (cards.size() == 2) cards.resize(8, cards[1]);
+    if (cards.size() != 8) fatal("Incorrect list of cards per hand %s", list.c_str());
+    return cards;
+}
+
+int main(int argc, char *argv[]) {
+    string output;
+    //Cards per hand for every round type; type 7 at two cards is some 15M positions
+    vector<int> cards = {0, 2, 2, 2, 2, 2, 2, 1};
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-o") {
+            if (i + 1 >= argc) fatal("Missing argument for -o");
+            else output = argv[++i];
+        }
+        else if (arg == "-k") {
+            if (i + 1 >= argc) fatal("Missing argument for -k");
+            else cards = parse_depths(argv[++i]);
+        }
+        else fatal("Usage: %s -o endgame file [-k cards per hand[,per round type]...]", argv[0]);
+    }
+    if (output.empty()) fatal("Missing file name");
+
+    EndgameTable table;
+    int64_t start = now_ns();
+    for (int type = 1; type <= 7; type++) {
+        for (int level = 1; level <= cards[type]; level++) {
+            uint64_t before = table.size();
+            table.build_level(type, level);
+            printf("type %d cards %d positions %lu ms %ld\n", type, level, table.size() - before,
+                   (now_ns() - start) / 1000000);
+            fflush(stdout);
+        }
+    }
+    table.save(output);
+    printf("positions %lu bytes %lu\n", table.size(),
+           sizeof(EndgameHeader) + table.capacity() * sizeof(EndgameRecord));
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ctime>
+
+#include "err.h"
+#include "results.h"
+
+using namespace std;
+
+static int64_t now_ns() {
+    auto now = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
+}
+
+static void print_time(int64_t ms) {
+    time_t seconds = ms / 1000;
+    tm local;
+    localtime_r(&seconds, &local);
+    char buffer[32];
+    strftime(buffer, sizeof buffer, "%Y-%m-%dT%H:%M:%S", &local);
+    printf("%s.%03d", buffer, (int)(ms % 1000));
+}
+
+static void print_leaderboard(const ResultsStore &store, int count, uint64_t min_games) {
+    vector<uint32_t> players;
+    int64_t start = now_ns();
+    store.leaderboard(count, min_games, players);
+    int64_t elapsed = now_ns() - start;
+    for (int i = 0; i < (int)players.size(); i++) {
+        const PlayerRecord &player = store.player_record(players[i]);
+        printf("%4d. %-22s games %6lu average %7.2f best %4d\n", i + 1, player.name, player.games,
+               (double)player.points / player.games, player.best);
+    }
+    fprintf(stderr, "%lu players, query took %.1f us\n", store.player_count(), elapsed / 1000.0);
+}
+
+static void print_history(const ResultsStore &store, const string &name, int count, bool games_only) {
+    int64_t start = now_ns();
+    int64_t player = store.find_player(name);
+    if (player == -1) fatal("Unknown player %s", name.c_str());
+    vector<uint64_t> records;
+    store.history(player, count, games_only, records);
+    int64_t elapsed = now_ns() - start;
+    for (uint64_t i : records) {
+        const ResultRecord &record = store.record(i);
+        print_time(record.time);
+        if (record.kind == RESULT_GAME) printf(" game %lu after %u deals TOTAL", record.game, record.deal);
+        else printf(" game %lu deal %u SCORE", record.game, record.deal);
+        for (int seat = 0; seat < 4; seat++) {
+            printf(" %c%d", "NESW"[seat], record.scores[seat]);
+            if (record.players[seat] == player) printf("*");
+        }
+        printf("\n");
+    }
+    fprintf(stderr, "%lu records, query took %.1f us\n", store.record_count(), elapsed / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+    string file = "";
+    string mode = "";
+    string player = "";
+    int count = 10;
+    uint64_t min_games = 1;
+    bool games_only = true;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-f") {
+            if (i + 1 >= argc) fatal("Missing argument for -f");
+            else file = argv[++i];
+        }
+        else if (arg == "-n") {
+            if (i + 1 >= argc) fatal("Missing argument for -n");
+            else count = stoi(argv[++i]);
+        }
+        else if (arg == "-m") {
+            if (i + 1 >= argc) fatal("Missing argument for -m");
+            else min_games = stoul(argv[++i]);
+        }
+        else if (arg == "-a") games_only = false;
+        else if (mode == "") mode = arg;
+        else if (mode == "history" && player == "") player = arg;
+        else fatal("Incorrect arguments");
+    }
+    if (file == "") fatal("Missing file name");
+    if (count <= 0) fatal("Incorrect count");
+
+    ResultsStore store;
+    store.open(file, false);
+    if (mode == "leaderboard") print_leaderboard(store, count, min_games);
+    else if (mode == "history" && player != "") print_history(store, player, count, games_only);
+    else fatal("Usage: %s -f file leaderboard [-n count] [-m min_games] | history <player> [-n count] [-a]", argv[0]);
+    return 0;
+}
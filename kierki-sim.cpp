@@ -0,0 +1,179 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "common.h"
+#include "err.h"
+#include "deals.h"
+#include "batch.h"
+
+// Number of mismatches printed by a validation before it gives up.
+#define MAX_MISMATCHES 10
+
+using namespace std;
+
+static int64_t now_ns() {
+    auto now = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
+}
+
+static const string suits = "CDHS";
+
+static int pack_card(Card card) {
+    return suits.find(card.color) * 16 + card.value;
+}
+
+static void remove_card(vector<Card> &cards, Card card) {
+    for (int i = 0; i < (int)cards.size(); i++) {
+        if (cards[i].color == card.color && cards[i].value == card.value) {
+            cards.erase(cards.begin() + i);
+            break;
+        }
+    }
+}
+
+// Plays a deal a card at a time, the way the server plays it with bots at every seat.
+static void play_reference(const Round &deal, int64_t points[4]) {
+    vector<Card> hands[4];
+    for (int i = 0; i < 4; i++) hands[i] = deal.player_cards[i];
+    vector<Card> trick_cards;
+    int leader = place_number(deal.starting_player);
+    for (int trick_number = 1; trick_number <= 13; trick_number++) {
+        trick_cards.clear();
+        for (int position = 0; position < 4; position++) {
+            vector<Card> &hand = hands[(leader + position) % 4];
+            Card card = choose_card(hand, trick_cards);
+            remove_card(hand, card);
+            trick_cards.push_back(card);
+        }
+        leader = (leader + trick_winner(trick_cards)) % 4;
+        points[leader] += trick_points(deal.type, trick_number, trick_cards);
+    }
+}
+
+static void report(int &mismatches, int game, int trick_number, const string &what) {
+    if (mismatches < MAX_MISMATCHES) cerr << "deal " << game << " trick " << trick_number << ": " << what << endl;
+    mismatches++;
+}
+
+// Steps the engine and the reference rules side by side and compares legal moves, cards, winners and points.
+static int validate(const vector<Round> &deals, const string &kernels) {
+    BatchEngine engine(deals, kernels);
+    int games = deals.size();
+    vector<vector<Card>> hands(games * 4);
+    vector<vector<Card>> tricks(games);
+    vector<int> leaders(games);
+    vector<int> points(games * 4, 0);
+    for (int game = 0; game < games; game++) {
+        for (int seat = 0; seat < 4; seat++) hands[game * 4 + seat] = deals[game].player_cards[seat];
+        leaders[game] = place_number(deals[game].starting_player);
+    }
+    int mismatches = 0;
+    int64_t checks = 0;
+    for (int trick_number = 1; trick_number <= 13; trick_number++) {
+        for (int game = 0; game < games; game++) tricks[game].clear();
+        for (int position = 0; position < 4; position++) {
+            engine.legal_moves(position);
+            engine.choose_cards(position);
+            for (int game = 0; game < games; game++) {
+                vector<Card> &hand = hands[game * 4 + (leaders[game] + position) % 4];
+                for (int suit = 0; suit < 4; suit++) {
+                    for (int value = 2; value <= 14; value++) {
+                        Card card = {suits[suit], value};
+                        bool legal = (engine.legal(game, suit) >> (value - 2)) & 1;
+                        checks++;
+                        if (legal != can_play(hand, tricks[game], card)) {
+                            report(mismatches, game, trick_number, "legality of " + card_to_string(card));
+                        }
+                    }
+                }
+                Card card = choose_card(hand, tricks[game]);
+                checks++;
+                if (engine.card(game, position) != pack_card(card)) {
+                    report(mismatches, game, trick_number, "played card, expected " + card_to_string(card));
+                }
+                remove_card(hand, card);
+                tricks[game].push_back(card);
+            }
+        }
+        engine.take_trick(trick_number);
+        for (int game = 0; game < games; game++) {
+            int winner = (leaders[game] + trick_winner(tricks[game])) % 4;
+            points[game * 4 + winner] += trick_points(deals[game].type, trick_number, tricks[game]);
+            leaders[game] = winner;
+            checks++;
+            if (engine.leader(game) != winner) report(mismatches, game, trick_number, "winner");
+            for (int seat = 0; seat < 4; seat++) {
+                checks++;
+                if (engine.points(game, seat) != points[game * 4 + seat]) report(mismatches, game, trick_number, "points");
+            }
+        }
+    }
+    cout << "validated " << games << " deals with " << engine.kernel_name() << " kernels, " << checks << " checks, "
+         << mismatches << " mismatches" << endl;
+    return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+    string file = "";
+    int copies = 1;
+    string kernels = "";
+    bool reference = false;
+    bool check = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-f") {
+            if (i + 1 >= argc) fatal("Missing argument for -f");
+            else file = argv[++i];
+        }
+        else if (arg == "-n") {
+            if (i + 1 >= argc) fatal("Missing argument for -n");
+            else copies = stoi(argv[++i]);
+        }
+        else if (arg == "-k") {
+            if (i + 1 >= argc) fatal("Missing argument for -k");
+            else kernels = argv[++i];
+        }
+        else if (arg == "-r") reference = true;
+        else if (arg == "-v") check = true;
+        else fatal("Usage: %s -f file [-n copies] [-k avx2|sse2|scalar | -r] [-v]", argv[0]);
+    }
+    if (file == "") fatal("Missing file name");
+    if (copies <= 0) fatal("Incorrect number of copies");
+
+    DealSource source;
+    source.open(file, false);
+    if (source.streaming()) fatal("%s is not a deal file", file.c_str());
+    vector<Round> deals;
+    for (int copy = 0; copy < copies; copy++) {
+        for (int i = 0; i < source.size(); i++) {
+            deals.emplace_back();
+            source.next(i, deals.back());
+        }
+    }
+    if (check) return validate(deals, kernels) == 0 ? 0 : 1;
+
+    int64_t totals[4] = {};
+    int64_t start = now_ns();
+    string name = "reference";
+    if (reference) {
+        for (const Round &deal : deals) play_reference(deal, totals);
+    }
+    else {
+        BatchEngine engine(deals, kernels);
+        start = now_ns();
+        engine.play();
+        name = engine.kernel_name();
+        for (int game = 0; game < engine.size(); game++) {
+            for (int seat = 0; seat < 4; seat++) totals[seat] += engine.points(game, seat);
+        }
+    }
+    int64_t elapsed = now_ns() - start;
+    cout << "TOTAL";
+    for (int seat = 0; seat < 4; seat++) cout << "NESW"[seat] << totals[seat];
+    cout << endl;
+    printf("deals %zu kernels %s ns_per_deal %.1f deals_per_second %.0f\n", deals.size(), name.c_str(),
+           (double)elapsed / deals.size(), deals.size() * 1e9 / elapsed);
+    return 0;
+}
@@ -0,0 +1,614 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <memory>
+#include <random>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <ucontext.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "err.h"
+#include "net.h"
+#include "game.h"
+#include "client.h"
+
+// Coroutine stacks. Pages are only touched as deep as a loop goes, so
+// thousands of seats cost far less than their sum.
+#define GAME_STACK    (1 << 20)
+#define SEAT_STACK    (128 << 10)
+// Virtual descriptors start here, far above any real one.
+#define VIRTUAL_FD    (1 << 24)
+#define SERVER_PORT   2024
+// Ephemeral ports of the seats' connections.
+#define FIRST_PORT    1024
+// Polls finding nothing without ever waiting, after which a loop is taken
+// to be spinning: in virtual time it would never let the clock move.
+#define SPIN_LIMIT    1000000
+
+using namespace std;
+
+static int64_t now_ms() {
+    auto now = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()).count();
+}
+
+// Bytes on their way to an endpoint, or the news that its peer is gone.
+struct Packet {
+    int64_t arrival;
+    string data;
+    bool hangup;
+};
+
+struct Endpoint {
+    bool open = false;
+    bool listener = false;
+    // A seat's end of a connection, what it sends after the greeting waits for the player to think.
+    bool seat = false;
+    bool greeted = false;
+    uint16_t port = 0;
+    int peer = -1;
+    // Actor woken when something arrives, the last one to poll it.
+    int owner = -1;
+    // Bumped when the slot is reused, arrivals for an earlier connection are ignored.
+    uint32_t generation = 0;
+    string input;
+    // The peer is gone and everything it sent has arrived.
+    bool hangup = false;
+    vector<Packet> in_flight;
+    size_t in_flight_head = 0;
+    vector<int> backlog;
+    size_t backlog_head = 0;
+};
+
+// A loop with its own stack. It runs until its next wait on the network,
+// which switches back to the scheduler.
+struct Actor {
+    ucontext_t context;
+    unique_ptr<char[]> stack;
+    function<void()> body;
+    bool ready = false;
+    bool finished = false;
+    int64_t deadline = -1;
+};
+
+struct Arrival {
+    int64_t time;
+    int endpoint;
+    uint32_t generation;
+    bool operator>(const Arrival &other) const { return this->time > other.time; }
+};
+
+// A network of in-memory connections under a clock that stands still while
+// anything can run and otherwise jumps to the next arrival or timeout. Every
+// actor is a coroutine, so a wait inside Game::run or Client::run is where
+// the next one gets its turn, and a day passes as fast as the loops can play it.
+class VirtualNet : public Net {
+public:
+    // The clock starts at start ms, rounded up to the quantum.
+    VirtualNet(int quantum, int latency, int think, int stall_percent, int stall_max, uint64_t seed, int64_t start);
+    int64_t now() override { return this->clock; }
+    int poll(pollfd *fds, nfds_t count, int timeout) override;
+    ssize_t read(int fd, void *buffer, size_t size) override;
+    ssize_t write(int fd, const void *buffer, size_t size) override;
+    void close(int fd) override;
+    void sleep(int milliseconds) override { this->poll(nullptr, 0, milliseconds); }
+    int listen(const sockaddr *address, socklen_t length, int backlog) override;
+    int accept(int listener, sockaddr_storage &address) override;
+    int connect(const sockaddr *address, socklen_t length) override;
+    void local_address(int fd, sockaddr_storage &address) override;
+
+    void spawn(function<void()> body, size_t stack_size);
+    // Runs every actor until the clock reaches end.
+    void run(int64_t end);
+    // Closes a random seat's connection at both ends, as a network failure would.
+    bool reset_connection();
+    int64_t resets = 0;
+    int64_t connections = 0;
+    mt19937_64 random;
+private:
+    int64_t clock = 0;
+    // Arrivals and timeouts happen on multiples of quantum ms, so a loop
+    // wakes once for everything that came in the meantime.
+    int quantum;
+    int latency;
+    int think;
+    int stall_percent;
+    int stall_max;
+    vector<Endpoint> endpoints;
+    vector<int> free_endpoints;
+    // Seat ends of connections, closed ones are dropped when picked.
+    vector<int> seat_ends;
+    uint16_t next_port = FIRST_PORT;
+    int listener = -1;
+
+    // A deque, contexts must not move once made.
+    deque<Actor> actors;
+    deque<int> ready;
+    int current = -1;
+    int spins = 0;
+    ucontext_t scheduler;
+    priority_queue<Arrival, vector<Arrival>, greater<Arrival>> arrivals;
+    priority_queue<pair<int64_t, int>, vector<pair<int64_t, int>>, greater<pair<int64_t, int>>> timers;
+
+    static void start_actor(unsigned int high, unsigned int low);
+    Endpoint *endpoint(int fd);
+    int open_endpoint();
+    void send(int to, string data, bool hangup, int64_t delay);
+    void disconnect(int id);
+    void deliver(const Arrival &arrival);
+    void wake(int actor);
+    void block(int64_t deadline);
+    int64_t think_time();
+    int64_t round_up(int64_t time) { return (time + this->quantum - 1) / this->quantum * this->quantum; }
+};
+
+VirtualNet::VirtualNet(int quantum, int latency, int think, int stall_percent, int stall_max, uint64_t seed,
+                       int64_t start)
+    : random(seed) {
+    this->quantum = quantum;
+    this->clock = this->round_up(start);
+    this->latency = latency;
+    this->think = think;
+    this->stall_percent = stall_percent;
+    this->stall_max = stall_max;
+}
+
+Endpoint *VirtualNet::endpoint(int fd) {
+    int id = fd - VIRTUAL_FD;
+    if (id < 0 || id >= (int)this->endpoints.size() || !this->endpoints[id].open) return nullptr;
+    return &this->endpoints[id];
+}
+
+int VirtualNet::open_endpoint() {
+    int id;
+    if (this->free_endpoints.empty()) {
+        id = this->endpoints.size();
+        this->endpoints.emplace_back();
+    }
+    else {
+        id = this->free_endpoints.back();
+        this->free_endpoints.pop_back();
+    }
+    Endpoint &e = this->endpoints[id];
+    uint32_t generation = e.generation + 1;
+    e = Endpoint();
+    e.generation = generation;
+    e.open = true;
+    e.owner = this->current;
+    return id;
+}
+
+int VirtualNet::poll(pollfd *fds, nfds_t count, int timeout) {
+    int64_t deadline = timeout < 0 ? -1 : this->clock + timeout;
+    while (true) {
+        int ready = 0;
+        for (nfds_t i = 0; i < count; i++) {
+            fds[i].revents = 0;
+            if (fds[i].fd < 0) continue;
+            Endpoint *e = this->endpoint(fds[i].fd);
+            if (e == nullptr) fds[i].revents = POLLNVAL;
+            else {
+                e->owner = this->current;
+                bool readable = e->listener ? e->backlog_head < e->backlog.size() : !e->input.empty() || e->hangup;
+                if (readable) fds[i].revents |= fds[i].events & POLLIN;
+                if (e->peer != -1) fds[i].revents |= fds[i].events & POLLOUT;
+                else if (!e->listener && e->hangup && e->input.empty()) fds[i].revents |= POLLHUP;
+            }
+            if (fds[i].revents != 0) ready++;
+        }
+        if (ready > 0) return ready;
+        if (deadline != -1 && this->clock >= deadline) {
+            if (timeout == 0 && ++this->spins > SPIN_LIMIT) fatal("A loop spins at %lld ms", (long long)this->clock);
+            return 0;
+        }
+        this->block(deadline);
+    }
+}
+
+ssize_t VirtualNet::read(int fd, void *buffer, size_t size) {
+    Endpoint *e = this->endpoint(fd);
+    if (e == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    if (e->input.empty()) {
+        if (e->hangup) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t length = min(size, e->input.size());
+    memcpy(buffer, e->input.data(), length);
+    e->input.erase(0, length);
+    return length;
+}
+
+ssize_t VirtualNet::write(int fd, const void *buffer, size_t size) {
+    Endpoint *e = this->endpoint(fd);
+    if (e == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    if (e->peer == -1) {
+        errno = EPIPE;
+        return -1;
+    }
+    int64_t delay = this->latency;
+    if (e->seat && e->greeted) delay += this->think_time();
+    e->greeted = true;
+    this->send(e->peer, string((const char *)buffer, size), false, delay);
+    return size;
+}
+
+// Exponential with the mean think time, and now and then a player who wanders off.
+int64_t VirtualNet::think_time() {
+    int64_t time = exponential_distribution<double>(1.0 / max(this->think, 1))(this->random);
+    if ((int)(this->random() % 100) < this->stall_percent) time += this->random() % (this->stall_max + 1);
+    return time;
+}
+
+// Arrivals at one endpoint keep the order they were sent in.
+void VirtualNet::send(int to, string data, bool hangup, int64_t delay) {
+    Endpoint &e = this->endpoints[to];
+    int64_t arrival = this->round_up(this->clock + delay);
+    if (e.in_flight_head < e.in_flight.size()) arrival = max(arrival, e.in_flight.back().arrival);
+    e.in_flight.push_back({arrival, std::move(data), hangup});
+    this->arrivals.push({arrival, to, e.generation});
+}
+
+void VirtualNet::deliver(const Arrival &arrival) {
+    Endpoint &e = this->endpoints[arrival.endpoint];
+    if (!e.open || e.generation != arrival.generation) return;
+    bool arrived = false;
+    while (e.in_flight_head < e.in_flight.size() && e.in_flight[e.in_flight_head].arrival <= this->clock) {
+        Packet &packet = e.in_flight[e.in_flight_head++];
+        if (packet.hangup) e.hangup = true;
+        else e.input += packet.data;
+        arrived = true;
+    }
+    if (e.in_flight_head == e.in_flight.size()) {
+        e.in_flight.clear();
+        e.in_flight_head = 0;
+    }
+    if (arrived && e.owner != -1) this->wake(e.owner);
+}
+
+// The peer hears of it after the latency, behind whatever was already sent.
+void VirtualNet::disconnect(int id) {
+    Endpoint &e = this->endpoints[id];
+    if (e.peer == -1) return;
+    int peer = e.peer;
+    e.peer = -1;
+    this->endpoints[peer].peer = -1;
+    this->send(peer, "", true, this->latency);
+}
+
+void VirtualNet::close(int fd) {
+    Endpoint *e = this->endpoint(fd);
+    if (e == nullptr) return;
+    int id = fd - VIRTUAL_FD;
+    this->disconnect(id);
+    //Connections still waiting to be accepted are refused
+    for (size_t i = e->backlog_head; i < e->backlog.size(); i++) this->close(e->backlog[i] + VIRTUAL_FD);
+    e = &this->endpoints[id];
+    e->open = false;
+    e->input = string();
+    e->in_flight = vector<Packet>();
+    e->backlog = vector<int>();
+    this->free_endpoints.push_back(id);
+}
+
+int VirtualNet::listen(const sockaddr *address, socklen_t, int) {
+    if (address->sa_family != AF_INET6 || this->listener != -1) fatal("The virtual network has one TCP listener");
+    int id = this->open_endpoint();
+    this->endpoints[id].listener = true;
+    this->endpoints[id].port = ntohs(((sockaddr_in6 *) address)->sin6_port);
+    this->listener = id;
+    return id + VIRTUAL_FD;
+}
+
+int VirtualNet::accept(int listener, sockaddr_storage &address) {
+    Endpoint *e = this->endpoint(listener);
+    if (e == nullptr || !e->listener || e->backlog_head == e->backlog.size()) {
+        errno = EAGAIN;
+        return -1;
+    }
+    int id = e->backlog[e->backlog_head++];
+    if (e->backlog_head == e->backlog.size()) {
+        e->backlog.clear();
+        e->backlog_head = 0;
+    }
+    this->endpoints[id].owner = this->current;
+    sockaddr_in6 *peer = (sockaddr_in6 *) &address;
+    *peer = {};
+    peer->sin6_family = AF_INET6;
+    peer->sin6_addr = in6addr_loopback;
+    int other = this->endpoints[id].peer;
+    peer->sin6_port = htons(other == -1 ? 0 : this->endpoints[other].port);
+    return id + VIRTUAL_FD;
+}
+
+int VirtualNet::connect(const sockaddr *address, socklen_t) {
+    uint16_t port = 0;
+    if (address->sa_family == AF_INET6) port = ntohs(((sockaddr_in6 *) address)->sin6_port);
+    else if (address->sa_family == AF_INET) port = ntohs(((sockaddr_in *) address)->sin_port);
+    if (this->listener == -1 || this->endpoints[this->listener].port != port) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    int seat = this->open_endpoint();
+    int server = this->open_endpoint();
+    Endpoint &s = this->endpoints[seat];
+    s.seat = true;
+    s.port = this->next_port;
+    s.peer = server;
+    this->next_port = this->next_port == 65535 ? FIRST_PORT : this->next_port + 1;
+    this->endpoints[server].peer = seat;
+    this->endpoints[server].port = port;
+    Endpoint &l = this->endpoints[this->listener];
+    this->endpoints[server].owner = l.owner;
+    l.backlog.push_back(server);
+    if (l.owner != -1) this->wake(l.owner);
+    this->seat_ends.push_back(seat);
+    this->connections++;
+    return seat + VIRTUAL_FD;
+}
+
+void VirtualNet::local_address(int fd, sockaddr_storage &address) {
+    Endpoint *e = this->endpoint(fd);
+    if (e == nullptr) fatal("local_address of a closed descriptor");
+    sockaddr_in6 *local = (sockaddr_in6 *) &address;
+    *local = {};
+    local->sin6_family = AF_INET6;
+    local->sin6_addr = e->listener ? in6addr_any : in6addr_loopback;
+    local->sin6_port = htons(e->port);
+}
+
+bool VirtualNet::reset_connection() {
+    while (!this->seat_ends.empty()) {
+        size_t i = this->random() % this->seat_ends.size();
+        int id = this->seat_ends[i];
+        Endpoint &e = this->endpoints[id];
+        //Closed since, or the slot now holds another connection
+        if (!e.open || !e.seat || e.peer == -1) {
+            this->seat_ends[i] = this->seat_ends.back();
+            this->seat_ends.pop_back();
+            continue;
+        }
+        int peer = e.peer;
+        e.peer = -1;
+        this->endpoints[peer].peer = -1;
+        this->send(id, "", true, 0);
+        this->send(peer, "", true, 0);
+        this->resets++;
+        return true;
+    }
+    return false;
+}
+
+void VirtualNet::wake(int actor) {
+    Actor &a = this->actors[actor];
+    if (a.ready || a.finished) return;
+    a.ready = true;
+    this->ready.push_back(actor);
+}
+
+void VirtualNet::block(int64_t deadline) {
+    Actor &a = this->actors[this->current];
+    if (deadline != -1) this->timers.push({this->round_up(deadline), this->current});
+    a.deadline = deadline;
+    this->spins = 0;
+    swapcontext(&a.context, &this->scheduler);
+}
+
+// makecontext passes ints, the actor's net arrives split in two.
+void VirtualNet::start_actor(unsigned int high, unsigned int low) {
+    VirtualNet *net = (VirtualNet *)(((uintptr_t)high << 32) | low);
+    int actor = net->current;
+    net->actors[actor].body();
+    net->actors[actor].finished = true;
+}
+
+void VirtualNet::spawn(function<void()> body, size_t stack_size) {
+    this->actors.emplace_back();
+    Actor &a = this->actors.back();
+    a.body = std::move(body);
+    a.stack.reset(new char[stack_size]);
+    if (getcontext(&a.context) < 0) syserr("getcontext");
+    a.context.uc_stack.ss_sp = a.stack.get();
+    a.context.uc_stack.ss_size = stack_size;
+    a.context.uc_link = &this->scheduler;
+    uintptr_t self = (uintptr_t)this;
+    makecontext(&a.context, (void (*)())start_actor, 2, (unsigned int)(self >> 32), (unsigned int)self);
+    this->wake(this->actors.size() - 1);
+}
+
+void VirtualNet::run(int64_t end) {
+    while (true) {
+        while (!this->ready.empty()) {
+            this->current = this->ready.front();
+            this->ready.pop_front();
+            Actor &a = this->actors[this->current];
+            a.ready = false;
+            a.deadline = -1;
+            if (swapcontext(&this->scheduler, &a.context) < 0) syserr("swapcontext");
+            this->current = -1;
+        }
+        int64_t next = end;
+        if (!this->arrivals.empty()) next = min(next, this->arrivals.top().time);
+        if (!this->timers.empty()) next = min(next, this->timers.top().first);
+        if (next >= end) break;
+        this->clock = next;
+        while (!this->arrivals.empty() && this->arrivals.top().time <= this->clock) {
+            Arrival arrival = this->arrivals.top();
+            this->arrivals.pop();
+            this->deliver(arrival);
+        }
+        while (!this->timers.empty() && this->timers.top().first <= this->clock) {
+            auto [time, actor] = this->timers.top();
+            this->timers.pop();
+            //Left over from an earlier wait
+            int64_t deadline = this->actors[actor].deadline;
+            if (deadline != -1 && this->round_up(deadline) == time) this->wake(actor);
+        }
+    }
+    this->clock = end;
+}
+
+// Games are counted per seat, a table's game counts four times.
+struct SeatTotals {
+    int64_t games = 0;
+    int64_t abandoned = 0;
+    RecoveryStats recovery;
+};
+
+int main(int argc, char *argv[]) {
+    string file = "";
+    int seats = 1000;
+    double hours = 24;
+    int timeout = 5;
+    int think = 5000;
+    int stall_percent = 2;
+    int latency = 20;
+    int quantum = 100;
+    int reset_minutes = 60;
+    int reconnects = 5;
+    int bot_grace = -1;
+    bool binary = false;
+    uint64_t seed = 1;
+    int64_t clock_start = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-f") {
+            if (i + 1 >= argc) fatal("Missing argument for -f");
+            else file = argv[++i];
+        }
+        else if (arg == "-n") {
+            if (i + 1 >= argc) fatal("Missing argument for -n");
+            else seats = stoi(argv[++i]);
+        }
+        else if (arg == "-H") {
+            if (i + 1 >= argc) fatal("Missing argument for -H");
+            else hours = stod(argv[++i]);
+        }
+        else if (arg == "-t") {
+            if (i + 1 >= argc) fatal("Missing argument for -t");
+            else timeout = stoi(argv[++i]);
+        }
+        else if (arg == "-m") {
+            if (i + 1 >= argc) fatal("Missing argument for -m");
+            else think = stoi(argv[++i]);
+        }
+        else if (arg == "-s") {
+            if (i + 1 >= argc) fatal("Missing argument for -s");
+            else stall_percent = stoi(argv[++i]);
+        }
+        else if (arg == "-l") {
+            if (i + 1 >= argc) fatal("Missing argument for -l");
+            else latency = stoi(argv[++i]);
+        }
+        else if (arg == "-q") {
+            if (i + 1 >= argc) fatal("Missing argument for -q");
+            else quantum = stoi(argv[++i]);
+        }
+        else if (arg == "-c") {
+            if (i + 1 >= argc) fatal("Missing argument for -c");
+            else reset_minutes = stoi(argv[++i]);
+        }
+        else if (arg == "-r") {
+            if (i + 1 >= argc) fatal("Missing argument for -r");
+            else reconnects = stoi(argv[++i]);
+        }
+        else if (arg == "-g") {
+            if (i + 1 >= argc) fatal("Missing argument for -g");
+            else bot_grace = stoi(argv[++i]) * 1000;
+        }
+        else if (arg == "-S") {
+            if (i + 1 >= argc) fatal("Missing argument for -S");
+            else seed = stoull(argv[++i]);
+        }
+        else if (arg == "-e") {
+            if (i + 1 >= argc) fatal("Missing argument for -e");
+            else clock_start = stoll(argv[++i]);
+        }
+        else if (arg == "-b") binary = true;
+        else {
+            fatal("Usage: %s -f file [-n seats] [-H hours] [-t timeout] [-m think_ms] [-s stall_percent] "
+                  "[-l latency_ms] [-q quantum_ms] [-c reset_minutes] [-r reconnects] [-g bot_grace] [-S seed] [-e start_ms] [-b]",
+                  argv[0]);
+        }
+    }
+    if (file == "") fatal("Missing file name");
+    if (seats <= 0 || hours <= 0 || timeout <= 0 || think < 0 || latency < 0 || quantum <= 0 || reset_minutes < 0
+        || reconnects < 0 || clock_start < 0) {
+        fatal("Incorrect arguments");
+    }
+    srandom(seed);
+    //Transcripts of thousands of seats are formatted but go nowhere
+    cout.setstate(ios::badbit);
+
+    //Stalls run up to three timeouts, so some players are waited for more than once
+    //A clock started past 2^31 ms, some 25 days of uptime, catches code keeping only its low 32 bits
+    VirtualNet net(quantum, latency, think, stall_percent, 3 * timeout * 1000, seed, clock_start);
+    Game game(net, SERVER_PORT, "", "", file, false, timeout * 1000, true, bot_grace, 0, -1);
+    net.spawn([&game] { game.run(); }, GAME_STACK);
+
+    SeatTotals totals;
+    ServerAddress address = {"::1", "", SERVER_PORT, false, true};
+    for (int seat = 0; seat < seats; seat++) {
+        net.spawn([&net, &totals, address, reconnects, binary, think] {
+            //Players arrive over the first minute, a new one takes the chair a while after a game
+            net.sleep(net.random() % 60000);
+            while (true) {
+                ServerInfo server_info = connect_server(net, address);
+                if (server_info.socket_fd == -1) syserr("connect");
+                Client client(net, server_info, get_client_info(net, server_info.socket_fd), true, '*', binary);
+                client.set_reconnect(address, reconnects, 0);
+                if (client.run()) totals.abandoned++;
+                else totals.games++;
+                totals.recovery.drops += client.recovery.drops;
+                totals.recovery.recovered += client.recovery.recovered;
+                totals.recovery.recovery_total += client.recovery.recovery_total;
+                totals.recovery.recovery_max = max(totals.recovery.recovery_max, client.recovery.recovery_max);
+                net.sleep(net.random() % (20 * max(think, 1000)));
+            }
+        }, SEAT_STACK);
+    }
+    if (reset_minutes > 0) {
+        net.spawn([&net, seats, reset_minutes] {
+            //Resets of the whole population come as one Poisson process
+            double mean = reset_minutes * 60000.0 / seats;
+            while (true) {
+                net.sleep(exponential_distribution<double>(1.0 / mean)(net.random) + 1);
+                net.reset_connection();
+            }
+        }, SEAT_STACK);
+    }
+
+    int64_t duration = hours * 3600 * 1000;
+    int64_t start = now_ms();
+    net.run(net.now() + duration);
+    int64_t elapsed = max(now_ms() - start, (int64_t)1);
+    game.print_stats();
+    printf("seats %d virtual_s %lld wall_ms %lld speedup %.0f connections %lld resets %lld\n", seats,
+           (long long)duration / 1000, (long long)elapsed, (double)duration / elapsed, (long long)net.connections,
+           (long long)net.resets);
+    printf("games %lld abandoned %lld drops %d recovered %d", (long long)totals.games, (long long)totals.abandoned,
+           totals.recovery.drops, totals.recovery.recovered);
+    if (totals.recovery.recovered > 0) {
+        printf(" recovery_mean_ms %lld recovery_max_ms %lld",
+               (long long)(totals.recovery.recovery_total / totals.recovery.recovered),
+               (long long)totals.recovery.recovery_max);
+    }
+    printf("\n");
+    return 0;
+}
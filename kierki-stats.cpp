@@ -0,0 +1,555 @@
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "err.h"
+#include "protocol.h"
+#include "deals.h"
+#include "batch.h"
+
+// Inputs are cut into chunks of about CHUNK_SIZE bytes, which the threads
+// take one after another. Played deals go to the batch engine STATS_BATCH
+// at a time.
+#define CHUNK_SIZE   (4 << 20)
+#define STATS_BATCH  4096
+
+using namespace std;
+
+static int64_t now_ns() {
+    auto now = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
+}
+
+// Aggregates of a part of the input, parts are added up in any order.
+// Types are indexed from 1, cards by card_id.
+struct Stats {
+    int64_t deals = 0;
+    int64_t malformed = 0;
+    // Scores of a transcript without the deal they end.
+    int64_t unmatched = 0;
+    int64_t types[8] = {};
+    int64_t leaders[4] = {};
+    // [seat][suit][length]
+    int64_t lengths[4][4][14] = {};
+    // [card][seat]
+    int64_t holders[52][4] = {};
+    // Hands with a score, [type][seat].
+    int64_t hands[8][4] = {};
+    int64_t points[8][4] = {};
+    int64_t squares[8][4] = {};
+    int64_t highest[8][4] = {};
+    // Points of the seat holding the card, [type][card].
+    int64_t card_hands[8][52] = {};
+    int64_t card_points[8][52] = {};
+
+    void deal(int type, int leader) {
+        this->deals++;
+        this->types[type]++;
+        this->leaders[leader]++;
+    }
+
+    void hand(int seat, uint64_t mask) {
+        for (int suit = 0; suit < 4; suit++) {
+            this->lengths[seat][suit][__builtin_popcountll((mask >> (suit * 13)) & 0x1fff)]++;
+        }
+        for (uint64_t rest = mask; rest != 0; rest &= rest - 1) this->holders[__builtin_ctzll(rest)][seat]++;
+    }
+
+    void score(int type, int seat, uint64_t mask, int points) {
+        this->hands[type][seat]++;
+        this->points[type][seat] += points;
+        this->squares[type][seat] += (int64_t)points * points;
+        this->highest[type][seat] = max(this->highest[type][seat], (int64_t)points);
+        for (uint64_t rest = mask; rest != 0; rest &= rest - 1) {
+            int card = __builtin_ctzll(rest);
+            this->card_hands[type][card]++;
+            this->card_points[type][card] += points;
+        }
+    }
+
+    void add(const Stats &other) {
+        this->deals += other.deals;
+        this->malformed += other.malformed;
+        this->unmatched += other.unmatched;
+        for (int seat = 0; seat < 4; seat++) {
+            this->leaders[seat] += other.leaders[seat];
+            for (int suit = 0; suit < 4; suit++) {
+                for (int length = 0; length < 14; length++) {
+                    this->lengths[seat][suit][length] += other.lengths[seat][suit][length];
+                }
+            }
+            for (int card = 0; card < 52; card++) this->holders[card][seat] += other.holders[card][seat];
+        }
+        for (int type = 1; type < 8; type++) {
+            this->types[type] += other.types[type];
+            for (int seat = 0; seat < 4; seat++) {
+                this->hands[type][seat] += other.hands[type][seat];
+                this->points[type][seat] += other.points[type][seat];
+                this->squares[type][seat] += other.squares[type][seat];
+                this->highest[type][seat] = max(this->highest[type][seat], other.highest[type][seat]);
+            }
+            for (int card = 0; card < 52; card++) {
+                this->card_hands[type][card] += other.card_hands[type][card];
+                this->card_points[type][card] += other.card_points[type][card];
+            }
+        }
+    }
+};
+
+// What a transcript says about one client connection, keyed by its address.
+struct Event {
+    char kind;
+    int8_t seat;
+    int8_t type;
+    int8_t leader;
+    uint64_t hand;
+    int scores[4];
+};
+
+// A hand is scored when SCORE follows DEAL on a connection whose seat is
+// known, from IAM or SEAT. A chunk cannot tell what came before it, so
+// the events of a connection are kept aside until the chunk has seen its
+// seat and its deal; they are replayed, chunk by chunk in file order, on
+// the state the connection had at the end of the previous chunks.
+struct Connection {
+    int seat = -1;
+    bool pending = false;
+    int type = 0;
+    int leader = 0;
+    uint64_t hand = 0;
+    bool known_seat = false;
+    bool known_deal = false;
+    vector<Event> prefix;
+
+    bool known() const { return this->known_seat && this->known_deal; }
+
+    void apply(const Event &event, Stats &stats) {
+        switch (event.kind) {
+            case 'I':
+                this->seat = event.seat;
+                this->pending = false;
+                this->known_seat = true;
+                this->known_deal = true;
+                break;
+            case 'S':
+                this->seat = event.seat;
+                this->known_seat = true;
+                break;
+            case 'D':
+                this->type = event.type;
+                this->leader = event.leader;
+                this->hand = event.hand;
+                this->pending = true;
+                this->known_deal = true;
+                break;
+            case 'P':
+                if (!this->pending || this->seat == -1) {
+                    stats.unmatched++;
+                }
+                else {
+                    //Every deal is counted once, on the hand of N
+                    if (this->seat == 0) stats.deal(this->type, this->leader);
+                    stats.hand(this->seat, this->hand);
+                    stats.score(this->type, this->seat, this->hand, event.scores[this->seat]);
+                }
+                this->pending = false;
+                this->known_deal = true;
+                break;
+        }
+    }
+};
+
+struct KeyHash {
+    using is_transparent = void;
+    size_t operator()(string_view key) const { return hash<string_view>()(key); }
+};
+
+using Connections = unordered_map<string, Connection, KeyHash, equal_to<>>;
+
+struct Chunk {
+    const char *begin;
+    const char *end;
+    bool transcript;
+    // Connections of a transcript chunk, for the replay.
+    Connections connections;
+};
+
+// Next line of [p, end) without its line ending, p moves past it.
+static string_view next_line(const char *&p, const char *end) {
+    const char *newline = (const char *)memchr(p, '\n', end - p);
+    const char *line_end = newline == nullptr ? end : newline;
+    string_view line(p, line_end - p);
+    p = newline == nullptr ? end : newline + 1;
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    return line;
+}
+
+static bool is_deal_header(string_view line) {
+    return line.size() == 2 && line[0] >= '1' && line[0] <= '7' && place_number(line[1]) != -1;
+}
+
+// Mask of a hand of 13 distinct cards, 0 when it is not one.
+static uint64_t hand_mask(const vector<Card> &cards) {
+    if (cards.size() != 13) return 0;
+    for (const Card &card : cards) {
+        if (!is_color(card.color) || card.value < 2 || card.value > 14) return 0;
+    }
+    uint64_t mask = cards_to_mask(cards);
+    return __builtin_popcountll(mask) == 13 ? mask : 0;
+}
+
+static bool parse_scores(string_view text, int scores[4]) {
+    const char *p = text.data() + 5;
+    const char *end = text.data() + text.size();
+    for (int i = 0; i < 4; i++) {
+        if (p == end) return false;
+        int seat = place_number(*p++);
+        if (seat == -1) return false;
+        auto result = from_chars(p, end, scores[seat]);
+        if (result.ec != errc() || result.ptr == p) return false;
+        p = result.ptr;
+    }
+    return p == end;
+}
+
+static void play_batch(vector<Round> &batch, int count, Stats &stats) {
+    batch.resize(count);
+    BatchEngine engine(batch, "");
+    engine.play();
+    for (int game = 0; game < count; game++) {
+        const Round &deal = batch[game];
+        for (int seat = 0; seat < 4; seat++) {
+            stats.score(deal.type, seat, deal.player_hands[seat], engine.points(game, seat));
+        }
+    }
+}
+
+static void scan_deals(const Chunk &chunk, bool play, vector<Round> &batch, Stats &stats) {
+    int count = 0;
+    const char *p = chunk.begin;
+    while (p < chunk.end) {
+        string_view header = next_line(p, chunk.end);
+        if (!is_deal_header(header)) {
+            if (!header.empty()) stats.malformed++;
+            continue;
+        }
+        if (count == (int)batch.size()) batch.emplace_back();
+        Round &deal = batch[count];
+        deal.type = header[0] - '0';
+        deal.starting_player = header[1];
+        uint64_t deck = 0;
+        for (int seat = 0; seat < 4; seat++) {
+            string_to_card_vector(next_line(p, chunk.end), deal.player_cards[seat]);
+            deal.player_hands[seat] = hand_mask(deal.player_cards[seat]);
+            deck |= deal.player_hands[seat];
+        }
+        if (deck != (1ULL << 52) - 1) {
+            stats.malformed++;
+            continue;
+        }
+        stats.deal(deal.type, place_number(deal.starting_player));
+        for (int seat = 0; seat < 4; seat++) stats.hand(seat, deal.player_hands[seat]);
+        if (!play) continue;
+        if (++count == STATS_BATCH) {
+            play_batch(batch, count, stats);
+            count = 0;
+        }
+    }
+    if (count > 0) play_batch(batch, count, stats);
+}
+
+// Splits a line "[from,to,timestamp] message" of a transcript.
+static bool split_log_line(string_view line, string_view &from, string_view &to, string_view &message) {
+    if (line.empty() || line[0] != '[') return false;
+    size_t first = line.find(',');
+    if (first == string_view::npos) return false;
+    size_t second = line.find(',', first + 1);
+    size_t close = line.find("] ", first);
+    if (second == string_view::npos || close == string_view::npos || second > close) return false;
+    from = line.substr(1, first - 1);
+    to = line.substr(first + 1, second - first - 1);
+    message = line.substr(close + 2);
+    return true;
+}
+
+static void scan_transcript(Chunk &chunk, vector<Card> &cards, Stats &stats) {
+    const char *p = chunk.begin;
+    while (p < chunk.end) {
+        string_view from, to, message;
+        if (!split_log_line(next_line(p, chunk.end), from, to, message)) continue;
+        Event event = {};
+        string_view client = to;
+        if (message.starts_with("IAM") && message.size() >= 4) {
+            event.kind = 'I';
+            event.seat = place_number(message[3]);
+            client = from;
+        }
+        else if (message.starts_with("SEAT") && message.size() >= 5) {
+            event.kind = 'S';
+            event.seat = place_number(message[4]);
+            if (event.seat == -1) {
+                stats.malformed++;
+                continue;
+            }
+        }
+        else if (message.starts_with("DEAL")) {
+            event.kind = 'D';
+            if (message.size() < 6 || !is_deal_header(message.substr(4, 2))) {
+                stats.malformed++;
+                continue;
+            }
+            event.type = message[4] - '0';
+            event.leader = place_number(message[5]);
+            string_to_card_vector(message.substr(6), cards);
+            event.hand = hand_mask(cards);
+            if (event.hand == 0) {
+                stats.malformed++;
+                continue;
+            }
+        }
+        else if (message.starts_with("SCORE")) {
+            event.kind = 'P';
+            if (!parse_scores(message, event.scores)) {
+                stats.malformed++;
+                continue;
+            }
+        }
+        else continue;
+        auto found = chunk.connections.find(client);
+        if (found == chunk.connections.end()) found = chunk.connections.emplace(string(client), Connection()).first;
+        Connection &connection = found->second;
+        if (connection.known()) {
+            connection.apply(event, stats);
+            continue;
+        }
+        //Only the state is followed until it no longer depends on earlier chunks
+        connection.prefix.push_back(event);
+        Stats ignored;
+        connection.apply(event, ignored);
+    }
+}
+
+static void replay(vector<Chunk> &chunks, Stats &stats) {
+    Connections state;
+    for (Chunk &chunk : chunks) {
+        if (!chunk.transcript) continue;
+        for (auto &[key, connection] : chunk.connections) {
+            Connection &current = state[key];
+            current.prefix.clear();
+            for (const Event &event : connection.prefix) current.apply(event, stats);
+            if (connection.known()) {
+                connection.prefix.clear();
+                current = move(connection);
+            }
+        }
+        chunk.connections.clear();
+    }
+}
+
+static void map_file(const string &file, bool transcript, vector<Chunk> &chunks, vector<pair<void *, size_t>> &maps) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd == -1) fatal("Cannot open file %s", file.c_str());
+    struct stat status;
+    if (fstat(fd, &status) < 0) syserr("fstat");
+    if (!S_ISREG(status.st_mode)) fatal("%s is not a regular file", file.c_str());
+    size_t size = status.st_size;
+    if (size == 0) {
+        close(fd);
+        return;
+    }
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) syserr("mmap");
+    close(fd);
+    madvise(data, size, MADV_SEQUENTIAL);
+    maps.emplace_back(data, size);
+    const char *begin = (const char *)data;
+    const char *end = begin + size;
+    //A chunk starts at a line, the one of a deal header for a deal file
+    const char *start = begin;
+    while (start < end) {
+        const char *p = start + min((size_t)CHUNK_SIZE, (size_t)(end - start));
+        if (p < end) {
+            const char *newline = (const char *)memchr(p, '\n', end - p);
+            p = newline == nullptr ? end : newline + 1;
+        }
+        while (!transcript && p < end) {
+            const char *line = p;
+            if (is_deal_header(next_line(p, end))) {
+                p = line;
+                break;
+            }
+        }
+        chunks.push_back({start, p, transcript, {}});
+        start = p;
+    }
+}
+
+static void print_points(const Stats &stats) {
+    for (int type = 1; type < 8; type++) {
+        int64_t hands = 0;
+        for (int seat = 0; seat < 4; seat++) hands += stats.hands[type][seat];
+        if (hands == 0) continue;
+        printf("points type %d hands %lld", type, (long long)hands);
+        for (int seat = 0; seat < 4; seat++) {
+            int64_t n = stats.hands[type][seat];
+            if (n == 0) {
+                printf(" %c -", "NESW"[seat]);
+                continue;
+            }
+            double mean = (double)stats.points[type][seat] / n;
+            double deviation = sqrt(max(0.0, (double)stats.squares[type][seat] / n - mean * mean));
+            printf(" %c mean %.3f sd %.3f max %lld", "NESW"[seat], mean, deviation,
+                   (long long)stats.highest[type][seat]);
+        }
+        printf("\n");
+    }
+}
+
+static double log_choose(int n, int k) {
+    return lgamma(n + 1) - lgamma(k + 1) - lgamma(n - k + 1);
+}
+
+static void print_deals(const Stats &stats) {
+    printf("types");
+    for (int type = 1; type < 8; type++) printf(" %d %.4f", type, (double)stats.types[type] / stats.deals);
+    printf("\nleaders");
+    for (int seat = 0; seat < 4; seat++) printf(" %c %.4f", "NESW"[seat], (double)stats.leaders[seat] / stats.deals);
+    printf("\n");
+    int64_t all_lengths[14] = {};
+    int64_t suits = 0;
+    for (int seat = 0; seat < 4; seat++) {
+        int64_t seat_hands = 0;
+        for (int length = 0; length < 14; length++) seat_hands += stats.lengths[seat][0][length];
+        if (seat_hands == 0) continue;
+        printf("seat %c hands %lld suits", "NESW"[seat], (long long)seat_hands);
+        int64_t voids = 0;
+        for (int suit = 0; suit < 4; suit++) {
+            int64_t cards = 0;
+            for (int length = 0; length < 14; length++) {
+                cards += stats.lengths[seat][suit][length] * length;
+                all_lengths[length] += stats.lengths[seat][suit][length];
+            }
+            voids += stats.lengths[seat][suit][0];
+            suits += seat_hands;
+            printf(" %c %.4f", "CDHS"[suit], (double)cards / seat_hands);
+        }
+        printf(" voids %.4f\n", (double)voids / seat_hands);
+    }
+    //Suit lengths of a fair deal are hypergeometric, 13 cards out of 52 with 13 of the suit
+    for (int length = 0; length < 14; length++) {
+        if (all_lengths[length] == 0 && length > 8) continue;
+        double expected = exp(log_choose(13, length) + log_choose(39, 13 - length) - log_choose(52, 13));
+        printf("length %d observed %.5f expected %.5f\n", length, (double)all_lengths[length] / suits, expected);
+    }
+    //Every card should be as likely at every seat
+    double chi2 = 0;
+    for (int card = 0; card < 52; card++) {
+        int64_t total = 0;
+        for (int seat = 0; seat < 4; seat++) total += stats.holders[card][seat];
+        if (total == 0) continue;
+        for (int seat = 0; seat < 4; seat++) {
+            double difference = stats.holders[card][seat] - total / 4.0;
+            chi2 += difference * difference / (total / 4.0);
+        }
+    }
+    printf("holders chi2 %.1f dof 156\n", chi2);
+}
+
+// A line per card: how often every seat holds it and, per type, the mean points of the seat holding it.
+static void print_cards(const Stats &stats) {
+    bool scored = false;
+    for (int type = 1; type < 8; type++) scored |= stats.card_hands[type][0] != 0;
+    for (int card = 0; card < 52; card++) {
+        printf("card %s held", card_to_string(id_to_card(card)).c_str());
+        int64_t total = 0;
+        for (int seat = 0; seat < 4; seat++) total += stats.holders[card][seat];
+        for (int seat = 0; seat < 4; seat++) {
+            printf(" %c %.4f", "NESW"[seat], total == 0 ? 0.0 : (double)stats.holders[card][seat] / total);
+        }
+        if (scored) {
+            printf(" cost");
+            for (int type = 1; type < 8; type++) {
+                if (stats.card_hands[type][card] == 0) printf(" %d:-", type);
+                else printf(" %d:%.3f", type, (double)stats.card_points[type][card] / stats.card_hands[type][card]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    vector<string> deal_files;
+    vector<string> transcripts;
+    bool play = false;
+    int threads = thread::hardware_concurrency();
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-f") {
+            if (i + 1 >= argc) fatal("Missing argument for -f");
+            else deal_files.push_back(argv[++i]);
+        }
+        else if (arg == "-l") {
+            if (i + 1 >= argc) fatal("Missing argument for -l");
+            else transcripts.push_back(argv[++i]);
+        }
+        else if (arg == "-j") {
+            if (i + 1 >= argc) fatal("Missing argument for -j");
+            else threads = stoi(argv[++i]);
+        }
+        else if (arg == "-p") play = true;
+        else fatal("Usage: %s [-f deal file]... [-l transcript]... [-p] [-j threads]", argv[0]);
+    }
+    if (deal_files.empty() && transcripts.empty()) fatal("Missing file name");
+    if (threads <= 0) threads = 1;
+
+    int64_t start = now_ns();
+    vector<Chunk> chunks;
+    vector<pair<void *, size_t>> maps;
+    size_t bytes = 0;
+    for (const string &file : deal_files) map_file(file, false, chunks, maps);
+    for (const string &file : transcripts) map_file(file, true, chunks, maps);
+    for (auto &map : maps) bytes += map.second;
+
+    threads = min(threads, max((int)chunks.size(), 1));
+    vector<Stats> partial(threads);
+    atomic<size_t> next_chunk = 0;
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            vector<Round> batch;
+            vector<Card> cards;
+            for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+                if (chunks[i].transcript) scan_transcript(chunks[i], cards, partial[t]);
+                else scan_deals(chunks[i], play, batch, partial[t]);
+            }
+        });
+    }
+    for (thread &worker : workers) worker.join();
+    Stats stats;
+    for (const Stats &part : partial) stats.add(part);
+    replay(chunks, stats);
+    int64_t elapsed = now_ns() - start;
+    for (auto &map : maps) munmap(map.first, map.second);
+
+    printf("deals %lld malformed %lld unmatched %lld\n", (long long)stats.deals, (long long)stats.malformed,
+           (long long)stats.unmatched);
+    if (stats.deals > 0) print_deals(stats);
+    print_points(stats);
+    print_cards(stats);
+    printf("threads %d chunks %zu bytes %zu ms %.1f deals_per_second %.0f\n", threads, chunks.size(), bytes,
+           elapsed / 1e6, stats.deals * 1e9 / elapsed);
+    return 0;
+}
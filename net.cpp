@@ -0,0 +1,77 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "common.h"
+#include "err.h"
+#include "net.h"
+#include "tuning.h"
+
+class SystemNet : public Net {
+public:
+    int64_t now() override {
+        return monotonic_ms();
+    }
+
+    int poll(pollfd *fds, nfds_t count, int timeout) override {
+        return spin_poll(fds, count, timeout);
+    }
+
+    ssize_t read(int fd, void *buffer, size_t size) override {
+        return ::read(fd, buffer, size);
+    }
+
+    ssize_t write(int fd, const void *buffer, size_t size) override {
+        return ::write(fd, buffer, size);
+    }
+
+    void close(int fd) override {
+        ::close(fd);
+    }
+
+    void sleep(int milliseconds) override {
+        usleep(milliseconds * 1000);
+    }
+
+    int listen(const sockaddr *address, socklen_t length, int backlog) override {
+        int socket_fd = socket(address->sa_family, SOCK_STREAM, 0);
+        if (socket_fd < 0) syserr("cannot create a socket");
+        if (bind(socket_fd, address, length) < 0) syserr("bind");
+        if (::listen(socket_fd, backlog) < 0) syserr("listen");
+        fcntl(socket_fd, F_SETFL, O_NONBLOCK);
+        return socket_fd;
+    }
+
+    int accept(int listener, sockaddr_storage &address) override {
+        socklen_t length = sizeof address;
+        int fd = ::accept(listener, (struct sockaddr *) &address, &length);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            tune_socket(fd);
+        }
+        return fd;
+    }
+
+    int connect(const sockaddr *address, socklen_t length) override {
+        int socket_fd = socket(address->sa_family, SOCK_STREAM, 0);
+        if (socket_fd < 0) syserr("socket");
+        if (::connect(socket_fd, address, length) < 0) {
+            ::close(socket_fd);
+            return -1;
+        }
+        fcntl(socket_fd, F_SETFL, O_NONBLOCK);
+        tune_socket(socket_fd);
+        return socket_fd;
+    }
+
+    void local_address(int fd, sockaddr_storage &address) override {
+        socklen_t length = sizeof address;
+        if (getsockname(fd, (struct sockaddr *) &address, &length) < 0) syserr("getsockname");
+    }
+};
+
+Net &system_net() {
+    static SystemNet net;
+    return net;
+}
@@ -0,0 +1,34 @@
+#include <cstdint>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <poll.h>
+
+#ifndef MIM_NET_H
+#define MIM_NET_H
+
+// The clock and the socket calls under the game and client loops. The
+// system one makes the calls, a test harness gives the loops a network
+// kept in memory and a clock that jumps to the next thing to happen.
+// Errors come back as from the calls themselves, -1 with errno set.
+class Net {
+public:
+    virtual ~Net() = default;
+    // Milliseconds of a monotonic clock.
+    virtual int64_t now() = 0;
+    virtual int poll(pollfd *fds, nfds_t count, int timeout) = 0;
+    virtual ssize_t read(int fd, void *buffer, size_t size) = 0;
+    virtual ssize_t write(int fd, const void *buffer, size_t size) = 0;
+    virtual void close(int fd) = 0;
+    virtual void sleep(int milliseconds) = 0;
+    // Sockets come back non-blocking.
+    virtual int listen(const sockaddr *address, socklen_t length, int backlog) = 0;
+    virtual int accept(int listener, sockaddr_storage &address) = 0;
+    // Blocks until connected, -1 when the server cannot be reached.
+    virtual int connect(const sockaddr *address, socklen_t length) = 0;
+    virtual void local_address(int fd, sockaddr_storage &address) = 0;
+};
+
+Net &system_net();
+
+#endif
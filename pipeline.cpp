@@ -0,0 +1,348 @@
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "err.h"
+#include "pipeline.h"
+#include "tuning.h"
+
+#define IO_BUFFER_SIZE 4096
+
+using namespace std;
+
+IoThread::IoThread(const vector<pollfd> &listeners, const vector<string> &ips, const vector<uint16_t> &ports, int timeout) {
+    this->logic_event = eventfd(0, EFD_NONBLOCK);
+    this->io_event = eventfd(0, EFD_NONBLOCK);
+    if (this->logic_event < 0 || this->io_event < 0) syserr("eventfd");
+    this->timeout = timeout;
+    this->first_client = listeners.size();
+    this->slots.resize(this->first_client);
+    for (int i = 0; i < this->first_client; i++) {
+        this->slots[i].fd = listeners[i].fd;
+        this->slots[i].ip = ips[i];
+        this->slots[i].port = ports[i];
+        this->slots[i].used = true;
+    }
+}
+
+IoThread::~IoThread() {
+    close(this->logic_event);
+    close(this->io_event);
+}
+
+void IoThread::start() {
+    this->thread = std::thread(&IoThread::run, this);
+}
+
+void IoThread::join() {
+    PipeEvent event = {};
+    event.kind = PIPE_SHUTDOWN;
+    this->send(event);
+    while (!this->overflow.empty()) {
+        this->flush();
+        sched_yield();
+    }
+    this->flush();
+    this->thread.join();
+}
+
+void IoThread::clear_logic_fd() {
+    uint64_t count;
+    while (read(this->logic_event, &count, sizeof count) > 0) {}
+}
+
+void IoThread::send(const PipeEvent &event) {
+    if (!this->overflow.empty() || !this->to_io.push(event)) this->overflow.push_back(event);
+}
+
+void IoThread::flush() {
+    size_t sent = 0;
+    while (sent < this->overflow.size() && this->to_io.push(this->overflow[sent])) sent++;
+    this->overflow.erase(this->overflow.begin(), this->overflow.begin() + sent);
+    uint64_t one = 1;
+    if (write(this->io_event, &one, sizeof one) < 0 && errno != EAGAIN) syserr("write");
+}
+
+void IoThread::push(PipeEvent &event) {
+    //Nobody reads the ring once the logic thread is waiting for us to finish
+    if (this->shutting_down) return;
+    //The logic thread never blocks on us, so waiting for it to drain cannot deadlock
+    while (!this->to_logic.push(event)) {
+        uint64_t one = 1;
+        if (write(this->logic_event, &one, sizeof one) < 0 && errno != EAGAIN) syserr("write");
+        sched_yield();
+    }
+    this->pushed = true;
+}
+
+void IoThread::log_line(int from, int to, string_view message) {
+    append_log_line(this->log, this->slots[from].ip, this->slots[from].port, this->slots[to].ip, this->slots[to].port, message);
+}
+
+void IoThread::run() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    pin_thread(1);
+    //A slow reader of the transcript must not hold up the sockets, it gets its own buffer
+    int stdout_flags = fcntl(STDOUT_FILENO, F_GETFL);
+    fcntl(STDOUT_FILENO, F_SETFL, stdout_flags | O_NONBLOCK);
+
+    while (true) {
+        //Rebuild the poll set, owners maps entries back to slots
+        this->pollfds.clear();
+        this->owners.clear();
+        this->pollfds.push_back({this->io_event, POLLIN, 0});
+        this->owners.push_back(-1);
+        if (this->log_offset < this->log.size()) {
+            this->pollfds.push_back({STDOUT_FILENO, POLLOUT, 0});
+            this->owners.push_back(-1);
+        }
+        bool pending = false;
+        for (int i = 0; i < (int)this->slots.size(); i++) {
+            IoSlot &slot = this->slots[i];
+            if (!slot.used || slot.fd == -1) continue;
+            short events = POLLIN;
+            if (i < this->first_client && this->shutting_down) continue;
+            if (i >= this->first_client && slot.write_offset < slot.write_buffer.size()) {
+                events |= POLLOUT;
+                pending = true;
+            }
+            if (this->shutting_down) events &= ~POLLIN;
+            if (events == 0) continue;
+            this->pollfds.push_back({slot.fd, events, 0});
+            this->owners.push_back(i);
+        }
+        int wait = -1;
+        if (this->shutting_down) {
+            int64_t now = monotonic_ms();
+            if (!pending || now >= this->shutdown_deadline) break;
+            wait = this->shutdown_deadline - now;
+        }
+        int poll_status = spin_poll(this->pollfds.data(), this->pollfds.size(), wait);
+        if (poll_status < 0 && errno != EINTR) syserr("poll");
+        if (this->pollfds[0].revents & POLLIN) {
+            uint64_t count;
+            while (read(this->io_event, &count, sizeof count) > 0) {}
+        }
+        PipeEvent event;
+        while (this->to_io.pop(event)) this->handle_command(event);
+        for (int k = 1; k < (int)this->pollfds.size(); k++) {
+            int i = this->owners[k];
+            if (i == -1) continue;
+            short revents = this->pollfds[k].revents;
+            if (revents == 0 || this->slots[i].fd != this->pollfds[k].fd) continue;
+            if (i < this->first_client) {
+                if (revents & POLLIN) this->accept_client(i);
+                continue;
+            }
+            if (revents & POLLOUT) this->write_client(i);
+            if (this->slots[i].fd == -1) continue;
+            if (revents & POLLIN) this->read_client(i);
+            else if (revents & (POLLERR | POLLHUP | POLLNVAL)) this->close_client(i);
+        }
+        this->write_log();
+        if (this->pushed) {
+            this->pushed = false;
+            uint64_t one = 1;
+            if (write(this->logic_event, &one, sizeof one) < 0 && errno != EAGAIN) syserr("write");
+        }
+    }
+    for (IoSlot &slot : this->slots) {
+        if (slot.fd != -1) close(slot.fd);
+    }
+    fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
+    this->write_log();
+}
+
+void IoThread::write_log() {
+    while (this->log_offset < this->log.size()) {
+        ssize_t length = write(STDOUT_FILENO, this->log.data() + this->log_offset, this->log.size() - this->log_offset);
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+            //Nobody reads the transcript any more
+            this->log_offset = this->log.size();
+            break;
+        }
+        this->log_offset += length;
+    }
+    this->log.clear();
+    this->log_offset = 0;
+}
+
+void IoThread::handle_command(const PipeEvent &event) {
+    if (event.kind == PIPE_SHUTDOWN) {
+        this->shutting_down = true;
+        this->shutdown_deadline = monotonic_ms() + this->timeout;
+        return;
+    }
+    IoSlot &slot = this->slots[event.slot];
+    if (event.kind == PIPE_SEND) {
+        if (slot.fd != -1) slot.write_buffer.append(event.data, event.wire);
+        string_view text(event.data + event.wire, event.length - event.wire);
+        //Parts of one message come one after another, it is logged as a whole
+        if (event.more || !this->long_message.empty()) {
+            this->long_message.append(text);
+            if (event.more) return;
+            this->log_line(slot.server, event.slot, this->long_message);
+            this->long_message.clear();
+        }
+        else this->log_line(slot.server, event.slot, text);
+    }
+    else if (event.kind == PIPE_CLOSE) {
+        //The logic thread is done with the slot, only now it can be reused
+        if (slot.fd != -1) close(slot.fd);
+        slot = IoSlot();
+        this->free_slots.push_back(event.slot);
+    }
+}
+
+void IoThread::accept_client(int listener) {
+    sockaddr_storage client_address;
+    socklen_t client_address_len = sizeof client_address;
+    int client_fd = accept(this->slots[listener].fd, (struct sockaddr *) &client_address, &client_address_len);
+    if (client_fd < 0) return;
+    fcntl(client_fd, F_SETFL, O_NONBLOCK);
+    tune_socket(client_fd);
+    int id;
+    if (this->free_slots.empty()) {
+        id = this->slots.size();
+        this->slots.emplace_back();
+    }
+    else {
+        id = this->free_slots.back();
+        this->free_slots.pop_back();
+    }
+    IoSlot &slot = this->slots[id];
+    in6_addr raw_address = {};
+    if (client_address.ss_family == AF_INET6) {
+        sockaddr_in6 *address = (sockaddr_in6 *) &client_address;
+        char buffer[INET6_ADDRSTRLEN];
+        if (inet_ntop(AF_INET6, &address->sin6_addr, buffer, INET6_ADDRSTRLEN) == nullptr) {
+            syserr("inet_ntop");
+        }
+        slot.ip = buffer;
+        slot.port = ntohs(address->sin6_port);
+        raw_address = address->sin6_addr;
+    }
+    else {
+        slot.ip = this->slots[listener].ip;
+        slot.port = ++this->unix_connections;
+    }
+    slot.fd = client_fd;
+    slot.server = listener;
+    slot.used = true;
+    PipeEvent event = {};
+    event.kind = PIPE_CONNECT;
+    event.slot = id;
+    event.server = listener;
+    event.port = slot.port;
+    //The logic thread keeps the address raw and formats it itself
+    event.length = sizeof raw_address;
+    memcpy(event.data, &raw_address, sizeof raw_address);
+    this->push(event);
+}
+
+void IoThread::read_client(int id) {
+    IoSlot &slot = this->slots[id];
+    char buffer[IO_BUFFER_SIZE];
+    ssize_t length = read(slot.fd, buffer, sizeof buffer);
+    if (length < 0) return;
+    if (length == 0) {
+        this->close_client(id);
+        return;
+    }
+    slot.read_buffer.append(buffer, length);
+    string message;
+    //Messages are taken from start on and erased once, every byte is looked at once
+    size_t start = 0;
+    while (true) {
+        string_view rest = string_view(slot.read_buffer).substr(start);
+        if (slot.binary) {
+            if (rest.empty() || rest.size() < (size_t)(unsigned char)rest[0] + 1) break;
+            size_t frame_length = (unsigned char)rest[0] + 1;
+            message.clear();
+            frame_to_text(rest.substr(0, frame_length), message);
+            start += frame_length;
+        }
+        else {
+            size_t end = rest.substr(0, LINE_LIMIT + 2).find("\r\n", slot.scanned);
+            if (end == string_view::npos) {
+                if (rest.size() < LINE_LIMIT + 2) {
+                    //A CR at the end may be completed by the next read
+                    slot.scanned = rest.empty() ? 0 : rest.size() - 1;
+                    break;
+                }
+                PipeEvent event = {};
+                event.kind = PIPE_LINE_TOO_LONG;
+                event.slot = id;
+                this->push(event);
+                this->close_client(id);
+                return;
+            }
+            message.assign(rest.substr(0, end));
+            start += end + 2;
+            slot.scanned = 0;
+        }
+        if (message.empty()) continue;
+        //Only the greeting can switch a connection to frames, as IAM<place>B with or without a seat token
+        if (!slot.greeted) {
+            slot.greeted = true;
+            uint64_t token;
+            string_view name;
+            slot.binary = parse_iam(message, slot.binary, token, name) && slot.binary;
+        }
+        this->log_line(id, slot.server, message);
+        PipeEvent event = {};
+        event.kind = PIPE_MESSAGE;
+        event.slot = id;
+        //Anything longer is not a valid message, cutting it keeps it invalid
+        event.length = min(message.size(), (size_t)PIPE_DATA);
+        memcpy(event.data, message.data(), event.length);
+        this->push(event);
+        message.clear();
+    }
+    slot.read_buffer.erase(0, start);
+}
+
+void IoThread::write_client(int id) {
+    IoSlot &slot = this->slots[id];
+    ssize_t length = write(slot.fd, slot.write_buffer.data() + slot.write_offset, slot.write_buffer.size() - slot.write_offset);
+    if (length < 0) return;
+    slot.write_offset += length;
+    slot.sent += length;
+    if (slot.write_offset == slot.write_buffer.size()) {
+        slot.write_buffer.clear();
+        slot.write_offset = 0;
+    }
+    PipeEvent event = {};
+    event.kind = PIPE_SENT;
+    event.slot = id;
+    event.sent = slot.sent;
+    this->push(event);
+}
+
+void IoThread::close_client(int id) {
+    IoSlot &slot = this->slots[id];
+    close(slot.fd);
+    slot.fd = -1;
+    slot.write_buffer.clear();
+    slot.write_offset = 0;
+    PipeEvent event = {};
+    event.kind = PIPE_CLOSED;
+    event.slot = id;
+    this->push(event);
+}
@@ -0,0 +1,115 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include <poll.h>
+
+#include "ring.h"
+
+#ifndef MIM_PIPELINE_H
+#define MIM_PIPELINE_H
+
+// Pipelined server mode: an I/O thread owns the sockets, frames input
+// and writes the transcript without blocking, the logic thread owns the
+// game state. They talk only through two SPSC rings and wake each other
+// with eventfds.
+#define PIPE_RING  4096
+#define PIPE_DATA  96
+
+enum PipeKind {
+    //To the logic thread
+    PIPE_CONNECT,
+    PIPE_MESSAGE,
+    PIPE_CLOSED,
+    PIPE_SENT,
+    // The peer sent a line over LINE_LIMIT, PIPE_CLOSED follows.
+    PIPE_LINE_TOO_LONG,
+    //To the I/O thread
+    PIPE_SEND,
+    PIPE_CLOSE,
+    PIPE_SHUTDOWN
+};
+
+struct PipeEvent {
+    int32_t kind;
+    int32_t slot;
+    // CONNECT: listener slot and port, data holds the raw in6_addr.
+    int32_t server;
+    uint16_t port;
+    // SEND: the first wire bytes of data go to the peer, the rest is logged.
+    uint16_t wire;
+    uint16_t length;
+    // SEND: set on every part of a message longer than data but the last.
+    uint16_t more;
+    // SENT: bytes written to the peer so far.
+    int64_t sent;
+    char data[PIPE_DATA];
+};
+
+struct IoSlot {
+    int fd = -1;
+    std::string ip;
+    uint16_t port = 0;
+    int server = 0;
+    std::string read_buffer;
+    // Bytes of read_buffer known to hold no CRLF.
+    size_t scanned = 0;
+    std::string write_buffer;
+    size_t write_offset = 0;
+    int64_t sent = 0;
+    bool greeted = false;
+    bool binary = false;
+    bool used = false;
+};
+
+class IoThread {
+public:
+    // Takes over the listening sockets, slots below first_client.
+    IoThread(const std::vector<pollfd> &listeners, const std::vector<std::string> &ips,
+             const std::vector<uint16_t> &ports, int timeout);
+    ~IoThread();
+    void start();
+    void join();
+    // Logic side: events from the I/O thread and the fd to wait on for them.
+    bool pop(PipeEvent &event) { return this->to_logic.pop(event); }
+    int logic_fd() const { return this->logic_event; }
+    void clear_logic_fd();
+    // Logic side: queued in order, kept aside while the ring is full.
+    void send(const PipeEvent &event);
+    void flush();
+    // Bytes written to a slot, read after join for the final stats.
+    int64_t sent(int slot) const { return slot < (int)this->slots.size() ? this->slots[slot].sent : 0; }
+private:
+    SpscRing<PipeEvent, PIPE_RING> to_logic;
+    SpscRing<PipeEvent, PIPE_RING> to_io;
+    std::vector<PipeEvent> overflow;
+    int logic_event;
+    int io_event;
+    int timeout;
+    int first_client;
+    uint16_t unix_connections = 0;
+    bool pushed = false;
+    bool shutting_down = false;
+    int64_t shutdown_deadline = 0;
+    std::vector<IoSlot> slots;
+    std::vector<int> free_slots;
+    std::vector<pollfd> pollfds;
+    std::vector<int> owners;
+    std::string log;
+    size_t log_offset = 0;
+    // Text of a message sent in parts so far.
+    std::string long_message;
+    std::thread thread;
+    void run();
+    void push(PipeEvent &event);
+    void handle_command(const PipeEvent &event);
+    void accept_client(int listener);
+    void read_client(int id);
+    void write_client(int id);
+    void close_client(int id);
+    void log_line(int from, int to, std::string_view message);
+    void write_log();
+};
+
+#endif
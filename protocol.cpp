@@ -0,0 +1,349 @@
+#include <cctype>
+#include <cstring>
+#include <charconv>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.h"
+#include "protocol.h"
+
+using namespace std;
+
+static const char colors[] = "CDHS";
+static const char places[] = "NESW";
+
+int card_id(Card card) {
+    return (strchr(colors, card.color) - colors) * 13 + card.value - 2;
+}
+
+Card id_to_card(int id) {
+    Card card;
+    card.color = colors[id / 13];
+    card.value = id % 13 + 2;
+    return card;
+}
+
+uint64_t cards_to_mask(const vector<Card> &cards) {
+    uint64_t mask = 0;
+    for (const Card &card : cards) mask |= 1ULL << card_id(card);
+    return mask;
+}
+
+void mask_to_cards(uint64_t mask, vector<Card> &cards) {
+    cards.clear();
+    while (mask != 0) {
+        cards.push_back(id_to_card(__builtin_ctzll(mask)));
+        mask &= mask - 1;
+    }
+}
+
+static int place_index(char place) {
+    return strchr(places, place) - places;
+}
+
+int encode_busy(char *output, const char *busy, int count) {
+    int mask = 0;
+    for (int i = 0; i < count; i++) mask |= 1 << place_index(busy[i]);
+    output[0] = 2;
+    output[1] = MESSAGE_BUSY;
+    output[2] = mask;
+    return 3;
+}
+
+int encode_seat(char *output, char place, uint64_t token) {
+    output[0] = token == 0 ? 2 : 10;
+    output[1] = MESSAGE_SEAT;
+    output[2] = place_index(place);
+    if (token == 0) return 3;
+    for (int i = 0; i < 8; i++) output[3 + i] = token >> (8 * i);
+    return 11;
+}
+
+int encode_deal(char *output, int type, char starting_player, uint64_t hand) {
+    output[0] = 10;
+    output[1] = MESSAGE_DEAL;
+    output[2] = type;
+    output[3] = place_index(starting_player);
+    for (int i = 0; i < 7; i++) output[4 + i] = hand >> (8 * i);
+    return 11;
+}
+
+int encode_trick(char *output, int number, const Card *cards, int count) {
+    output[0] = 2 + count;
+    output[1] = MESSAGE_TRICK;
+    output[2] = number;
+    for (int i = 0; i < count; i++) output[3 + i] = card_id(cards[i]);
+    return 3 + count;
+}
+
+int encode_wrong(char *output, int number) {
+    output[0] = 2;
+    output[1] = MESSAGE_WRONG;
+    output[2] = number;
+    return 3;
+}
+
+int encode_taken(char *output, int number, const Card *cards, char winner) {
+    output[0] = 7;
+    output[1] = MESSAGE_TAKEN;
+    output[2] = number;
+    for (int i = 0; i < 4; i++) output[3 + i] = card_id(cards[i]);
+    output[7] = place_index(winner);
+    return 8;
+}
+
+int encode_scores(char *output, int kind, const int *scores) {
+    output[0] = 17;
+    output[1] = kind;
+    for (int i = 0; i < 4; i++) {
+        uint32_t score = scores[i];
+        for (int j = 0; j < 4; j++) output[2 + 4 * i + j] = score >> (8 * j);
+    }
+    return 18;
+}
+
+bool extract_frame(string &buffer, string &frame) {
+    if (buffer.size() == 0) return false;
+    size_t length = (unsigned char)buffer[0] + 1;
+    if (buffer.size() < length) return false;
+    frame.assign(buffer, 0, length);
+    buffer.erase(0, length);
+    return true;
+}
+
+static bool decode_cards(string_view payload, vector<Card> &cards) {
+    cards.clear();
+    for (unsigned char id : payload) {
+        if (id >= 52) return false;
+        cards.push_back(id_to_card(id));
+    }
+    return true;
+}
+
+bool decode_frame(string_view frame, Message &message) {
+    if (frame.size() < 2) return false;
+    const unsigned char *data = (const unsigned char *)frame.data();
+    size_t size = frame.size();
+    message.kind = data[1];
+    switch (message.kind) {
+        case MESSAGE_BUSY:
+            if (size != 3 || data[2] == 0 || data[2] > 15) return false;
+            message.places.clear();
+            for (int i = 0; i < 4; i++) {
+                if (data[2] & (1 << i)) message.places += places[i];
+            }
+            return true;
+        case MESSAGE_SEAT:
+            if ((size != 3 && size != 11) || data[2] > 3) return false;
+            message.place = places[data[2]];
+            message.token = 0;
+            for (int i = 0; i < 8 && size == 11; i++) message.token |= (uint64_t)data[3 + i] << (8 * i);
+            return true;
+        case MESSAGE_DEAL: {
+            if (size != 11 || data[2] < 1 || data[2] > 7 || data[3] > 3) return false;
+            uint64_t hand = 0;
+            for (int i = 0; i < 7; i++) hand |= (uint64_t)data[4 + i] << (8 * i);
+            if (hand >> 52 != 0 || __builtin_popcountll(hand) != 13) return false;
+            message.type = data[2];
+            message.place = places[data[3]];
+            mask_to_cards(hand, message.cards);
+            return true;
+        }
+        case MESSAGE_TRICK:
+            if (size < 3 || size > 6 || data[2] < 1 || data[2] > 13) return false;
+            message.number = data[2];
+            return decode_cards(frame.substr(3), message.cards);
+        case MESSAGE_WRONG:
+            if (size != 3 || data[2] < 1 || data[2] > 13) return false;
+            message.number = data[2];
+            return true;
+        case MESSAGE_TAKEN:
+            if (size != 8 || data[2] < 1 || data[2] > 13 || data[7] > 3) return false;
+            message.number = data[2];
+            message.place = places[data[7]];
+            return decode_cards(frame.substr(3, 4), message.cards);
+        case MESSAGE_SCORE:
+        case MESSAGE_TOTAL:
+            if (size != 18) return false;
+            for (int i = 0; i < 4; i++) {
+                uint32_t score = 0;
+                for (int j = 0; j < 4; j++) score |= (uint32_t)data[2 + 4 * i + j] << (8 * j);
+                message.scores[i] = score;
+            }
+            return true;
+    }
+    return false;
+}
+
+// Splits the number and cards of a TRICK or TAKEN message without the winner.
+static void parse_trick_or_taken(const string &text, Message &message) {
+    message.cards.clear();
+    if (text.size() == 6) message.number = text[5] - '0';
+    else if (text.size() == 7) message.number = 10 + text[6] - '0';
+    else {
+        if (is_color(text[7])) {
+            message.number = text[5] - '0';
+            message.cards = string_to_card_vector(text.substr(6));
+        }
+        else if (is_color(text[8])) {
+            if (text[7] == '0') {
+                message.number = text[5] - '0';
+                message.cards = string_to_card_vector(text.substr(6));
+            }
+            else {
+                message.number = 10 + text[6] - '0';
+                message.cards = string_to_card_vector(text.substr(7));
+            }
+        }
+        else {
+            message.number = 10 + text[6] - '0';
+            message.cards = string_to_card_vector(text.substr(7));
+        }
+    }
+}
+
+static void parse_scores(const string &text, Message &message) {
+    size_t p = 5;
+    while (p < text.size()) {
+        int place = place_index(text[p++]);
+        int score = 0;
+        while (p < text.size() && text[p] >= '0' && text[p] <= '9') score = score * 10 + text[p++] - '0';
+        message.scores[place] = score;
+    }
+}
+
+bool parse_iam(string_view text, bool &binary, uint64_t &token, string_view &name) {
+    if (text.size() < 4 || !text.starts_with("IAM")) return false;
+    if (place_number(text[3]) == -1 && text[3] != '*') return false;
+    size_t digits = 4;
+    binary = text.size() > 4 && text[4] == 'B';
+    if (binary) digits++;
+    size_t colon = text.find(':', digits);
+    name = colon == string_view::npos ? string_view() : text.substr(colon + 1);
+    if (colon != string_view::npos && !is_player_name(name)) return false;
+    string_view number = text.substr(digits, colon == string_view::npos ? string_view::npos : colon - digits);
+    token = 0;
+    if (number.empty()) return true;
+    if (number.size() > 19) return false;
+    const char *end = number.data() + number.size();
+    auto result = from_chars(number.data(), end, token);
+    return result.ec == errc() && result.ptr == end && token != 0;
+}
+
+bool is_player_name(string_view name) {
+    if (name.empty() || name.size() > NAME_LIMIT) return false;
+    for (char c : name) {
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-' && c != '.') return false;
+    }
+    return true;
+}
+
+bool parse_message(const string &text, Message &message) {
+    static const regex busy("^BUSY[NEWS]{1,4}$");
+    static const regex seat("^SEAT[NESW][0-9]{0,19}$");
+    static const regex deal("^DEAL[1-7][NSWE]((10|[2-9]|[JQKA])[CDSH]){13}$");
+    static const regex taken("^TAKEN(1[0-3]|[1-9])((10|[2-9]|[JQKA])[CDSH]){4}[NSWE]$");
+    static const regex trick("^TRICK(1[0-3]|[1-9])((10|[2-9]|[JQKA])[CDSH]){0,3}$");
+    static const regex wrong("^WRONG(1[0-3]|[1-9])$");
+    static const regex score("^SCORE[NESW][0-9]+[NESW][0-9]+[NESW][0-9]+[NESW][0-9]+$");
+    static const regex total("^TOTAL[NESW][0-9]+[NESW][0-9]+[NESW][0-9]+[NESW][0-9]+$");
+    if (regex_match(text, busy)) {
+        message.kind = MESSAGE_BUSY;
+        message.places = text.substr(4);
+    }
+    else if (regex_match(text, seat)) {
+        message.kind = MESSAGE_SEAT;
+        message.place = text[4];
+        message.token = 0;
+        from_chars(text.data() + 5, text.data() + text.size(), message.token);
+    }
+    else if (regex_match(text, deal)) {
+        message.kind = MESSAGE_DEAL;
+        message.type = text[4] - '0';
+        message.place = text[5];
+        message.cards = string_to_card_vector(text.substr(6));
+    }
+    else if (regex_match(text, taken)) {
+        message.kind = MESSAGE_TAKEN;
+        message.place = text.back();
+        parse_trick_or_taken(text.substr(0, text.size() - 1), message);
+    }
+    else if (regex_match(text, trick)) {
+        message.kind = MESSAGE_TRICK;
+        parse_trick_or_taken(text, message);
+    }
+    else if (regex_match(text, wrong)) {
+        message.kind = MESSAGE_WRONG;
+        message.number = text[5] - '0';
+        if (text.size() == 7) message.number = 10 + text[6] - '0';
+    }
+    else if (regex_match(text, score)) {
+        message.kind = MESSAGE_SCORE;
+        parse_scores(text, message);
+    }
+    else if (regex_match(text, total)) {
+        message.kind = MESSAGE_TOTAL;
+        parse_scores(text, message);
+    }
+    else {
+        message.kind = MESSAGE_NONE;
+        return false;
+    }
+    return true;
+}
+
+static void append_number(string &text, int number) {
+    char buffer[16];
+    text.append(buffer, to_chars(buffer, buffer + sizeof buffer, number).ptr - buffer);
+}
+
+static void append_cards(string &text, const vector<Card> &cards) {
+    char buffer[4];
+    for (const Card &card : cards) text.append(buffer, card_to_chars(card, buffer));
+}
+
+void frame_to_text(string_view frame, string &text) {
+    static thread_local Message message;
+    if (!decode_frame(frame, message)) {
+        text += "?";
+        return;
+    }
+    switch (message.kind) {
+        case MESSAGE_BUSY:
+            text += "BUSY";
+            text += message.places;
+            break;
+        case MESSAGE_SEAT:
+            text += "SEAT";
+            text += message.place;
+            if (message.token != 0) text += to_string(message.token);
+            break;
+        case MESSAGE_DEAL:
+            text += "DEAL";
+            append_number(text, message.type);
+            text += message.place;
+            append_cards(text, message.cards);
+            break;
+        case MESSAGE_TRICK:
+        case MESSAGE_TAKEN:
+            text += message.kind == MESSAGE_TRICK ? "TRICK" : "TAKEN";
+            append_number(text, message.number);
+            append_cards(text, message.cards);
+            if (message.kind == MESSAGE_TAKEN) text += message.place;
+            break;
+        case MESSAGE_WRONG:
+            text += "WRONG";
+            append_number(text, message.number);
+            break;
+        case MESSAGE_SCORE:
+        case MESSAGE_TOTAL:
+            text += message.kind == MESSAGE_SCORE ? "SCORE" : "TOTAL";
+            for (int i = 0; i < 4; i++) {
+                text += places[i];
+                append_number(text, message.scores[i]);
+            }
+            break;
+    }
+}
@@ -0,0 +1,73 @@
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.h"
+
+#ifndef MIM_PROTOCOL_H
+#define MIM_PROTOCOL_H
+
+// Compact binary framing, negotiated by the client with IAM<place>B.
+// A frame is a length byte (counting the type and payload), a type byte
+// and the payload. Cards are 6-bit ids, hands are 52-bit masks, scores
+// are 32-bit little endian numbers in NESW order.
+#define FRAME_SIZE 32
+// Longest text line a client may send without its CRLF, its longest
+// valid message (TRICK13 with a ten) is a fraction of it.
+#define LINE_LIMIT 64
+// Longest player name a client may give in IAM, which then still fits in
+// LINE_LIMIT with a seat token.
+#define NAME_LIMIT 32
+
+enum MessageKind {
+    MESSAGE_NONE,
+    MESSAGE_BUSY,
+    MESSAGE_SEAT,
+    MESSAGE_DEAL,
+    MESSAGE_TRICK,
+    MESSAGE_WRONG,
+    MESSAGE_TAKEN,
+    MESSAGE_SCORE,
+    MESSAGE_TOTAL
+};
+
+// A server message decoded from either encoding.
+struct Message {
+    int kind = MESSAGE_NONE;
+    int number = 0;
+    int type = 0;
+    // SEAT place, DEAL starting player or TAKEN winner.
+    char place = 0;
+    // SEAT in lobby mode: named by IAM<place>[B]<token> to take the seat back, 0 when none.
+    uint64_t token = 0;
+    std::string places;
+    std::vector<Card> cards;
+    int scores[4] = {};
+};
+
+int card_id(Card card);
+Card id_to_card(int id);
+uint64_t cards_to_mask(const std::vector<Card> &cards);
+void mask_to_cards(uint64_t mask, std::vector<Card> &cards);
+
+int encode_busy(char *output, const char *places, int count);
+int encode_seat(char *output, char place, uint64_t token);
+int encode_deal(char *output, int type, char starting_player, uint64_t hand);
+int encode_trick(char *output, int number, const Card *cards, int count);
+int encode_wrong(char *output, int number);
+int encode_taken(char *output, int number, const Card *cards, char winner);
+int encode_scores(char *output, int kind, const int *scores);
+
+bool extract_frame(std::string &buffer, std::string &frame);
+bool decode_frame(std::string_view frame, Message &message);
+bool parse_message(const std::string &text, Message &message);
+// IAM<place>, B for binary frames, then in lobby mode the seat token of a client coming back, or 0,
+// then optionally :<name>, empty when there is none.
+bool parse_iam(std::string_view text, bool &binary, uint64_t &token, std::string_view &name);
+// 1 to NAME_LIMIT letters, digits, '_', '-' and '.'.
+bool is_player_name(std::string_view name);
+// Appends the text form of a frame, as it would appear on a text connection.
+void frame_to_text(std::string_view frame, std::string &text);
+
+#endif
@@ -0,0 +1,267 @@
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "results.h"
+
+using namespace std;
+
+static uint64_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ull;
+    for (; *name != 0; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// The name as kept in a PlayerRecord, so that lookups of a long name find it again.
+static string stored_name(const string &name) {
+    if (name.size() < PLAYER_NAME_SIZE) return name;
+    char hash[18];
+    snprintf(hash, sizeof hash, "~%016lx", hash_name(name.c_str()));
+    return name.substr(0, PLAYER_NAME_SIZE - sizeof hash) + hash;
+}
+
+MappedFile::~MappedFile() {
+    if (this->data != nullptr) munmap(this->data, this->size);
+    if (this->fd != -1) close(this->fd);
+}
+
+void MappedFile::open(const string &path, uint32_t record_size, uint64_t capacity, bool writable) {
+    this->fd = ::open(path.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (this->fd < 0) syserr("cannot open %s", path.c_str());
+    this->record_size = record_size;
+    this->writable = writable;
+    struct stat info;
+    if (fstat(this->fd, &info) < 0) syserr("fstat");
+    bool created = info.st_size == 0;
+    if (created && !writable) fatal("Empty results file %s", path.c_str());
+    this->size = created ? sizeof(ResultsHeader) + capacity * record_size : info.st_size;
+    if (created && ftruncate(this->fd, this->size) < 0) syserr("ftruncate");
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *data = mmap(nullptr, this->size, protection, MAP_SHARED, this->fd, 0);
+    if (data == MAP_FAILED) syserr("mmap");
+    this->data = (char *)data;
+    ResultsHeader *header = this->header();
+    if (created) {
+        header->magic = RESULTS_MAGIC;
+        header->record_size = record_size;
+        header->capacity = capacity;
+    }
+    if (header->magic != RESULTS_MAGIC || header->record_size != record_size) {
+        fatal("Incompatible results file %s", path.c_str());
+    }
+    this->mapped = (this->size - sizeof(ResultsHeader)) / record_size;
+}
+
+void MappedFile::grow(uint64_t capacity) {
+    size_t size = sizeof(ResultsHeader) + capacity * this->record_size;
+    if (ftruncate(this->fd, size) < 0) syserr("ftruncate");
+    void *data = mremap(this->data, this->size, size, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED) syserr("mremap");
+    this->data = (char *)data;
+    this->size = size;
+    this->mapped = capacity;
+    this->header()->capacity = capacity;
+}
+
+void ResultsStore::open(const string &path, bool writable) {
+    this->log.open(path + ".log", sizeof(ResultRecord), RESULTS_GROW, writable);
+    this->players.open(path + ".players", sizeof(PlayerRecord), RESULTS_GROW / 16, writable);
+    this->index.open(path + ".index", sizeof(uint32_t), INDEX_INITIAL_SLOTS, writable);
+    if (this->index.header()->next == 0 && writable) this->index.header()->next = INDEX_INITIAL_SLOTS;
+}
+
+int64_t ResultsStore::find_player(const string &full_name) const {
+    string name = stored_name(full_name);
+    uint64_t slots = this->index.header()->next;
+    if (slots > 0 && slots <= this->index.mapped_records()) {
+        uint32_t *slot = (uint32_t *)this->index.record(0);
+        uint64_t i = hash_name(name.c_str()) & (slots - 1);
+        for (uint64_t probes = 0; probes < slots && slot[i] != 0; probes++) {
+            if (slot[i] - 1 < this->player_count() && name == this->player_record(slot[i] - 1).name) return slot[i] - 1;
+            i = (i + 1) & (slots - 1);
+        }
+        if (this->index.writable_file()) return -1;
+    }
+    //A reader can race with a rehash, fall back to a scan
+    for (uint64_t i = 0; i < this->player_count(); i++) {
+        if (name == this->player_record(i).name) return i;
+    }
+    return -1;
+}
+
+uint32_t ResultsStore::player(const string &name, uint32_t flags) {
+    int64_t found = this->find_player(name);
+    if (found != -1) return found;
+    ResultsHeader *header = this->players.header();
+    if (header->count == header->capacity) this->players.grow(header->capacity * 2);
+    header = this->players.header();
+    uint32_t id = header->count;
+    PlayerRecord &player = *(PlayerRecord *)this->players.record(id);
+    memset(&player, 0, sizeof player);
+    snprintf(player.name, PLAYER_NAME_SIZE, "%s", stored_name(name).c_str());
+    player.best = INT32_MAX;
+    player.flags = flags;
+    __atomic_store_n(&header->count, id + 1, __ATOMIC_RELEASE);
+    if ((this->index.header()->count + 1) * 2 > this->index.header()->next) this->rehash();
+    this->insert(id);
+    return id;
+}
+
+void ResultsStore::insert(uint32_t id) {
+    ResultsHeader *header = this->index.header();
+    uint32_t *slot = (uint32_t *)this->index.record(0);
+    uint64_t i = hash_name(this->player_record(id).name) & (header->next - 1);
+    while (slot[i] != 0) i = (i + 1) & (header->next - 1);
+    slot[i] = id + 1;
+    header->count++;
+}
+
+void ResultsStore::rehash() {
+    uint64_t slots = this->index.header()->next * 2;
+    this->index.grow(slots);
+    ResultsHeader *header = this->index.header();
+    memset(this->index.record(0), 0, slots * sizeof(uint32_t));
+    header->count = 0;
+    header->next = slots;
+    for (uint64_t i = 0; i < this->player_count(); i++) this->insert(i);
+}
+
+uint64_t ResultsStore::new_game() {
+    return this->log.header()->next++;
+}
+
+void ResultsStore::append(ResultRecord &record) {
+    ResultsHeader *header = this->log.header();
+    if (header->count == header->capacity) this->log.grow(header->capacity * 2);
+    header = this->log.header();
+    uint64_t position = header->count;
+    //A name at two seats (bots) is chained and counted through its first seat only
+    bool repeated[4] = {};
+    for (int i = 0; i < 4; i++) {
+        record.prev[i] = 0;
+        for (int j = 0; j < i; j++) repeated[i] |= record.players[j] == record.players[i];
+        if (repeated[i]) continue;
+        PlayerRecord &player = *(PlayerRecord *)this->players.record(record.players[i]);
+        record.prev[i] = player.last;
+        player.last = position + 1;
+    }
+    memcpy(this->log.record(position), &record, sizeof record);
+    __atomic_store_n(&header->count, position + 1, __ATOMIC_RELEASE);
+    if (record.kind != RESULT_GAME) return;
+    for (int i = 0; i < 4; i++) {
+        if (repeated[i]) continue;
+        PlayerRecord &player = *(PlayerRecord *)this->players.record(record.players[i]);
+        player.games++;
+        player.points += record.scores[i];
+        player.best = min(player.best, record.scores[i]);
+    }
+}
+
+uint64_t ResultsStore::record_count() const {
+    return min(__atomic_load_n(&this->log.header()->count, __ATOMIC_ACQUIRE), this->log.mapped_records());
+}
+
+uint64_t ResultsStore::player_count() const {
+    return min(__atomic_load_n(&this->players.header()->count, __ATOMIC_ACQUIRE), this->players.mapped_records());
+}
+
+void ResultsStore::leaderboard(int count, uint64_t min_games, vector<uint32_t> &result) const {
+    result.clear();
+    for (uint64_t i = 0; i < this->player_count(); i++) {
+        const PlayerRecord &player = this->player_record(i);
+        if (player.flags & PLAYER_NO_CLIENT) continue;
+        if (player.games >= max(min_games, (uint64_t)1)) result.push_back(i);
+    }
+    auto average = [&](uint32_t i) {
+        const PlayerRecord &player = this->player_record(i);
+        return (double)player.points / player.games;
+    };
+    size_t top = min(result.size(), (size_t)count);
+    partial_sort(result.begin(), result.begin() + top, result.end(), [&](uint32_t a, uint32_t b) {
+        return average(a) < average(b);
+    });
+    result.resize(top);
+}
+
+void ResultsStore::history(uint32_t player, int count, bool games_only, vector<uint64_t> &result) const {
+    result.clear();
+    uint64_t next = this->player_record(player).last;
+    while (next != 0 && next <= this->record_count() && (int)result.size() < count) {
+        const ResultRecord &record = this->record(next - 1);
+        if (!games_only || record.kind == RESULT_GAME) result.push_back(next - 1);
+        int seat = 0;
+        while (seat < 3 && record.players[seat] != player) seat++;
+        next = record.prev[seat];
+    }
+}
+
+ResultsWriter::~ResultsWriter() {
+    if (!this->running) return;
+    {
+        lock_guard<mutex> lock(this->queue_lock);
+        this->stopping = true;
+    }
+    this->ready.notify_one();
+    this->thread.join();
+}
+
+void ResultsWriter::open(const string &path) {
+    this->store.open(path, true);
+    this->running = true;
+    this->thread = std::thread(&ResultsWriter::run, this);
+}
+
+void ResultsWriter::push(ResultEvent &event) {
+    {
+        lock_guard<mutex> lock(this->queue_lock);
+        this->queue.push_back(std::move(event));
+    }
+    this->ready.notify_one();
+}
+
+void ResultsWriter::run() {
+    vector<ResultEvent> events;
+    while (true) {
+        {
+            unique_lock<mutex> lock(this->queue_lock);
+            this->ready.wait(lock, [&] { return this->stopping || !this->queue.empty(); });
+            if (this->queue.empty()) return;
+            swap(events, this->queue);
+        }
+        for (ResultEvent &event : events) this->write(event);
+        events.clear();
+    }
+}
+
+void ResultsWriter::write(ResultEvent &event) {
+    auto game = this->games.find(event.table);
+    if (game == this->games.end()) game = this->games.emplace(event.table, this->store.new_game()).first;
+    ResultRecord record;
+    memset(&record, 0, sizeof record);
+    record.kind = event.kind;
+    record.deal = event.deal;
+    record.game = game->second;
+    record.time = event.time;
+    for (int i = 0; i < 4; i++) {
+        //A given name is the same player in every game, a connection only in this one. Seats with no
+        //client are in parentheses, which no given name has.
+        string name = event.players[i];
+        if (event.no_client[i]) name = "(" + name + ")";
+        else if (!event.named[i]) name += "#" + to_string(game->second);
+        record.players[i] = this->store.player(name, event.no_client[i] ? PLAYER_NO_CLIENT : 0);
+        record.scores[i] = event.scores[i];
+        record.totals[i] = event.totals[i];
+    }
+    this->store.append(record);
+    if (event.kind == RESULT_GAME) this->games.erase(game);
+}
@@ -0,0 +1,144 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifndef MIM_RESULTS_H
+#define MIM_RESULTS_H
+
+// A results store is three memory-mapped files next to each other:
+//   <path>.log      append-only ResultRecords, one per finished deal and game
+//   <path>.players  PlayerRecords with running aggregates for the leaderboard
+//   <path>.index    open-addressing hash of player names into .players
+// Records are written before the count in the header is advanced, so a
+// reader never sees a partial record.
+#define RESULTS_MAGIC        0x4b524c31
+#define RESULTS_GROW         65536
+// A longer name is kept as its start and a hash of the whole of it.
+#define PLAYER_NAME_SIZE     48
+#define INDEX_INITIAL_SLOTS  1024
+
+#define RESULT_ROUND  1
+#define RESULT_GAME   2
+
+// PlayerRecord flags. A seat with no client, played by the server's bot or
+// left empty, is recorded for the history but left out of the leaderboard.
+#define PLAYER_NO_CLIENT  1
+
+struct ResultsHeader {
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t capacity;
+    // Next game id in the .log header, number of slots in the .index header.
+    uint64_t next;
+};
+
+struct ResultRecord {
+    uint32_t kind;
+    // Deal index in the deal file, number of deals for RESULT_GAME.
+    uint32_t deal;
+    uint64_t game;
+    int64_t time;
+    uint32_t players[4];
+    // SCORE of the deal, or final TOTAL for RESULT_GAME.
+    int32_t scores[4];
+    int32_t totals[4];
+    // Previous record of the player at each seat plus one, 0 ends the chain.
+    uint64_t prev[4];
+};
+
+struct PlayerRecord {
+    char name[PLAYER_NAME_SIZE];
+    uint64_t games;
+    int64_t points;
+    int32_t best;
+    uint32_t flags;
+    // Last record of the player plus one.
+    uint64_t last;
+};
+
+// One shared mapping of a header followed by fixed-size records.
+class MappedFile {
+public:
+    ~MappedFile();
+    void open(const std::string &path, uint32_t record_size, uint64_t capacity, bool writable);
+    void grow(uint64_t capacity);
+    ResultsHeader *header() const { return (ResultsHeader *)this->data; }
+    char *record(uint64_t i) const { return this->data + sizeof(ResultsHeader) + i * this->record_size; }
+    uint64_t mapped_records() const { return this->mapped; }
+    bool writable_file() const { return this->writable; }
+private:
+    int fd = -1;
+    char *data = nullptr;
+    size_t size = 0;
+    uint32_t record_size = 0;
+    uint64_t mapped = 0;
+    bool writable = false;
+};
+
+class ResultsStore {
+public:
+    void open(const std::string &path, bool writable);
+    // Id of the player with that name, created with the flags when writing.
+    uint32_t player(const std::string &name, uint32_t flags = 0);
+    // Returns -1 when there is no such player.
+    int64_t find_player(const std::string &name) const;
+    uint64_t new_game();
+    void append(ResultRecord &record);
+    uint64_t record_count() const;
+    uint64_t player_count() const;
+    const ResultRecord &record(uint64_t i) const { return *(ResultRecord *)this->log.record(i); }
+    const PlayerRecord &player_record(uint64_t i) const { return *(PlayerRecord *)this->players.record(i); }
+    // Best players by average total, lower is better in hearts.
+    void leaderboard(int count, uint64_t min_games, std::vector<uint32_t> &result) const;
+    // Last records of a player, newest first.
+    void history(uint32_t player, int count, bool games_only, std::vector<uint64_t> &result) const;
+private:
+    MappedFile log;
+    MappedFile players;
+    MappedFile index;
+    void insert(uint32_t id);
+    void rehash();
+};
+
+// A finished deal or game as seen by the server.
+struct ResultEvent {
+    int kind;
+    int table;
+    int deal;
+    int64_t time;
+    // Name the client at each seat gave, or the address and port it took the seat from,
+    // or the name of a seat with no client.
+    std::string players[4];
+    bool no_client[4];
+    bool named[4];
+    int scores[4];
+    int totals[4];
+};
+
+// Appends events on its own thread, so the game loop only takes a mutex.
+class ResultsWriter {
+public:
+    ~ResultsWriter();
+    void open(const std::string &path);
+    bool enabled() const { return this->running; }
+    void push(ResultEvent &event);
+private:
+    ResultsStore store;
+    std::thread thread;
+    std::mutex queue_lock;
+    std::condition_variable ready;
+    std::vector<ResultEvent> queue;
+    bool running = false;
+    bool stopping = false;
+    // Game id of each table's game in progress.
+    std::unordered_map<int, uint64_t> games;
+    void run();
+    void write(ResultEvent &event);
+};
+
+#endif
@@ -0,0 +1,44 @@
+#include <atomic>
+#include <cstddef>
+
+#ifndef MIM_RING_H
+#define MIM_RING_H
+
+// Bounded lock-free queue for exactly one producer and one consumer
+// thread. Size must be a power of two.
+template <typename T, size_t Size>
+class SpscRing {
+public:
+    bool push(const T &item) {
+        size_t tail = this->tail.load(std::memory_order_relaxed);
+        if (tail - this->head_cache == Size) {
+            this->head_cache = this->head.load(std::memory_order_acquire);
+            if (tail - this->head_cache == Size) return false;
+        }
+        this->items[tail & (Size - 1)] = item;
+        this->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        size_t head = this->head.load(std::memory_order_relaxed);
+        if (head == this->tail_cache) {
+            this->tail_cache = this->tail.load(std::memory_order_acquire);
+            if (head == this->tail_cache) return false;
+        }
+        item = this->items[head & (Size - 1)];
+        this->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static_assert((Size & (Size - 1)) == 0, "ring size must be a power of two");
+    T items[Size];
+    // Each index is written by one side only, the caches save reloading the other one.
+    alignas(64) std::atomic<size_t> head = 0;
+    size_t tail_cache = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+    size_t head_cache = 0;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include <cstring>
+#include <algorithm>
+
+#include "slab.h"
+
+using namespace std;
+
+char *SlabPool::allocate(int size_class) {
+    vector<char *> &free_chunks = this->free_chunks[size_class];
+    if (free_chunks.empty()) {
+        size_t size = chunk_size(size_class);
+        size_t slab_size = max(size, (size_t)SLAB_SIZE);
+        this->slabs.emplace_back(new char[slab_size]);
+        char *slab = this->slabs.back().get();
+        //Handed out from the start of the slab, so untouched pages stay unmapped
+        for (size_t offset = slab_size; offset > 0; offset -= size) free_chunks.push_back(slab + offset - size);
+    }
+    char *chunk = free_chunks.back();
+    free_chunks.pop_back();
+    return chunk;
+}
+
+void SlabPool::release(char *chunk, int size_class) {
+    this->free_chunks[size_class].push_back(chunk);
+}
+
+bool SlabBuffer::append(SlabPool &pool, string_view data) {
+    if (data.empty()) return true;
+    size_t size = this->size();
+    size_t needed = size + data.size();
+    if (this->chunk == nullptr || this->end + data.size() > SlabPool::chunk_size(this->size_class)) {
+        if (this->chunk != nullptr && needed <= SlabPool::chunk_size(this->size_class)) {
+            //Enough room once the consumed front is dropped
+            memmove(this->chunk, this->chunk + this->start, size);
+        }
+        else {
+            int size_class = 0;
+            while (size_class < SLAB_CLASSES && SlabPool::chunk_size(size_class) < needed) size_class++;
+            if (size_class == SLAB_CLASSES) return false;
+            char *chunk = pool.allocate(size_class);
+            if (this->chunk != nullptr) {
+                memcpy(chunk, this->chunk + this->start, size);
+                pool.release(this->chunk, this->size_class);
+            }
+            this->chunk = chunk;
+            this->size_class = size_class;
+        }
+        this->start = 0;
+        this->end = size;
+    }
+    memcpy(this->chunk + this->end, data.data(), data.size());
+    this->end += data.size();
+    return true;
+}
+
+void SlabBuffer::consume(SlabPool &pool, size_t size) {
+    this->start += size;
+    if (this->start == this->end) this->clear(pool);
+}
+
+void SlabBuffer::clear(SlabPool &pool) {
+    if (this->chunk != nullptr) pool.release(this->chunk, this->size_class);
+    this->chunk = nullptr;
+    this->start = 0;
+    this->end = 0;
+}
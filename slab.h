@@ -0,0 +1,47 @@
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#ifndef MIM_SLAB_H
+#define MIM_SLAB_H
+
+// Chunk sizes are powers of two from 64 B to 256 kB, every size class is
+// carved out of slabs of at least SLAB_SIZE bytes. Chunks are reused and
+// never given back to the system.
+#define SLAB_MIN_SHIFT 6
+#define SLAB_CLASSES   13
+#define SLAB_SIZE      65536
+
+class SlabPool {
+public:
+    char *allocate(int size_class);
+    void release(char *chunk, int size_class);
+    static size_t chunk_size(int size_class) { return (size_t)1 << (SLAB_MIN_SHIFT + size_class); }
+private:
+    std::vector<char *> free_chunks[SLAB_CLASSES];
+    std::vector<std::unique_ptr<char[]>> slabs;
+};
+
+// Byte queue which holds no memory while empty: appends go to the end,
+// consume drops bytes from the front and gives the chunk back once the
+// queue is drained. The pool is passed in, so a buffer is 16 bytes.
+class SlabBuffer {
+public:
+    const char *data() const { return this->chunk + this->start; }
+    size_t size() const { return this->end - this->start; }
+    bool empty() const { return this->start == this->end; }
+    std::string_view view() const { return std::string_view(this->data(), this->size()); }
+    // Returns false when the queue would outgrow the largest chunk.
+    bool append(SlabPool &pool, std::string_view data);
+    void consume(SlabPool &pool, size_t size);
+    void clear(SlabPool &pool);
+private:
+    char *chunk = nullptr;
+    uint32_t start = 0;
+    uint32_t end : 24 = 0;
+    uint32_t size_class : 8 = 0;
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "common.h"
+#include "err.h"
+#include "handoff.h"
+#include "supervisor.h"
+
+// A worker failing sooner than this after its start is not started again.
+#define MIN_UPTIME 1000
+
+using namespace std;
+
+Supervisor::Supervisor(const vector<int> &listeners, const vector<string> &arguments, int workers, const string &unix_path) {
+    this->listeners = listeners;
+    this->arguments = arguments;
+    this->unix_path = unix_path;
+    this->workers.resize(workers);
+    //Workers get the listeners over their channel, not by inheriting them
+    for (int fd : this->listeners) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    sigemptyset(&this->signals);
+    sigaddset(&this->signals, SIGHUP);
+    sigaddset(&this->signals, SIGCHLD);
+    sigaddset(&this->signals, SIGTERM);
+    sigaddset(&this->signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &this->signals, &this->original_mask);
+}
+
+void Supervisor::run() {
+    for (int i = 0; i < (int)this->workers.size(); i++) this->start(i);
+    while (!this->finished()) {
+        int signal_number = sigwaitinfo(&this->signals, nullptr);
+        if (signal_number < 0) {
+            if (errno == EINTR) continue;
+            syserr("sigwaitinfo");
+        }
+        if (signal_number == SIGCHLD) this->reap();
+        else if (signal_number == SIGHUP) {
+            for (int i = 0; i < (int)this->workers.size(); i++) this->upgrade(i);
+        }
+        else break;
+    }
+    for (Worker &worker : this->workers) {
+        if (worker.pid != -1) kill(worker.pid, SIGTERM);
+        if (worker.next_pid != -1) kill(worker.next_pid, SIGTERM);
+    }
+    while (wait(nullptr) > 0) {}
+    for (int fd : this->listeners) close(fd);
+    if (this->unix_path != "") unlink(this->unix_path.c_str());
+}
+
+pid_t Supervisor::spawn(int &control) {
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) < 0) syserr("socketpair");
+    pid_t pid = fork();
+    if (pid < 0) syserr("fork");
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &this->original_mask, nullptr);
+        fcntl(channel[1], F_SETFD, 0);
+        vector<string> arguments = this->arguments;
+        arguments.push_back("-W");
+        arguments.push_back(to_string(channel[1]));
+        vector<char *> argv;
+        for (string &argument : arguments) argv.push_back(argument.data());
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        syserr("exec %s", argv[0]);
+    }
+    close(channel[1]);
+    control = channel[0];
+    return pid;
+}
+
+void Supervisor::start(int i) {
+    Worker &worker = this->workers[i];
+    worker.pid = this->spawn(worker.control);
+    worker.started = monotonic_ms();
+    //A worker which dies right away is noticed through SIGCHLD
+    send_handoff(worker.control, this->listeners, "");
+}
+
+void Supervisor::upgrade(int i) {
+    Worker &worker = this->workers[i];
+    if (worker.finished || worker.next_pid != -1) return;
+    worker.next_pid = this->spawn(worker.next_control);
+    //The old worker writes its state straight into the new worker's channel and waits there for the answer
+    send_command(worker.control, COMMAND_UPGRADE, worker.next_control);
+}
+
+void Supervisor::reap() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < (int)this->workers.size(); i++) {
+            Worker &worker = this->workers[i];
+            if (pid == worker.next_pid) {
+                //The old worker gets no answer and keeps its games
+                cerr << "worker " << i << ": upgrade failed" << endl;
+                close(worker.next_control);
+                worker.next_pid = -1;
+                worker.next_control = -1;
+            }
+            if (pid != worker.pid) continue;
+            close(worker.control);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == HANDOFF_EXIT && worker.next_pid != -1) {
+                cerr << "worker " << i << ": upgraded to pid " << worker.next_pid << endl;
+                worker.pid = worker.next_pid;
+                worker.control = worker.next_control;
+                worker.started = monotonic_ms();
+                worker.next_pid = -1;
+                worker.next_control = -1;
+                continue;
+            }
+            //Nobody is going to send the new worker a state
+            if (worker.next_pid != -1) {
+                kill(worker.next_pid, SIGTERM);
+                close(worker.next_control);
+                worker.next_pid = -1;
+                worker.next_control = -1;
+            }
+            worker.pid = -1;
+            worker.control = -1;
+            bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+            if (failed && monotonic_ms() - worker.started >= MIN_UPTIME) {
+                cerr << "worker " << i << ": died, starting it again" << endl;
+                this->start(i);
+            }
+            else {
+                if (failed) cerr << "worker " << i << ": failed on start" << endl;
+                worker.finished = true;
+            }
+        }
+    }
+}
+
+bool Supervisor::finished() {
+    for (Worker &worker : this->workers) {
+        if (!worker.finished) return false;
+    }
+    return true;
+}
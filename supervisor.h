@@ -0,0 +1,44 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <sys/types.h>
+
+#ifndef MIM_SUPERVISOR_H
+#define MIM_SUPERVISOR_H
+
+struct Worker {
+    pid_t pid = -1;
+    int control = -1;
+    // Started by an upgrade, takes over when the old process exits with HANDOFF_EXIT.
+    pid_t next_pid = -1;
+    int next_control = -1;
+    int64_t started = 0;
+    bool finished = false;
+};
+
+// Owns the listening sockets and keeps a number of worker processes
+// running them. SIGHUP starts the binary again for every worker and
+// moves the worker's connections and games over to the new process.
+class Supervisor {
+public:
+    // arguments start with the binary, a worker gets them with -W <fd> appended.
+    Supervisor(const std::vector<int> &listeners, const std::vector<std::string> &arguments, int workers,
+               const std::string &unix_path);
+    void run();
+private:
+    std::vector<int> listeners;
+    std::vector<std::string> arguments;
+    std::string unix_path;
+    std::vector<Worker> workers;
+    sigset_t signals;
+    sigset_t original_mask;
+    pid_t spawn(int &control);
+    void start(int i);
+    void upgrade(int i);
+    void reap();
+    bool finished();
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "err.h"
+#include "trace.h"
+
+using namespace std;
+
+static const char *seat_names[4] = {"N", "E", "S", "W"};
+
+static const char *trace_names[TRACE_NAMES] = {
+    "poll", "read", "handle_messages", "TRICK sent", "TRICK received", "waiting for card", "TAKEN", "write"
+};
+
+Trace::~Trace() {
+    if (this->file == nullptr) return;
+    {
+        lock_guard<mutex> lock(this->pending_lock);
+        this->stopping = true;
+    }
+    this->ready.notify_one();
+    this->thread.join();
+    this->write(this->events);
+    fclose(this->file);
+}
+
+void Trace::open(const char *path) {
+    this->file = fopen(path, "w");
+    if (this->file == nullptr) syserr("cannot open trace file %s", path);
+    this->events.reserve(TRACE_BUFFER);
+    this->pending.reserve(TRACE_BUFFER);
+    fprintf(this->file, "[\n");
+    fprintf(this->file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"server\"}},\n");
+    this->thread = std::thread(&Trace::run, this);
+}
+
+int64_t Trace::now() {
+    auto now = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::microseconds>(now.time_since_epoch()).count();
+}
+
+int64_t Trace::start() const {
+    return this->file != nullptr ? Trace::now() : 0;
+}
+
+void Trace::span(int name, int64_t start, int table, int seat) {
+    if (this->file == nullptr) return;
+    this->add(name, start, Trace::now() - start, table, seat);
+}
+
+void Trace::instant(int name, int table, int seat) {
+    if (this->file == nullptr) return;
+    this->add(name, Trace::now(), -1, table, seat);
+}
+
+void Trace::add(int name, int64_t start, int64_t duration, int table, int seat) {
+    if (this->events.size() == TRACE_BUFFER && !this->hand_off()) {
+        this->dropped_events++;
+        return;
+    }
+    this->events.push_back({start, duration, (int16_t)name, (int16_t)seat, table});
+}
+
+void Trace::name_table(int table) {
+    if (table < (int)this->named.size() && this->named[table]) return;
+    if (table >= (int)this->named.size()) this->named.resize(table + 1);
+    this->named[table] = true;
+    fprintf(this->file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"table %d\"}},\n", table + 1, table);
+    for (int seat = 0; seat < 5; seat++) {
+        fprintf(this->file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                table + 1, seat, seat < 4 ? seat_names[seat] : "table");
+    }
+}
+
+void Trace::flush() {
+    if (this->file == nullptr || this->events.empty()) return;
+    this->hand_off();
+}
+
+bool Trace::hand_off() {
+    {
+        lock_guard<mutex> lock(this->pending_lock);
+        if (!this->pending.empty()) return false;
+        //Both buffers keep their capacity, so the game loop never allocates here
+        swap(this->pending, this->events);
+    }
+    this->ready.notify_one();
+    return true;
+}
+
+void Trace::run() {
+    vector<TraceEvent> events;
+    events.reserve(TRACE_BUFFER);
+    while (true) {
+        {
+            unique_lock<mutex> lock(this->pending_lock);
+            this->ready.wait(lock, [&] { return this->stopping || !this->pending.empty(); });
+            if (this->pending.empty()) return;
+            swap(events, this->pending);
+        }
+        this->write(events);
+        events.clear();
+    }
+}
+
+void Trace::write(const vector<TraceEvent> &events) {
+    for (const TraceEvent &event : events) {
+        if (event.table >= 0) this->name_table(event.table);
+        int pid = event.table + 1;
+        int tid = event.seat == -1 ? 4 : event.seat;
+        if (event.table < 0) tid = 0;
+        if (event.duration < 0) {
+            fprintf(this->file, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%ld,\"pid\":%d,\"tid\":%d},\n",
+                    trace_names[event.name], event.start, pid, tid);
+        }
+        else {
+            fprintf(this->file, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%d},\n",
+                    trace_names[event.name], event.start, event.duration, pid, tid);
+        }
+    }
+    fflush(this->file);
+}
@@ -0,0 +1,69 @@
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef MIM_TRACE_H
+#define MIM_TRACE_H
+
+// Events are kept in a preallocated buffer and, whenever it fills up, handed
+// to a writer thread which writes them out as Chrome trace-event JSON (JSON
+// array format). Events that come while the writer still has a full buffer
+// are dropped and counted.
+#define TRACE_BUFFER 65536
+
+enum TraceName {
+    TRACE_POLL,
+    TRACE_READ,
+    TRACE_HANDLE,
+    TRACE_TRICK_SENT,
+    TRACE_TRICK_RECEIVED,
+    TRACE_WAIT,
+    TRACE_TAKEN,
+    TRACE_WRITE,
+    TRACE_NAMES
+};
+
+struct TraceEvent {
+    int64_t start;
+    int64_t duration;
+    int16_t name;
+    int16_t seat;
+    int32_t table;
+};
+
+class Trace {
+public:
+    ~Trace();
+    void open(const char *path);
+    bool enabled() const { return this->file != nullptr; }
+    static int64_t now();
+    // Start time for a span, free when tracing is off.
+    int64_t start() const;
+    // Events are grouped by table (-1 for the server itself) and seat (-1 for the whole table).
+    void span(int name, int64_t start, int table, int seat);
+    void instant(int name, int table, int seat);
+    // Hands the events so far to the writer, unless it is busy.
+    void flush();
+    uint64_t dropped() const { return this->dropped_events; }
+private:
+    FILE *file = nullptr;
+    std::vector<TraceEvent> events;
+    // Written by the thread, empty when the writer can take more.
+    std::vector<TraceEvent> pending;
+    std::vector<bool> named;
+    uint64_t dropped_events = 0;
+    std::thread thread;
+    std::mutex pending_lock;
+    std::condition_variable ready;
+    bool stopping = false;
+    void add(int name, int64_t start, int64_t duration, int table, int seat);
+    bool hand_off();
+    void run();
+    void write(const std::vector<TraceEvent> &events);
+    void name_table(int table);
+};
+
+#endif
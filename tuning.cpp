@@ -0,0 +1,91 @@
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "tuning.h"
+
+using namespace std;
+
+Tuning tuning;
+
+static int64_t now_us() {
+    auto now = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::microseconds>(now.time_since_epoch()).count();
+}
+
+vector<int> parse_cores(const string &list) {
+    vector<int> cores;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos) end = list.size();
+        string core = list.substr(start, end - start);
+        if (core.empty() || core.find_first_not_of("0123456789") != string::npos || core.size() > 4) {
+            fatal("Incorrect core list %s", list.c_str());
+        }
+        cores.push_back(stoi(core));
+        start = end + 1;
+    }
+    return cores;
+}
+
+void pin_thread(int loop) {
+    if (loop >= (int)tuning.cores.size()) return;
+    int core = tuning.cores[loop];
+    if (core >= CPU_SETSIZE) fatal("No core %d", core);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (error != 0) fatal("Cannot pin to core %d", core);
+}
+
+void prefault_memory() {
+    if (tuning.spin < 0) return;
+    //Freed heap is kept rather than given back, what was touched stays mapped
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_THRESHOLD, PREFAULT_HEAP + 1);
+    long page = sysconf(_SC_PAGESIZE);
+    char *heap = (char *)malloc(PREFAULT_HEAP);
+    if (heap == nullptr) fatal("Cannot prefault the heap");
+    for (long i = 0; i < PREFAULT_HEAP; i += page) ((volatile char *)heap)[i] = 0;
+    free(heap);
+    char stack[PREFAULT_STACK];
+    volatile char *touch = stack;
+    for (long i = 0; i < PREFAULT_STACK; i += page) touch[i] = 0;
+    //Without the privilege or the limit it stays a prefault, not worth failing over
+    mlockall(MCL_CURRENT);
+}
+
+void tune_socket(int fd) {
+    //A TAKEN and the next TRICK must not wait for the ACK of the previous message
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    if (tuning.spin > 0) setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &tuning.spin, sizeof tuning.spin);
+}
+
+int spin_poll(pollfd *fds, nfds_t count, int timeout) {
+    if (tuning.spin <= 0 || timeout == 0) return poll(fds, count, timeout);
+    int64_t start = now_us();
+    int64_t spin = tuning.spin;
+    if (timeout > 0) spin = min(spin, (int64_t)timeout * 1000);
+    int64_t elapsed = 0;
+    while (elapsed < spin) {
+        int ready = poll(fds, count, 0);
+        if (ready != 0) return ready;
+        elapsed = now_us() - start;
+    }
+    if (timeout < 0) return poll(fds, count, -1);
+    return poll(fds, count, max(0, timeout - (int)(elapsed / 1000)));
+}
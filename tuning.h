@@ -0,0 +1,37 @@
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+#ifndef MIM_TUNING_H
+#define MIM_TUNING_H
+
+// Heap and stack touched at startup in low-latency mode, so the buffers
+// of the first games do not take page faults.
+#define PREFAULT_HEAP   (16 << 20)
+#define PREFAULT_STACK  (256 << 10)
+
+// Low-latency mode of an event loop, -y and -c of the server and the
+// client. Off by default; a loop which has no core of its own runs
+// wherever the scheduler puts it.
+struct Tuning {
+    // Microseconds a poll busy-waits before it blocks, -1 when the mode is off.
+    int spin = -1;
+    // Cores of the event loops, the game loop first and the I/O thread second.
+    std::vector<int> cores;
+};
+
+extern Tuning tuning;
+
+// Comma-separated core numbers.
+std::vector<int> parse_cores(const std::string &list);
+// Pins the calling thread to tuning.cores[loop], if there is such a core.
+void pin_thread(int loop);
+// Touches and locks memory ahead of the loop, when the mode is on.
+void prefault_memory();
+// TCP_NODELAY always, SO_BUSY_POLL in low-latency mode. Harmless on Unix sockets.
+void tune_socket(int fd);
+// poll, after up to tuning.spin microseconds of polling without blocking.
+int spin_poll(pollfd *fds, nfds_t count, int timeout);
+
+#endif